@@ -0,0 +1,231 @@
+// Little program to benchmark queries on a synthetic database.
+// Compile with "make bench-query" and then run it with the number of
+// images (default 100000), queries (default 200), a comma separated list
+// of modes (default normal,readonly,simple, sharded ones like simple:4
+// work too), query threads (default 1), query flags (default 0, e.g. 64
+// to compare with flag_prune), pages for the buckets and scores (normal,
+// transparent or reserved, default transparent) and whether to copy the
+// buckets to each NUMA node (default 0). With
+// flag_rerank (128), it also prints how many of the best and of all 16
+// results of scoring every image the queries found, as recall_1 and
+// recall_16.
+// It creates bench-query-<images>.idb with random signatures unless it
+// already exists, then loads it in each mode in a separate process.
+//
+// For each mode, one line is printed to stdout with space separated
+// key=value pairs, for instance to collect the results of several builds
+// (with or without USE_DELTA_QUEUE, USE_BLOCK_QUEUE or USE_DISK_CACHE) for comparison:
+// bench mode=simple build=delta_queue images=100000 queries=200 threads=1
+//       flags=0 pages=transparent replicas=0 load_ms=... p50_ms=...
+//       p99_ms=... qps=... rss_kb=...
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "imgdb.h"
+
+using namespace imgdb;
+
+int debug_level = DEBUG_errors;
+
+#if defined(USE_BLOCK_QUEUE)
+static const char* build = "block_queue";
+#elif defined(USE_DELTA_QUEUE)
+static const char* build = "delta_queue";
+#else
+static const char* build = "vector";
+#endif
+#ifdef USE_DISK_CACHE
+static const char* cache = "+disk_cache";
+#else
+static const char* cache = "";
+#endif
+
+static double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double uniform() { return (double) rand() / RAND_MAX; }
+
+// Like in real images, most of the largest coefficients are low frequencies.
+static void random_sig(imgdb::sig_t sig) {
+	for (int i = 0; i < NUM_COEFS; i++) {
+		Idx c;
+		do {
+			int row = NUM_PIXELS * pow(uniform(), 3), col = NUM_PIXELS * pow(uniform(), 3);
+			c = std::min(row, NUM_PIXELS - 1) * NUM_PIXELS + std::min(col, NUM_PIXELS - 1);
+			if (rand() & 1) c = -c;
+		} while (!c || std::find(sig, sig + i, c) != sig + i);
+		sig[i] = c;
+	}
+}
+
+// Seeded by the ID, so that the queries can be made from the same images.
+static void random_image(imageId id, ImgData* img) {
+	srand(id);
+	img->id = id;
+	random_sig(img->sig1);
+	random_sig(img->sig2);
+	random_sig(img->sig3);
+	img->avglf[0] = uniform();
+	img->avglf[1] = (uniform() - 0.5) * (rand() % 4 ? 0.2 : 0.002);
+	img->avglf[2] = (uniform() - 0.5) * (rand() % 4 ? 0.2 : 0.002);
+	img->width = 100 + rand() % 1000;
+	img->height = 100 + rand() % 1000;
+}
+
+// Queries are altered copies of some of the images, replacing a quarter of their coefficients.
+static void random_query(ImgData* img) {
+	Idx* sigs[3] = { img->sig1, img->sig2, img->sig3 };
+	for (int c = 0; c < 3; c++) {
+		imgdb::sig_t other;
+		random_sig(other);
+		for (int i = 0; i < NUM_COEFS / 4; i++) {
+			Idx* sig = sigs[c];
+			if (std::find(sig, sig + NUM_COEFS, other[i]) == sig + NUM_COEFS) sig[rand() % NUM_COEFS] = other[i];
+		}
+	}
+	img->avglf[0] += (uniform() - 0.5) * 0.02;
+}
+
+static void create_db(const char* fn, size_t images) {
+	fprintf(stderr, "Creating %s with %zd images...\n", fn, images);
+	double start = seconds();
+	std::string temp = std::string(fn) + ".tmp";
+	unlink(temp.c_str());
+	dbSpace* db = dbSpace::load_file(temp.c_str(), dbSpace::mode_alter);
+	for (size_t i = 0; i < images; i++) {
+		ImgData img;
+		random_image(i + 1, &img);
+		db->addImageData(&img);
+	}
+	db->save_file(temp.c_str());
+	delete db;
+	if (rename(temp.c_str(), fn)) throw io_error("Can't rename temp file.");
+	fprintf(stderr, "Took %.1f s.\n", seconds() - start);
+}
+
+static const char* page_names[] = { "normal", "transparent", "reserved" };
+
+static void run(const char* fn, const char* mode, size_t images, const std::vector<ImgData>& queries, int threads, int flags, int pages, bool replicas) {
+	dbSpace::setQueryThreads(threads);
+	dbSpace::setHugePages(pages);
+	dbSpace::setNumaReplicas(replicas);
+
+	double start = seconds();
+	dbSpace* db = dbSpace::load_file(fn, dbSpace::mode_from_name(mode));
+	double load = seconds() - start;
+
+	// Warm up the caches first.
+	for (size_t i = 0; i < std::min<size_t>(queries.size(), 5); i++)
+		db->queryImg(queryArg(queries[i], 16, flags));
+
+	std::vector<double> times;
+	start = seconds();
+	for (size_t i = 0; i < queries.size(); i++) {
+		double qstart = seconds();
+		db->queryImg(queryArg(queries[i], 16, flags));
+		times.push_back(seconds() - qstart);
+	}
+	double total = seconds() - start;
+	std::sort(times.begin(), times.end());
+
+	double recall_1 = 0, recall_16 = 0;
+	if (flags & dbSpace::flag_rerank) {
+		for (size_t i = 0; i < queries.size(); i++) {
+			sim_vector all = db->queryImg(queryArg(queries[i], 16, flags & ~dbSpace::flag_rerank));
+			sim_vector some = db->queryImg(queryArg(queries[i], 16, flags));
+			size_t found = 0;
+			for (sim_vector::const_iterator itr = all.begin(); itr != all.end(); ++itr)
+				for (sim_vector::const_iterator other = some.begin(); other != some.end(); ++other)
+					found += itr->id == other->id;
+			recall_1 += !all.empty() && !some.empty() && all.front().id == some.front().id;
+			recall_16 += all.empty() ? 1 : (double) found / all.size();
+		}
+		recall_1 /= queries.size();
+		recall_16 /= queries.size();
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("bench mode=%s build=%s%s images=%zd queries=%zd threads=%d flags=%d pages=%s replicas=%d load_ms=%.1f p50_ms=%.3f p99_ms=%.3f qps=%.1f rss_kb=%ld",
+		mode, build, cache, images, queries.size(), threads, flags, page_names[pages], replicas, load * 1000,
+		times[times.size() / 2] * 1000, times[std::min(times.size() - 1, times.size() * 99 / 100)] * 1000,
+		queries.size() / total, usage.ru_maxrss);
+	if (flags & dbSpace::flag_rerank)
+		printf(" recall_1=%.3f recall_16=%.3f", recall_1, recall_16);
+	printf("\n");
+	fflush(stdout);
+	delete db;
+}
+
+int main(int argc, char** argv) {
+	size_t images = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+	size_t num_queries = argc > 2 ? strtoul(argv[2], NULL, 0) : 200;
+	std::string modes = argc > 3 ? argv[3] : "normal,readonly,simple";
+	int threads = argc > 4 ? atoi(argv[4]) : 1;
+	int flags = argc > 5 ? strtol(argv[5], NULL, 0) : 0;
+	int pages = dbSpace::pages_transparent;
+	if (argc > 6)
+		for (pages = 0; pages < 3 && strcmp(argv[6], page_names[pages]); pages++) ;
+	bool replicas = argc > 7 && atoi(argv[7]);
+	if (!images || !num_queries || threads < 1 || pages == 3) {
+		fprintf(stderr, "Usage: %s [images [queries [modes [threads [flags [pages [replicas]]]]]]]\n", argv[0]);
+		return 1;
+	}
+
+	try {
+		char fn[64];
+		snprintf(fn, sizeof(fn), "bench-query-%zd.idb", images);
+		struct stat st;
+		if (stat(fn, &st)) create_db(fn, images);
+
+		std::vector<ImgData> queries(num_queries);
+		for (size_t i = 0; i < num_queries; i++) {
+			random_image(i * 2654435761U % images + 1, &queries[i]);
+			random_query(&queries[i]);
+		}
+
+		// Each mode in a new process, to measure its memory use separately.
+		for (size_t pos = 0; pos < modes.size(); ) {
+			size_t end = modes.find(',', pos);
+			if (end == std::string::npos) end = modes.size();
+			std::string mode = modes.substr(pos, end - pos);
+			pos = end + 1;
+
+			pid_t pid = fork();
+			if (pid == -1) throw io_error("Can't fork.");
+			if (!pid) {
+				run(fn, mode.c_str(), images, queries, threads, flags, pages, replicas);
+				_exit(0);
+			}
+			int status;
+			waitpid(pid, &status, 0);
+			if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+				fprintf(stderr, "Mode %s failed.\n", mode.c_str());
+				return 1;
+			}
+		}
+
+	} catch (const base_error& err) {
+		fprintf(stderr, "Caught error %s: %s.\n", err.type(), err.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,200 @@
+// Little program to compare the delta queue bucket scan implementations
+// with each other and with block queues, and those of the luminance scan
+// that starts each query. Compile with "make bench-scan" and then just run
+// it, optionally with the number of images and buckets (default 5000000
+// and 120, the number of buckets used by a query). It checks that all
+// implementations compute the same scores and prints how long they take.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include <vector>
+
+#include "block_queue.h"
+#include "delta_scan.h"
+#include "lumin_scan.h"
+
+int debug_level = 0;
+
+static const char* impls[] = { "iterator", "scalar", "sse4.1", "avx2" };
+static const int num_impls = sizeof(impls) / sizeof(impls[0]);
+
+static const char* lumin_impls[] = { "scalar", "sse4.1", "avx2" };
+static const int num_lumin_impls = sizeof(lumin_impls) / sizeof(lumin_impls[0]);
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static delta_iterator seek(const delta_queue& bucket, size_t lo) {
+	delta_iterator itr = bucket.begin();
+	while (itr != bucket.end() && *itr < lo) ++itr;
+	return itr;
+}
+
+// Returns the time per pass over all buckets.
+static double run(const std::vector<delta_queue>& buckets, const std::vector<delta_iterator>& starts, size_t lo, size_t hi, std::vector<int32_t>& scores, int reps) {
+	double start = now();
+	for (int rep = 0; rep < reps; rep++) {
+		scores.assign(hi - lo, 0);
+		for (size_t b = 0; b < buckets.size(); b++) {
+			delta_iterator itr = starts[b];
+			delta_scan::scan(itr, buckets[b].end(), lo, hi, &scores.front(), b + 1);
+		}
+	}
+	return (now() - start) / reps;
+}
+
+struct subtract_weight {
+	subtract_weight(int32_t* scores, size_t lo, int32_t weight) : m_scores(scores), m_lo(lo), m_weight(weight) { }
+	void operator()(size_t index) { m_scores[index - m_lo] -= m_weight; }
+
+	int32_t* m_scores;
+	size_t m_lo;
+	int32_t m_weight;
+};
+
+// Same for block queues.
+static double run(const std::vector<block_queue>& buckets, const std::vector<block_queue::const_iterator>& starts, size_t lo, size_t hi, std::vector<int32_t>& scores, int reps) {
+	double start = now();
+	for (int rep = 0; rep < reps; rep++) {
+		scores.assign(hi - lo, 0);
+		for (size_t b = 0; b < buckets.size(); b++) {
+			block_queue::const_iterator itr = starts[b];
+			subtract_weight f(&scores.front(), lo, b + 1);
+			block_queue::scan(itr, buckets[b].end(), hi, f);
+		}
+	}
+	return (now() - start) / reps;
+}
+
+int main(int argc, char** argv) {
+	size_t images = argc > 1 ? strtoul(argv[1], NULL, 0) : 5000000;
+	size_t num_buckets = argc > 2 ? strtoul(argv[2], NULL, 0) : 120;
+
+	// Bucket densities vary a lot, from a few percent of all images for
+	// the low frequency coefficients down to a few in a million.
+	printf("Generating %zd buckets for %zd images...\n", num_buckets, images);
+	srand(42);
+	std::vector<delta_queue> buckets(num_buckets);
+	std::vector<block_queue> blocks(num_buckets);
+	size_t total = 0, delta_bytes = 0, block_bytes = 0;
+	for (size_t b = 0; b < num_buckets; b++) {
+		double density = 0.2 * pow(1e-4, (double)rand() / RAND_MAX);
+		buckets[b].reserve(images * density);
+		for (size_t i = 0; i < images; i++)
+			if (rand() < density * RAND_MAX) {
+				buckets[b].push_back(i);
+				blocks[b].push_back(i);
+			}
+		blocks[b].finish();
+		total += buckets[b].size();
+		delta_bytes += buckets[b].base_size() * sizeof(delta_value);
+		block_bytes += blocks[b].bytes();
+	}
+	printf("%zd entries, %.2f per image. Default implementation: %s\n", total, (double)total / images, delta_scan::impl());
+	printf("Delta queues use %.2f bytes per entry, block queues %.2f.\n", (double)delta_bytes / total, (double)block_bytes / total);
+
+	size_t ranges[][2] = { { 0, images }, { images / 3, images * 2 / 3 } };
+	for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+		size_t lo = ranges[r][0], hi = ranges[r][1];
+		printf("Images %zd to %zd:\n", lo, hi);
+
+		std::vector<delta_iterator> starts;
+		for (size_t b = 0; b < num_buckets; b++)
+			starts.push_back(seek(buckets[b], lo));
+
+		std::vector<int32_t> expected;
+		double base = 0;
+		for (int i = 0; i < num_impls; i++) {
+			if (!delta_scan::use(impls[i])) {
+				printf("  %-8s not supported\n", impls[i]);
+				continue;
+			}
+
+			std::vector<int32_t> scores;
+			double time = run(buckets, starts, lo, hi, scores, 5);
+			if (!i) {
+				expected.swap(scores);
+				base = time;
+			} else if (scores != expected) {
+				fprintf(stderr, "%s computed different scores!\n", impls[i]);
+				return 1;
+			}
+			printf("  %-8s %8.2f ms %6.2fx\n", impls[i], time * 1000, base / time);
+		}
+
+		std::vector<block_queue::const_iterator> block_starts;
+		for (size_t b = 0; b < num_buckets; b++)
+			block_starts.push_back(blocks[b].lower_bound(lo));
+
+		std::vector<int32_t> scores;
+		double time = run(blocks, block_starts, lo, hi, scores, 5);
+		if (scores != expected) {
+			fprintf(stderr, "block queue computed different scores!\n");
+			return 1;
+		}
+		printf("  %-8s %8.2f ms %6.2fx\n", "block", time * 1000, base / time);
+	}
+
+	// Luminance like that of real images, in the range of ScoreMax = 1 << 20,
+	// with masks that some queries use to skip images.
+	std::vector<int32_t> avgl[3];
+	std::vector<uint16_t> mask(images);
+	for (int c = 0; c < 3; c++) {
+		avgl[c].resize(images);
+		for (size_t i = 0; i < images; i++)
+			avgl[c][i] = c ? rand() % (1 << 20) - (1 << 19) : rand() % (1 << 20);
+	}
+	for (size_t i = 0; i < images; i++)
+		mask[i] = rand() & 7;
+	const int32_t* columns[3] = { &avgl[0].front(), &avgl[1].front(), &avgl[2].front() };
+
+	// Queries with one or three colors, with and without masks, and an odd number of images.
+	lumin_scan::query queries[3];
+	for (int n = 0; n < 3; n++) {
+		lumin_scan::query& q = queries[n];
+		q.colors = n ? 3 : 1;
+		for (int c = 0; c < 3; c++) {
+			q.avgl[c] = columns[c][n];
+			q.weight[c] = (5 << 20) + (c + n) * (7 << 20);
+		}
+		q.shift = 20;
+		q.use_mask = n == 2;
+		q.mask_and = 3;
+		q.mask_xor = 1;
+	}
+	size_t num = images - 3;
+
+	printf("Luminance of %zd images:\n", num);
+	std::vector<int32_t> expected;
+	double base = 0;
+	for (int i = 0; i < num_lumin_impls; i++) {
+		if (!lumin_scan::use(lumin_impls[i])) {
+			printf("  %-8s not supported\n", lumin_impls[i]);
+			continue;
+		}
+
+		std::vector<int32_t> scores(3 * num);
+		double start = now();
+		for (int rep = 0; rep < 5; rep++)
+			for (int n = 0; n < 3; n++)
+				lumin_scan::scan(queries[n], columns, &mask.front(), num, &scores[n * num]);
+		double time = (now() - start) / 5;
+		if (!i) {
+			expected.swap(scores);
+			base = time;
+		} else if (scores != expected) {
+			fprintf(stderr, "%s computed different luminance scores!\n", lumin_impls[i]);
+			return 1;
+		}
+		printf("  %-8s %8.2f ms %6.2fx\n", lumin_impls[i], time * 1000, base / time);
+	}
+
+	return 0;
+}
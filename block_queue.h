@@ -0,0 +1,270 @@
+#ifndef BLOCK_QUEUE_H
+#define BLOCK_QUEUE_H
+
+/***************************************************************************\
+    Sorted list of size_t stored as blocks of bit-packed differences.
+
+    Copyright (C) 2008 piespy@gmail.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+\**************************************************************************/
+
+/* Values are stored in blocks of block_size. Each block has its first value
+   and the differences to the previous value of the others, all with as
+   many bits as the largest one needs. Sparse lists then need far less than
+   a delta_queue, which takes nine bytes for each difference of 255 or more.
+
+   The differences of a block are interleaved across four 32 bit lanes, so
+   that difference i is in lane i % 4 of row i / 4. A row of each of the
+   four lanes is unpacked with a few SSE2 shifts, giving four consecutive
+   differences at once. See scan() for decoding whole blocks.
+
+   Values are added to a list of pending ones until they fill a block.
+   finish() packs the rest into a last, shorter block, after which no more
+   values can be added. Differences must fit in 32 bits.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+class block_queue {
+public:
+	static const size_t block_size = 128;
+
+	class const_iterator {
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef size_t value_type;
+		typedef ptrdiff_t difference_type;
+		typedef const size_t* pointer;
+		typedef const size_t& reference;
+
+		const_iterator() { }
+
+		const_iterator& operator++() { if (++m_pos < m_queue->m_size) m_val = m_queue->next(m_pos, m_val); return *this; }
+		const_iterator  operator++(int) { const_iterator old = *this; ++*this; return old; }
+		size_t operator*() const { return m_val; }
+		bool operator==(const const_iterator& other) const { return m_pos == other.m_pos; }
+		bool operator!=(const const_iterator& other) const { return m_pos != other.m_pos; }
+
+	private:
+		friend class block_queue;
+		const_iterator(const block_queue* queue, size_t pos) : m_queue(queue), m_pos(pos), m_val(0) { if (pos < queue->m_size) m_val = queue->next(pos, 0); }
+
+		const block_queue* m_queue;
+		size_t m_pos;
+		size_t m_val;
+	};
+	typedef const_iterator iterator;
+
+	block_queue() : m_size(0) { }
+
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, m_size); }
+
+	// Iterator to the first value not below v.
+	const_iterator lower_bound(size_t v) const;
+
+	void reserve(size_t size) { m_blocks.reserve(size / block_size + 1); m_pending.reserve(std::min(size, block_size)); }
+
+	void push_back(size_t v);
+	void finish();
+
+	bool empty() const { return !m_size; }
+	size_t size() const { return m_size; }
+
+	void swap(block_queue& other);
+
+	// Memory used by the blocks and pending values, without unused capacity.
+	size_t bytes() const { return m_blocks.size() * sizeof(block) + m_data.size() * sizeof(uint32_t) + m_pending.size() * sizeof(size_t); }
+
+	// Call f(v) for each value v from itr until end or the first one not below hi,
+	// decoding a block at a time. Leaves itr at the first value not passed to f.
+	template<typename F>
+	static void scan(const_iterator& itr, const const_iterator& end, size_t hi, F& f);
+
+private:
+	struct block {
+		size_t first;
+		uint32_t data;	// Offset of its rows in m_data.
+		uint32_t bits;	// Bits per difference.
+	};
+
+	// Value at pos, which is prev plus the difference unless it is the first of a block.
+	size_t next(size_t pos, size_t prev) const;
+	size_t difference(const block& b, size_t slot) const;
+	void unpack(const block& b, size_t row, size_t rows, uint32_t* out) const;
+	void pack(const size_t* values, size_t num);
+	size_t packed() const { return std::min(m_size, m_blocks.size() * block_size); }
+
+	std::vector<block> m_blocks;
+	std::vector<uint32_t> m_data;
+	std::vector<size_t> m_pending;
+	size_t m_size;
+};
+
+inline size_t block_queue::next(size_t pos, size_t prev) const {
+	if (pos >= packed()) return m_pending[pos - m_blocks.size() * block_size];
+	size_t slot = pos % block_size;
+	const block& b = m_blocks[pos / block_size];
+	return slot ? prev + difference(b, slot) : b.first;
+}
+
+inline size_t block_queue::difference(const block& b, size_t slot) const {
+	if (!b.bits) return 0;
+	size_t bit = slot / 4 * b.bits, shift = bit % 32;
+	const uint32_t* p = &m_data[b.data + bit / 32 * 4 + slot % 4];
+	uint64_t v = p[0] >> shift;
+	if (shift + b.bits > 32) v |= (uint64_t)p[4] << (32 - shift);
+	return v & (((uint64_t)1 << b.bits) - 1);
+}
+
+// Unpack the differences of rows [row, rows) to out[4 * row] onwards.
+inline void block_queue::unpack(const block& b, size_t row, size_t rows, uint32_t* out) const {
+	if (!b.bits) {
+		std::fill(out + 4 * row, out + 4 * rows, 0);
+		return;
+	}
+	const uint32_t* in = &m_data[b.data];
+	uint32_t mask = (uint32_t)(((uint64_t)1 << b.bits) - 1);
+#ifdef __SSE2__
+	__m128i vmask = _mm_set1_epi32(mask);
+	for (; row < rows; row++) {
+		size_t bit = row * b.bits, shift = bit % 32;
+		const uint32_t* p = in + bit / 32 * 4;
+		__m128i v = _mm_srl_epi32(_mm_loadu_si128((const __m128i*) p), _mm_cvtsi32_si128(shift));
+		if (shift + b.bits > 32)
+			v = _mm_or_si128(v, _mm_sll_epi32(_mm_loadu_si128((const __m128i*) (p + 4)), _mm_cvtsi32_si128(32 - shift)));
+		_mm_storeu_si128((__m128i*) (out + 4 * row), _mm_and_si128(v, vmask));
+	}
+#else
+	for (; row < rows; row++) {
+		size_t bit = row * b.bits, shift = bit % 32;
+		const uint32_t* p = in + bit / 32 * 4;
+		for (int lane = 0; lane < 4; lane++) {
+			uint64_t v = p[lane] >> shift;
+			if (shift + b.bits > 32) v |= (uint64_t)p[lane + 4] << (32 - shift);
+			out[4 * row + lane] = v & mask;
+		}
+	}
+#endif
+}
+
+inline void block_queue::pack(const size_t* values, size_t num) {
+	uint32_t diff[block_size];
+	diff[0] = 0;
+	size_t max = 0;
+	for (size_t i = 1; i < num; i++) {
+		size_t d = values[i] - values[i - 1];
+		if (d > 0xffffffff) throw std::overflow_error("block_queue difference does not fit in 32 bits");
+		diff[i] = d;
+		max |= d;
+	}
+
+	block b;
+	b.first = values[0];
+	b.data = m_data.size();
+	b.bits = 0;
+	while (max >> b.bits) b.bits++;
+	if (m_data.size() > 0xffffffff - 4 * b.bits) throw std::overflow_error("block_queue has too many blocks");
+
+	size_t rows = (num + 3) / 4;
+	m_data.resize(m_data.size() + (rows * b.bits + 31) / 32 * 4, 0);
+	m_blocks.push_back(b);
+	if (!b.bits) return;
+
+	uint32_t* out = &m_data[b.data];
+	for (size_t i = 1; i < num; i++) {
+		size_t bit = i / 4 * b.bits, shift = bit % 32;
+		uint32_t* p = out + bit / 32 * 4 + i % 4;
+		p[0] |= diff[i] << shift;
+		if (shift + b.bits > 32) p[4] |= diff[i] >> (32 - shift);
+	}
+}
+
+inline void block_queue::push_back(size_t v) {
+	if (m_size < m_blocks.size() * block_size) throw std::logic_error("block_queue is finished");
+	m_pending.push_back(v);
+	m_size++;
+	if (m_pending.size() < block_size) return;
+
+	pack(&m_pending.front(), block_size);
+	m_pending.clear();
+}
+
+// Pack the pending values and free any unused capacity.
+inline void block_queue::finish() {
+	if (!m_pending.empty()) pack(&m_pending.front(), m_pending.size());
+	std::vector<size_t>().swap(m_pending);
+	std::vector<block>(m_blocks).swap(m_blocks);
+	std::vector<uint32_t>(m_data).swap(m_data);
+}
+
+inline void block_queue::swap(block_queue& other) {
+	m_blocks.swap(other.m_blocks);
+	m_data.swap(other.m_data);
+	m_pending.swap(other.m_pending);
+	std::swap(m_size, other.m_size);
+}
+
+struct block_first_less {
+	template<typename B>
+	bool operator() (const B& b, size_t v) const { return b.first < v; }
+};
+
+inline block_queue::const_iterator block_queue::lower_bound(size_t v) const {
+	// Start from the block before the first one starting at v or later.
+	size_t b = std::lower_bound(m_blocks.begin(), m_blocks.end(), v, block_first_less()) - m_blocks.begin();
+	const_iterator itr(this, b ? (b - 1) * block_size : 0);
+	while (itr.m_pos < m_size && *itr < v) ++itr;
+	return itr;
+}
+
+template<typename F>
+inline void block_queue::scan(const_iterator& itr, const const_iterator& end, size_t hi, F& f) {
+	const block_queue& q = *itr.m_queue;
+	uint32_t diff[block_size];
+	while (itr.m_pos < end.m_pos && itr.m_pos < q.packed() && itr.m_val < hi) {
+		size_t start = itr.m_pos / block_size * block_size, slot = itr.m_pos - start;
+		size_t stop = std::min(std::min(block_size, q.m_size - start), end.m_pos - start);
+		q.unpack(q.m_blocks[start / block_size], slot / 4, (stop + 3) / 4, diff);
+
+		// If the next block starts below hi, so does all of this one.
+		size_t v = itr.m_val;
+		f(v);
+		if (stop == block_size && start / block_size + 1 < q.m_blocks.size() && q.m_blocks[start / block_size + 1].first < hi) {
+			while (++slot < stop)
+				f(v += diff[slot]);
+		} else {
+			while (++slot < stop && (v += diff[slot]) < hi)
+				f(v);
+		}
+
+		itr.m_pos = start + slot;
+		if (itr.m_pos < q.m_size) itr.m_val = slot < stop ? v : q.next(itr.m_pos, v);
+	}
+	for (; itr != end && *itr < hi; ++itr)
+		f(*itr);
+}
+
+#endif // BLOCK_QUEUE_H
@@ -21,6 +21,8 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 \**************************************************************************/
 
+#include <stddef.h>
+
 #include <vector>
 
 static const size_t size_t_mask = sizeof(size_t) - 1;
@@ -45,8 +47,16 @@ struct delta_iterator : public std::iterator<std::forward_iterator_tag, size_t>
 	bool operator==(const delta_iterator& other) const { return m_p == other.m_p; }
 	bool operator!=(const delta_iterator& other) const { return m_p != other.m_p; }
 
+	// If it points into the words from begin to end, move it to the same
+	// position in a copy of them offset bytes away.
+	void relocate(const delta_value* begin, const delta_value* end, ptrdiff_t offset) {
+		if (m_p + size_t_mask >= (size_t)begin && m_p < (size_t)end) m_p += offset;
+	}
+
 private:
 	friend class delta_queue;
+	friend class delta_queue_view;
+	friend struct delta_scan_words;
 	delta_iterator(const delta_value* itr, int ind) : m_p(ptr(itr) + ind - size_t_mask) { }	// only useful for end()
 
 	size_t itr() const { return *(const size_t*)(m_p & ~size_t_mask); }
@@ -90,8 +100,81 @@ public:
 	size_t base_size() const { return m_base.size(); }
 
 private:
+	friend class delta_queue_view;
+
+	size_t m_size;
+	size_t m_pos;
+	size_t m_bval;
+};
+
+// Read-only access to the words of a delta_queue stored elsewhere, either
+// in a delta_queue or e.g. in a memory mapped file.
+class delta_queue_view {
+public:
+	typedef delta_iterator const_iterator;
+
+	// Iterator state relative to the first word, to store it in a file.
+	struct position {
+		size_t ofs;
+		size_t val;
+		size_t bval;
+	};
+
+	delta_queue_view() : m_words(NULL), m_num_words(0), m_size(0) { }
+	delta_queue_view(const delta_queue& queue) : m_words(&queue.m_base.front()), m_num_words(queue.m_base.size()), m_size(queue.m_size) { }
+	delta_queue_view(const delta_value* words, size_t num_words, size_t size) : m_words(words), m_num_words(num_words), m_size(size) { }
+
+	const_iterator begin() const { return const_iterator(m_words); }
+	const_iterator end() const { return const_iterator(m_words + m_num_words - 1, m_size & size_t_mask); }
+
+	bool empty() const { return !m_size; }
+	size_t size() const { return m_size; }
+
+	const delta_value* words() const { return m_words; }
+	size_t num_words() const { return m_num_words; }
+
+	position save(const const_iterator& itr) const;
+	const_iterator restore(const position& pos) const;
+
+private:
+	const delta_value* m_words;
+	size_t m_num_words;
+	size_t m_size;
+};
+
+// Counts the words a delta_queue with the same values would have, to
+// allocate them beforehand for a delta_writer.
+class delta_counter {
+public:
+	delta_counter() : m_words(2), m_size(0), m_bval(0) { }
+
+	void push_back(size_t v);
+
+	size_t words() const { return m_words; }
+	size_t size() const { return m_size; }
+
+private:
+	size_t m_words;
 	size_t m_size;
+	size_t m_bval;
+};
+
+// Writes the same words as a delta_queue, but to memory allocated elsewhere
+// which must have room for all of them.
+class delta_writer {
+public:
+	delta_writer() : m_words(NULL) { }
+	explicit delta_writer(delta_value* words) : m_words(words), m_pos(0), m_end(1), m_size(0), m_bval(0) { m_words[0] = m_words[1] = 0; }
+
+	void push_back(size_t v);
+
+	delta_queue_view view() const { return delta_queue_view(m_words, m_end + 1, m_size); }
+
+private:
+	delta_value* m_words;
 	size_t m_pos;
+	size_t m_end;
+	size_t m_size;
 	size_t m_bval;
 };
 
@@ -139,4 +222,45 @@ inline void delta_queue::push_back(size_t v) {
 	};
 }
 
+inline void delta_counter::push_back(size_t v) {
+	if (v - m_bval >= 255) m_words++;
+	m_bval = v;
+	if (!(++m_size & size_t_mask)) m_words++;
+}
+
+// Same as delta_queue::push_back, with m_end the index of its last word.
+inline void delta_writer::push_back(size_t v) {
+	v -= m_bval;
+	m_bval += v;
+
+	if (v >= 255) {
+		m_words[m_end] = v - 255;
+		m_words[++m_end] = 0;
+		v = 255;
+	}
+
+	m_words[m_pos].put(v, m_size++ & size_t_mask);
+
+	if (!(m_size & size_t_mask)) {
+		m_pos = m_end;
+		m_words[++m_end] = 0;
+	}
+}
+
+inline delta_queue_view::position delta_queue_view::save(const const_iterator& itr) const {
+	position pos;
+	pos.ofs = itr.m_p - (size_t)m_words;
+	pos.val = itr.m_val.full;
+	pos.bval = itr.m_bval;
+	return pos;
+}
+
+inline delta_queue_view::const_iterator delta_queue_view::restore(const position& pos) const {
+	const_iterator itr;
+	itr.m_p = (size_t)m_words + pos.ofs;
+	itr.m_val = pos.val;
+	itr.m_bval = pos.bval;
+	return itr;
+}
+
 #endif // DELTA_QUEUE_H
@@ -0,0 +1,202 @@
+/***************************************************************************\
+    delta_scan.cpp - Apply a weight to the scores of all values in a delta_queue.
+
+    Copyright (C) 2008 piespy@gmail.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+\**************************************************************************/
+
+#include <string.h>
+
+#include "delta_scan.h"
+
+// Function level target options and __builtin_cpu_supports need gcc 4.9.
+#if defined(__x86_64__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define DELTA_SCAN_SIMD 1
+#include <immintrin.h>
+#else
+#define DELTA_SCAN_SIMD 0
+#endif
+
+static const uint64_t bytes_01 = 0x0101010101010101ULL;
+static const uint64_t bytes_80 = 0x8080808080808080ULL;
+static const uint64_t words_00ff = 0x00ff00ff00ff00ffULL;
+
+// Whether any of the delta bytes is 255, meaning that the value is in the next word.
+static inline bool has_escape(uint64_t word) {
+	word = ~word;
+	return (word - bytes_01) & ~word & bytes_80;
+}
+
+// Sum of all eight delta bytes.
+static inline uint64_t byte_sum(uint64_t word) {
+	word = (word & words_00ff) + ((word >> 8) & words_00ff);
+	word += word >> 16;
+	word += word >> 32;
+	return word & 0xffff;
+}
+
+static void scan_iterator(delta_iterator& itr, const delta_iterator& end, size_t lo, size_t hi, int32_t* scores, int32_t weight) {
+	for (; itr != end && *itr < hi; ++itr)
+		scores[*itr - lo] -= weight;
+}
+
+// Offset policies: compute base plus the sum of all delta bytes before
+// each one, i.e. the score offsets of the eight values of the word.
+struct offsets_scalar {
+	static inline void get(uint64_t word, uint32_t base, uint32_t* ofs) {
+		for (int i = 0; i < 8; i++, word >>= 8) {
+			ofs[i] = base;
+			base += word & 255;
+		}
+	}
+};
+
+#if DELTA_SCAN_SIMD
+struct offsets_sse41 {
+	__attribute__((target("sse4.1")))
+	static inline void get(uint64_t word, uint32_t base, uint32_t* ofs) {
+		// Shift in a zero byte, so the prefix sums don't include the byte itself.
+		__m128i bytes = _mm_cvtsi64_si128(word << 8);
+		__m128i low = _mm_cvtepu8_epi32(bytes);
+		__m128i high = _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4));
+
+		low = _mm_add_epi32(low, _mm_slli_si128(low, 4));
+		low = _mm_add_epi32(low, _mm_slli_si128(low, 8));
+		high = _mm_add_epi32(high, _mm_slli_si128(high, 4));
+		high = _mm_add_epi32(high, _mm_slli_si128(high, 8));
+
+		low = _mm_add_epi32(low, _mm_set1_epi32(base));
+		high = _mm_add_epi32(high, _mm_shuffle_epi32(low, 0xff));
+
+		_mm_storeu_si128((__m128i*) ofs, low);
+		_mm_storeu_si128((__m128i*) (ofs + 4), high);
+	}
+};
+
+struct offsets_avx2 {
+	__attribute__((target("avx2")))
+	static inline void get(uint64_t word, uint32_t base, uint32_t* ofs) {
+		__m256i sums = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(word << 8));
+
+		// Prefix sums within each 128 bit lane, then carry the low lane's total into the high lane.
+		sums = _mm256_add_epi32(sums, _mm256_slli_si256(sums, 4));
+		sums = _mm256_add_epi32(sums, _mm256_slli_si256(sums, 8));
+		__m256i last = _mm256_shuffle_epi32(sums, 0xff);
+		sums = _mm256_add_epi32(sums, _mm256_permute2x128_si256(last, last, 0x08));
+
+		sums = _mm256_add_epi32(sums, _mm256_set1_epi32(base));
+		_mm256_storeu_si256((__m256i*) ofs, sums);
+	}
+};
+#endif
+
+struct delta_scan_words {
+	template<typename O>
+	static inline void scan(delta_iterator& itr, const delta_iterator& end, size_t lo, size_t hi, int32_t* scores, int32_t weight);
+};
+
+template<typename O>
+inline void delta_scan_words::scan(delta_iterator& itr, const delta_iterator& end, size_t lo, size_t hi, int32_t* scores, int32_t weight) {
+	// The offsets are computed in 32 bits.
+	if (sizeof(size_t) != sizeof(uint64_t) || hi - lo >= 0xffff0000)
+		return scan_iterator(itr, end, lo, hi, scores, weight);
+
+	size_t end_word = end.m_p & ~size_t_mask;
+	uint32_t ofs[8];
+
+	while (itr != end && itr.m_bval < hi) {
+		// At the start of a word whose eight values are all before end and
+		// hi, and which has no escapes: handle the whole word at once. The
+		// value of its last delta byte then becomes the current value.
+		if (!itr.ind() && (itr.m_p & ~size_t_mask) != end_word && !has_escape(itr.m_val.full)) {
+			uint64_t word = itr.m_val.full;
+			size_t next = itr.m_bval + byte_sum(word);
+			if (next < hi) {
+				O::get(word, itr.m_bval - lo, ofs);
+				for (int i = 0; i < 8; i++)
+					scores[ofs[i]] -= weight;
+
+				itr.m_bval = next;
+				itr.m_p += sizeof(size_t);
+				itr.m_val.full = itr.itr();
+				continue;
+			}
+		}
+
+		scores[itr.m_bval - lo] -= weight;
+		++itr;
+	}
+}
+
+static void scan_scalar(delta_iterator& itr, const delta_iterator& end, size_t lo, size_t hi, int32_t* scores, int32_t weight) {
+	delta_scan_words::scan<offsets_scalar>(itr, end, lo, hi, scores, weight);
+}
+
+#if DELTA_SCAN_SIMD
+// Flatten to inline the offset policy even though the template itself has no target options.
+__attribute__((target("sse4.1"), flatten))
+static void scan_sse41(delta_iterator& itr, const delta_iterator& end, size_t lo, size_t hi, int32_t* scores, int32_t weight) {
+	delta_scan_words::scan<offsets_sse41>(itr, end, lo, hi, scores, weight);
+}
+
+__attribute__((target("avx2"), flatten))
+static void scan_avx2(delta_iterator& itr, const delta_iterator& end, size_t lo, size_t hi, int32_t* scores, int32_t weight) {
+	delta_scan_words::scan<offsets_avx2>(itr, end, lo, hi, scores, weight);
+}
+#endif
+
+const char* delta_scan::s_impl;
+delta_scan::scan_func delta_scan::s_func = delta_scan::detect();
+
+delta_scan::scan_func delta_scan::detect() {
+#if DELTA_SCAN_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		s_impl = "avx2";
+		return &scan_avx2;
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		s_impl = "sse4.1";
+		return &scan_sse41;
+	}
+#endif
+	s_impl = "scalar";
+	return &scan_scalar;
+}
+
+bool delta_scan::use(const char* impl) {
+	scan_func func = NULL;
+	if (!strcmp(impl, "iterator")) {
+		func = &scan_iterator;
+		impl = "iterator";
+	} else if (!strcmp(impl, "scalar")) {
+		func = &scan_scalar;
+		impl = "scalar";
+#if DELTA_SCAN_SIMD
+	} else if (!strcmp(impl, "sse4.1") && __builtin_cpu_supports("sse4.1")) {
+		func = &scan_sse41;
+		impl = "sse4.1";
+	} else if (!strcmp(impl, "avx2") && __builtin_cpu_supports("avx2")) {
+		func = &scan_avx2;
+		impl = "avx2";
+#endif
+	}
+
+	if (!func) return false;
+	s_func = func;
+	s_impl = impl;
+	return true;
+}
@@ -0,0 +1,61 @@
+#ifndef DELTA_SCAN_H
+#define DELTA_SCAN_H
+
+/***************************************************************************\
+    delta_scan.h - Apply a weight to the scores of all values in a delta_queue.
+
+    Copyright (C) 2008 piespy@gmail.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+\**************************************************************************/
+
+/* Same as
+
+   for (; itr != end && *itr < hi; ++itr)
+	scores[*itr - lo] -= weight;
+
+   leaving itr at the first value not below hi, but instead of decoding
+   one value at a time, whole words of eight delta bytes are decoded at
+   once. Depending on the CPU, this uses AVX2, SSE4.1 or plain integer
+   arithmetic, selected when the program starts.
+*/
+
+#include <stdint.h>
+
+#include "delta_queue.h"
+
+class delta_scan {
+public:
+	static void scan(delta_iterator& itr, const delta_iterator& end, size_t lo, size_t hi, int32_t* scores, int32_t weight) {
+		(*s_func)(itr, end, lo, hi, scores, weight);
+	}
+
+	// Name of the implementation in use.
+	static const char* impl() { return s_impl; }
+
+	// Use the given implementation ("avx2", "sse4.1", "scalar" or "iterator"
+	// to decode one value at a time). Returns false if it is not available.
+	static bool use(const char* impl);
+
+private:
+	typedef void (*scan_func)(delta_iterator& itr, const delta_iterator& end, size_t lo, size_t hi, int32_t* scores, int32_t weight);
+
+	static scan_func detect();
+
+	static scan_func s_func;
+	static const char* s_impl;
+};
+
+#endif // DELTA_SCAN_H
@@ -51,9 +51,20 @@
 #include <stdlib.h> 
 #include <string.h>
 
+/* STL Includes */
+#include <algorithm>
+
 /* imgSeek Includes */
 #include "haar.h"
 
+// Function level target options and __builtin_cpu_supports need gcc 4.9.
+#if defined(__x86_64__) && defined(UNIT_IS_DOUBLE) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAAR_SIMD 1
+#include <immintrin.h>
+#else
+#define HAAR_SIMD 0
+#endif
+
 // RGB -> YIQ colorspace conversion; Y luminance, I,Q chrominance.
 // If RGB in [0..255] then Y in [0..255] and I,Q in [-127..127].
 #define RGB_2_YIQ(a, b, c) \
@@ -149,7 +160,7 @@ haar2D(Unit a[])
 // Here input is RGB data [0..255] in Unit arrays
 // Computation is (almost) in-situ.
 static void
-haar2D(Unit a[])
+haar2D_scalar(Unit a[])
 {
   int i;
   Unit t[NUM_PIXELS >> 1];
@@ -216,20 +227,368 @@ haar2D(Unit a[])
 }
 #endif
 
+static void
+rgb2yiq_scalar(Unit* a, Unit* b, Unit* c)
+{
+  RGB_2_YIQ(a, b, c);
+}
+
+static void
+char2yiq_scalar(unsigned char* c1, unsigned char* c2, unsigned char* c3,
+		Unit* a, Unit* b, Unit* c)
+{
+  int i;
+  Unit *p = a;
+  Unit *q = b;
+  Unit *r = c;
+
+  for (i = 0; i < NUM_PIXELS_SQUARED; i++) {
+    *p++ = *c1++;
+    *q++ = *c2++;
+    *r++ = *c3++;
+  }
+  RGB_2_YIQ(a, b, c);
+}
+
+// Index of the first of cdata[i..] larger than d in magnitude,
+// or NUM_PIXELS_SQUARED if there is none.
+static int
+find_larger_scalar(const Unit* cdata, int i, Unit d)
+{
+  for (; i < NUM_PIXELS_SQUARED; i++)
+    if (ABS(cdata[i]) > d) break;
+  return i;
+}
+
+#if HAAR_SIMD
+/* The same transform on SSE2 or AVX2 vectors of doubles. Every element
+   goes through exactly the same operations in the same order as in the
+   scalar version, only several at once, so that the results are
+   bit-identical. (There must be no FMA, which rounds differently.)
+
+   Rows: the sums and differences of neighbouring elements are computed
+   by splitting the vectors into even and odd elements.
+
+   Columns: instead of going down one column at a time, a block of
+   adjacent columns is transformed at once, with the vectors running
+   along the rows. The block is only a few cache lines wide, so it stays
+   in the L1 cache for all levels of the transform.
+*/
+#define HAAR_BLOCK	8	/* columns per block */
+
+// The AVX2 vectors only ever pass between functions with target("avx2")
+// that are inlined into each other, but gcc still notes once that passing
+// them changes the ABI when the templates below are instantiated.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+struct vec_sse2 {
+  typedef __m128d type;
+  static const int width = 2;
+
+  static inline type load(const Unit* p) { return _mm_loadu_pd(p); }
+  static inline void store(Unit* p, type v) { _mm_storeu_pd(p, v); }
+  static inline type set1(Unit x) { return _mm_set1_pd(x); }
+  static inline type add(type x, type y) { return _mm_add_pd(x, y); }
+  static inline type sub(type x, type y) { return _mm_sub_pd(x, y); }
+  static inline type mul(type x, type y) { return _mm_mul_pd(x, y); }
+
+  // Bit mask of the elements of x larger than d in magnitude.
+  static inline int larger(type x, type d) {
+    return _mm_movemask_pd(_mm_cmpgt_pd(_mm_andnot_pd(_mm_set1_pd(-0.0), x), d));
+  }
+
+  // Even and odd elements of p[0 .. 2*width-1].
+  static inline void split(const Unit* p, type& even, type& odd) {
+    type x = load(p), y = load(p + width);
+    even = _mm_unpacklo_pd(x, y);
+    odd = _mm_unpackhi_pd(x, y);
+  }
+
+  // Convert the bytes p[0 .. width-1].
+  static inline type from_char(const unsigned char* p) {
+    return _mm_set_pd(p[1], p[0]);
+  }
+};
+
+struct vec_avx2 {
+  typedef __m256d type;
+  static const int width = 4;
+
+  __attribute__((target("avx2"))) static inline type load(const Unit* p) { return _mm256_loadu_pd(p); }
+  __attribute__((target("avx2"))) static inline void store(Unit* p, type v) { _mm256_storeu_pd(p, v); }
+  __attribute__((target("avx2"))) static inline type set1(Unit x) { return _mm256_set1_pd(x); }
+  __attribute__((target("avx2"))) static inline type add(type x, type y) { return _mm256_add_pd(x, y); }
+  __attribute__((target("avx2"))) static inline type sub(type x, type y) { return _mm256_sub_pd(x, y); }
+  __attribute__((target("avx2"))) static inline type mul(type x, type y) { return _mm256_mul_pd(x, y); }
+
+  __attribute__((target("avx2")))
+  static inline int larger(type x, type d) {
+    return _mm256_movemask_pd(_mm256_cmp_pd(_mm256_andnot_pd(_mm256_set1_pd(-0.0), x), d, _CMP_GT_OQ));
+  }
+
+  __attribute__((target("avx2")))
+  static inline void split(const Unit* p, type& even, type& odd) {
+    type x = load(p), y = load(p + width);
+    // 0 4 2 6 and 1 5 3 7, then put them in order.
+    even = _mm256_permute4x64_pd(_mm256_unpacklo_pd(x, y), 0xd8);
+    odd = _mm256_permute4x64_pd(_mm256_unpackhi_pd(x, y), 0xd8);
+  }
+
+  __attribute__((target("avx2")))
+  static inline type from_char(const unsigned char* p) {
+    int32_t bytes;
+    memcpy(&bytes, p, sizeof(bytes));
+    return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+  }
+};
+
+template<typename V>
+static inline void
+haar_rows(Unit a[])
+{
+  typedef typename V::type vec;
+  int i;
+  Unit t[NUM_PIXELS >> 1];
+
+  for (i = 0; i < NUM_PIXELS_SQUARED; i += NUM_PIXELS) {
+    int h, h1;
+    Unit C = 1;
+
+    for (h = NUM_PIXELS; h > 1; h = h1) {
+      int k = 0;
+
+      h1 = h >> 1;
+      C *= 0.7071;
+      if (h1 >= V::width) {
+        vec vC = V::set1(C);
+        // All of a vector's inputs are read before storing its sums
+        // at k, and the next inputs start at 2k or later.
+        for (; k < h1; k += V::width) {
+          vec even, odd;
+          V::split(a + i + 2*k, even, odd);
+          V::store(t + k, V::mul(V::sub(even, odd), vC));
+          V::store(a + i + k, V::add(even, odd));
+        }
+      }
+      for (; k < h1; k++) {
+        int j2 = i + 2*k, j21 = j2 + 1;
+
+        t[k]  = (a[j2] - a[j21]) * C;
+        a[i+k] = (a[j2] + a[j21]);
+      }
+      memcpy(a+i+h1, t, h1*sizeof(a[0]));
+    }
+    a[i] *= C;
+  }
+}
+
+template<typename V>
+static inline void
+haar_columns(Unit a[])
+{
+  typedef typename V::type vec;
+  static const int lanes = HAAR_BLOCK / V::width;
+  int i;
+  Unit t[(NUM_PIXELS >> 1) * HAAR_BLOCK];
+
+  for (i = 0; i < NUM_PIXELS; i += HAAR_BLOCK) {
+    Unit C = 1;
+    int h, h1, l;
+
+    for (h = NUM_PIXELS; h > 1; h = h1) {
+      int k;
+
+      h1 = h >> 1;
+      C *= 0.7071;
+      vec vC = V::set1(C);
+      // Row k of the block is only written after reading rows 2k and 2k+1.
+      for (k = 0; k < h1; k++) {
+        Unit* j1 = a + i + k*NUM_PIXELS;
+        Unit* j2 = a + i + 2*k*NUM_PIXELS;
+        Unit* j21 = j2 + NUM_PIXELS;
+
+        for (l = 0; l < lanes; l++) {
+          vec x = V::load(j2 + l*V::width), y = V::load(j21 + l*V::width);
+          V::store(t + k*HAAR_BLOCK + l*V::width, V::mul(V::sub(x, y), vC));
+          V::store(j1 + l*V::width, V::add(x, y));
+        }
+      }
+      for (k = 0; k < h1; k++)
+        memcpy(a + i + (h1+k)*NUM_PIXELS, t + k*HAAR_BLOCK, HAAR_BLOCK*sizeof(a[0]));
+    }
+    vec vC = V::set1(C);
+    for (l = 0; l < lanes; l++)
+      V::store(a + i + l*V::width, V::mul(V::load(a + i + l*V::width), vC));
+  }
+}
+
+template<typename V>
+static inline int
+find_larger(const Unit* cdata, int i, Unit d)
+{
+  typedef typename V::type vec;
+  static const int lanes = HAAR_BLOCK / V::width;
+  vec vd = V::set1(d);
+
+  for (; i + HAAR_BLOCK <= NUM_PIXELS_SQUARED; i += HAAR_BLOCK) {
+    int mask = 0;
+    for (int l = 0; l < lanes; l++)
+      mask |= V::larger(V::load(cdata + i + l*V::width), vd) << (l*V::width);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return find_larger_scalar(cdata, i, d);
+}
+
+template<typename V>
+static inline void
+rgb2yiq(Unit* a, Unit* b, Unit* c, int i)
+{
+  typedef typename V::type vec;
+  vec x = V::load(a + i), y = V::load(b + i), z = V::load(c + i);
+
+  V::store(a + i, V::add(V::add(V::mul(V::set1(0.299), x), V::mul(V::set1(0.587), y)), V::mul(V::set1(0.114), z)));
+  V::store(b + i, V::sub(V::sub(V::mul(V::set1(0.596), x), V::mul(V::set1(0.275), y)), V::mul(V::set1(0.321), z)));
+  V::store(c + i, V::add(V::sub(V::mul(V::set1(0.212), x), V::mul(V::set1(0.523), y)), V::mul(V::set1(0.311), z)));
+}
+
+static void
+haar2D_sse2(Unit a[])
+{
+  haar_rows<vec_sse2>(a);
+  haar_columns<vec_sse2>(a);
+}
+
+static int
+find_larger_sse2(const Unit* cdata, int i, Unit d)
+{
+  return find_larger<vec_sse2>(cdata, i, d);
+}
+
+static void
+rgb2yiq_sse2(Unit* a, Unit* b, Unit* c)
+{
+  for (int i = 0; i < NUM_PIXELS_SQUARED; i += vec_sse2::width)
+    rgb2yiq<vec_sse2>(a, b, c, i);
+}
+
+static void
+char2yiq_sse2(unsigned char* c1, unsigned char* c2, unsigned char* c3,
+	      Unit* a, Unit* b, Unit* c)
+{
+  for (int i = 0; i < NUM_PIXELS_SQUARED; i += vec_sse2::width) {
+    vec_sse2::store(a + i, vec_sse2::from_char(c1 + i));
+    vec_sse2::store(b + i, vec_sse2::from_char(c2 + i));
+    vec_sse2::store(c + i, vec_sse2::from_char(c3 + i));
+    rgb2yiq<vec_sse2>(a, b, c, i);
+  }
+}
+
+// Flatten to inline the vector policy even though the templates themselves have no target options.
+__attribute__((target("avx2"), flatten))
+static void
+haar2D_avx2(Unit a[])
+{
+  haar_rows<vec_avx2>(a);
+  haar_columns<vec_avx2>(a);
+}
+
+__attribute__((target("avx2"), flatten))
+static int
+find_larger_avx2(const Unit* cdata, int i, Unit d)
+{
+  return find_larger<vec_avx2>(cdata, i, d);
+}
+
+__attribute__((target("avx2"), flatten))
+static void
+rgb2yiq_avx2(Unit* a, Unit* b, Unit* c)
+{
+  for (int i = 0; i < NUM_PIXELS_SQUARED; i += vec_avx2::width)
+    rgb2yiq<vec_avx2>(a, b, c, i);
+}
+
+__attribute__((target("avx2"), flatten))
+static void
+char2yiq_avx2(unsigned char* c1, unsigned char* c2, unsigned char* c3,
+	      Unit* a, Unit* b, Unit* c)
+{
+  for (int i = 0; i < NUM_PIXELS_SQUARED; i += vec_avx2::width) {
+    vec_avx2::store(a + i, vec_avx2::from_char(c1 + i));
+    vec_avx2::store(b + i, vec_avx2::from_char(c2 + i));
+    vec_avx2::store(c + i, vec_avx2::from_char(c3 + i));
+    rgb2yiq<vec_avx2>(a, b, c, i);
+  }
+}
+#pragma GCC diagnostic pop
+#endif
+
+struct haar_impl {
+  const char* name;
+  void (*haar2D)(Unit a[]);
+  void (*rgb2yiq)(Unit* a, Unit* b, Unit* c);
+  void (*char2yiq)(unsigned char* c1, unsigned char* c2, unsigned char* c3, Unit* a, Unit* b, Unit* c);
+  int (*find_larger)(const Unit* cdata, int i, Unit d);
+};
+
+static const haar_impl impls[] = {
+#if HAAR_SIMD
+  { "avx2", haar2D_avx2, rgb2yiq_avx2, char2yiq_avx2, find_larger_avx2 },
+  { "sse2", haar2D_sse2, rgb2yiq_sse2, char2yiq_sse2, find_larger_sse2 },
+#endif
+  { "scalar", haar2D_scalar, rgb2yiq_scalar, char2yiq_scalar, find_larger_scalar },
+};
+
+static bool
+haar_supported(const haar_impl* impl)
+{
+#if HAAR_SIMD
+  __builtin_cpu_init();
+  if (!strcmp(impl->name, "avx2")) return __builtin_cpu_supports("avx2");
+#endif
+  return true;
+}
+
+// Use the fastest implementation by default.
+static const haar_impl*
+haar_detect()
+{
+  const haar_impl* impl = impls;
+  while (!haar_supported(impl)) impl++;
+  return impl;
+}
+
+static const haar_impl* haar = haar_detect();
+
+const char*
+haarImpl()
+{
+  return haar->name;
+}
+
+bool
+haarUse(const char* name)
+{
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+    if (!strcmp(impls[i].name, name) && haar_supported(&impls[i])) {
+      haar = &impls[i];
+      return true;
+    }
+  return false;
+}
+
 /* Do the Haar tensorial 2d transform itself.
    Here input is RGB data [0..255] in Unit arrays.
    Results are available in a, b, and c.
    Fully inplace calculation; order of result is interleaved though,
    but we don't care about that.
 */
-void
-transform(Unit* a, Unit* b, Unit* c)
+static void
+haar2D_scale(Unit* a, Unit* b, Unit* c)
 {
-  RGB_2_YIQ(a, b, c);
-
-  haar2D(a);
-  haar2D(b);
-  haar2D(c);
+  haar->haar2D(a);
+  haar->haar2D(b);
+  haar->haar2D(c);
 
   /* Reintroduce the skipped scaling factors: */
   a[0] /= 256 * 128;
@@ -237,6 +596,13 @@ transform(Unit* a, Unit* b, Unit* c)
   c[0] /= 256 * 128;
 }
 
+void
+transform(Unit* a, Unit* b, Unit* c)
+{
+  haar->rgb2yiq(a, b, c);
+  haar2D_scale(a, b, c);
+}
+
 // Do the Haar tensorial 2d transform itself.
 // Here input RGB data is in unsigned char arrays ([0..255])
 // Results are available in a, b, and c.
@@ -244,70 +610,59 @@ void
 transformChar(unsigned char* c1, unsigned char* c2, unsigned char* c3,
 	      Unit* a, Unit* b, Unit* c)
 {
-  int i;
-  Unit *p = a;
-  Unit *q = b;
-  Unit *r = c;
-
-  for (i = 0; i < NUM_PIXELS_SQUARED; i++) {
-    *p++ = *c1++;
-    *q++ = *c2++;
-    *r++ = *c3++;
-  }
-  transform(a, b, c);
+  haar->char2yiq(c1, c2, c3, a, b, c);
+  haar2D_scale(a, b, c);
 }
 
 // Find the NUM_COEFS largest numbers in cdata[] (in magnitude that is)
 // and store their indices in sig[].
+// This works exactly like a std::priority_queue of valStruct's, including
+// the order of values of equal magnitude, but without allocating memory.
+// Most values are smaller than the smallest one in the queue, which the
+// vectorized find_larger skips quickly.
 inline static void
 get_m_largests(Unit *cdata, Idx *sig)
 {
   int cnt, i;
-  valStruct val;
-  valqueue vq;			// dynamic priority queue of valStruct's
+  valStruct vq[NUM_COEFS];	// heap with the smallest magnitude first
 
   // Could skip i=0: goes into separate avgl
 
   // Fill up the bounded queue. (Assuming NUM_PIXELS_SQUARED > NUM_COEFS)
   for (i = 1; i < NUM_COEFS+1; i++) {
-    val.i = i;
-    val.d = ABS(cdata[i]);
-    vq.push(val);
+    vq[i-1].i = i;
+    vq[i-1].d = ABS(cdata[i]);
+    std::push_heap(vq, vq + i);
   }
   // Queue is full (size is NUM_COEFS)
 
-  for (/*i = NUM_COEFS+1*/; i < NUM_PIXELS_SQUARED; i++) {
-    val.d = ABS(cdata[i]);
-
-    if (val.d > vq.top().d) {
-      // Make room by dropping smallest entry:
-      vq.pop();
-      // Insert val as new entry:
-      val.i = i;
-      vq.push(val);
-    }
-    // else discard: do nothing
+  while ((i = haar->find_larger(cdata, i, vq[0].d)) < NUM_PIXELS_SQUARED) {
+    // Make room by dropping smallest entry:
+    std::pop_heap(vq, vq + NUM_COEFS);
+    // Insert val as new entry:
+    vq[NUM_COEFS-1].i = i;
+    vq[NUM_COEFS-1].d = ABS(cdata[i]);
+    std::push_heap(vq, vq + NUM_COEFS);
+    i++;
   }
 
-  // Empty the (non-empty) queue and fill-in sig:
-  cnt=0;
-  do {
+  // Empty the queue and fill-in sig:
+  for (cnt = 0; cnt < NUM_COEFS; cnt++) {
     int t;
 
-    val = vq.top();
-    t = (cdata[val.i] <= 0);	/* t = 0 if pos else 1 */
+    t = (cdata[vq[0].i] <= 0);	/* t = 0 if pos else 1 */
     /* i - 0 ^ 0 = i; i - 1 ^ 0b111..1111 = 2-compl(i) = -i */
-    sig[cnt++] = (val.i - t) ^ -t; // never 0
-    vq.pop();
-  } while(!vq.empty());
-  // Must have cnt==NUM_COEFS here.
+    sig[cnt] = (vq[0].i - t) ^ -t; // never 0
+    std::pop_heap(vq, vq + NUM_COEFS - cnt);
+  }
 }
 
 // Determines a total of NUM_COEFS positions in the image that have the
 // largest magnitude (absolute value) in color value. Returns linearized
 // coordinates in sig1, sig2, and sig3. avgl are the [0,0] values.
 // The order of occurrence of the coordinates in sig doesn't matter.
-// Complexity is 3 x NUM_PIXELS^2 x 2log(NUM_COEFS).
+// Complexity is 3 x NUM_PIXELS^2, plus 3 x NUM_COEFS x log(NUM_PIXELS^2 / NUM_COEFS) x 2log(NUM_COEFS)
+// for the values that go through the queue.
 int
 calcHaar(Unit *cdata1, Unit *cdata2, Unit *cdata3,
 	 Idx *sig1, Idx *sig2, Idx *sig3, double *avgl)
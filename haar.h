@@ -63,6 +63,13 @@ typedef std::priority_queue < valStruct > valqueue;
 //#define min(a, b)  (((a) > (b)) ? (b) : (a))
 
 void initImgBin();
+
+// Name of the transform implementation in use, and use another one ("avx2",
+// "sse2" or "scalar") instead. Returns false if it is not available. They
+// all give the same results, the fastest one available is used by default.
+const char* haarImpl();
+bool haarUse(const char* impl);
+
 void transform(Unit* a, Unit* b, Unit* c);
 void transformChar(unsigned char* c1, unsigned char* c2, unsigned char* c3, Unit* a, Unit* b, Unit* c);
 int calcHaar(Unit* cdata1, Unit* cdata2, Unit* cdata3, Idx* sig1, Idx* sig2, Idx* sig3, double * avgl);
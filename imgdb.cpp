@@ -28,19 +28,28 @@
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <ctime> 
 #include <limits>
 
 /* STL includes */
 #include <algorithm>
+#include <set>
 #include <vector>
 
 /* iqdb includes */
 #include "imgdb.h"
 #include "imglib.h"
 #include "debug.h"
+#include "worker_pool.h"
+#ifdef USE_DELTA_QUEUE
+#include "delta_scan.h"
+#endif
+#include "lumin_scan.h"
+#include "mem_policy.h"
 
 extern int debug_level;
 
@@ -64,6 +73,34 @@ static size_t pageMask = 0;
 static size_t pageImgs = 0;
 static size_t pageImgMask = 0;
 
+// Threads to split up queries in simple mode, NULL to query in the calling thread only.
+static worker_pool* query_pool = NULL;
+// Minimum number of images in each part of a query worth its own thread.
+static const size_t query_part_images = 32768;
+// Number of images to score at a time in simple mode, 0 for all. The default
+// keeps the scores of one tile (4 bytes per image) within a typical L2 cache.
+static size_t query_tile_images = 65536;
+// Smallest tile for a batch of queries, below which walking the buckets takes longer.
+static const size_t query_tile_min = 4096;
+// Most scores each thread of a batch of queries keeps at a time. Larger
+// batches are run in several parts.
+static const size_t query_batch_scores = 16 << 20;
+// Number of images a flag_rerank query scores from their signatures, and how
+// many bucket entries per image in the DB it reads to find them.
+static size_t rerank_candidates = 256;
+static double rerank_entries = 0.25;
+// Number of signatures to read at a time when filling the buckets with several threads.
+static const size_t load_chunk_images = 16384;
+// Whether loading writes the base lists of the buckets in place, into one
+// array sized by first counting their entries.
+#ifdef USE_DELTA_QUEUE
+static const bool load_arena = true;
+#else
+static const bool load_arena = false;
+#endif
+// Whether to copy bucket arenas to each NUMA node.
+static bool numa_replicas = false;
+
 /* Endianness */
 #if CONV_LE && (__BIG_ENDIAN__ || _BIG_ENDIAN || BIG_ENDIAN)
 #define CONV_ENDIAN 1
@@ -112,6 +149,123 @@ inline void mapped_file::unmap() {
 		DEBUG(errors)("WARNING: Could not unmap %zd bytes of memory.\n", m_length);
 }
 
+void sig_store::map(const char* filename, offset_t offset, size_t count) {
+	if (size()) throw internal_error("Can't map signatures into a non-empty store.");
+	if (!count) return;
+
+	offset_t page = offset & ~(offset_t)pageMask;
+	size_t length = offset - page + count * sizeof(ImgData);
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	void* base;
+	if (fd == -1 || fstat(fd, &st)) {
+		if (fd != -1) close(fd);
+		throw io_error(std::string("Can't open DB file ")+filename+": "+strerror(errno));
+	}
+	if ((offset_t) st.st_size < page + length) {
+		close(fd);
+		throw data_error("Image signatures are truncated.");
+	}
+	// Private, so that changes to the signatures do not end up in the file.
+	if ((base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, page)) == MAP_FAILED) {
+		close(fd);
+		throw io_error(std::string("Can't map DB file ")+filename+": "+strerror(errno));
+	}
+	close(fd);
+
+	m_map = mapped_file(base, length);
+	m_sigs = (char*) base + (offset - page);
+	m_mapped = count;
+}
+
+void sig_store::clear() {
+	m_map.unmap();
+	m_map = mapped_file();
+	m_sigs = NULL;
+	m_mapped = 0;
+	std::vector<ImgData>().swap(m_added);
+}
+
+void sig_store::read(size_t ind, ImgData* sig) const {
+	if (ind < m_mapped)
+		memcpy(sig, m_sigs + ind * sizeof(ImgData), sizeof(ImgData));
+	else if (ind - m_mapped < m_added.size())
+		*sig = m_added[ind - m_mapped];
+	else
+		throw internal_error("Signature index out of range.");
+}
+
+void sig_store::write(size_t ind, const ImgData* sig) {
+	if (ind < m_mapped)
+		memcpy(m_sigs + ind * sizeof(ImgData), sig, sizeof(ImgData));
+	else if (ind - m_mapped < m_added.size())
+		m_added[ind - m_mapped] = *sig;
+	else if (ind - m_mapped == m_added.size())
+		m_added.push_back(*sig);
+	else
+		throw internal_error("Signature index out of range.");
+}
+
+void sig_store::truncate(size_t count) {
+	if (count < m_mapped) {
+		m_mapped = count;
+		std::vector<ImgData>().swap(m_added);
+	} else if (count - m_mapped < m_added.size()) {
+		std::vector<ImgData>(m_added.begin(), m_added.begin() + (count - m_mapped)).swap(m_added);
+	}
+}
+
+void image_index_hash::add_index(imageId id, size_t index) {
+	if ((m_size + 1) * 4 > m_slots.size() * 3) reserve(m_size + 1);
+
+	size_t i = slot(id);
+	while (m_slots[i].index != npos && m_slots[i].id != id)
+		i = (i + 1) & m_mask;
+	if (m_slots[i].index == npos) {
+		m_slots[i].id = id;
+		m_size++;
+	}
+	m_slots[i].index = index;
+}
+
+void image_index_hash::erase(imageId id) {
+	if (!m_size) return;
+
+	size_t i = slot(id);
+	for (; m_slots[i].id != id; i = (i + 1) & m_mask)
+		if (m_slots[i].index == npos) return;
+	if (m_slots[i].index == npos) return;
+
+	// Move back each following entry of the run that would not be found
+	// anymore after emptying slot i, i.e. whose home slot is not after i.
+	for (size_t j = (i + 1) & m_mask; m_slots[j].index != npos; j = (j + 1) & m_mask) {
+		size_t home = slot(m_slots[j].id);
+		if (((j - home) & m_mask) >= ((j - i) & m_mask)) {
+			m_slots[i] = m_slots[j];
+			i = j;
+		}
+	}
+	m_slots[i].index = npos;
+	m_size--;
+}
+
+void image_index_hash::reserve(size_t count) {
+	// At most 3/4 full.
+	size_t slots = 16;
+	while (slots * 3 < count * 4) slots *= 2;
+	if (slots <= m_slots.size()) return;
+
+	entry empty;
+	empty.id = 0;
+	empty.index = npos;
+	std::vector<entry> old(slots, empty);
+	old.swap(m_slots);
+	m_mask = slots - 1;
+	m_size = 0;
+	for (std::vector<entry>::const_iterator itr = old.begin(); itr != old.end(); ++itr)
+		if (itr->index != npos) add_index(itr->id, itr->index);
+}
+
 int tempfile() {
 	char tempnam[] = "/tmp/imgdb_cache.XXXXXXX";
 	int fd = mkstemp(tempnam);
@@ -152,12 +306,17 @@ imageIdIndex_map<true> imageIdIndex_list<true, false>::map_all(bool writable) {
 //fprintf(stderr, "Using fake map of tail data.\n");
 		return imageIdIndex_map<true>();
 	}
+#ifdef USE_BLOCK_QUEUE
+	// Block queues and the disk cache cannot be used at the same time.
+	throw internal_error("Disk cache not supported with block queues.");
+#else
 	imageIdPage& page = m_pages.front();
 	size_t length = page.second + m_baseofs;
 //fprintf(stderr, "Directly mapping %zd bytes. ", length);
 	void* base = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, m_fd, page.first);
 	if (base == MAP_FAILED) throw memory_error("Failed to mmap bucket.");
 	return imageIdIndex_map<true>(base, (size_t*)(((char*)base)+m_baseofs), (size_t*)(((char*)base)+m_baseofs)+m_size, length);
+#endif
 }
 
 template<>
@@ -177,7 +336,8 @@ imageIdIndex_map<false> imageIdIndex_list<false, false>::map_all(bool writable)
 	void* base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
 	if (base == MAP_FAILED) throw memory_error("Failed to mmap bucket.");
 
-	imageIdIndex_map<false> mapret(base, (image_id_index*)base, (image_id_index*)base+m_capacity, len);
+	// Only reading needs to stop at the last image, writing fills the whole capacity.
+	imageIdIndex_map<false> mapret(base, (image_id_index*)base, (image_id_index*)base+(writable ? m_capacity : m_size), len);
 	char* chunk = (char*) base;
 	for (page_list::iterator itr = m_pages.begin(); itr != m_pages.end(); ++itr) {
 //fprintf(stderr, "Using %zd bytes from ofs %llx. ", itr->second, (long long int) itr->first);
@@ -266,25 +426,236 @@ void imageIdIndex_list<false, false>::remove(image_id_index i) {
 void imageIdIndex_list<true, true>::set_base() {
 	if (!m_base.empty()) return;
 
-#ifdef USE_DELTA_QUEUE
+#if defined(USE_BLOCK_QUEUE)
+	m_tail.finish();
+	m_base.swap(m_tail);
+#elif defined(USE_DELTA_QUEUE)
 	if (m_tail.base_size() * 17 / 16 + 16 < m_tail.base_capacity()) {
 		container copy;
 		copy.reserve(m_tail.base_size(), true);
 		for (container::iterator itr = m_tail.begin(); itr != m_tail.end(); ++itr)
 			copy.push_back(*itr);
 
-		m_base.swap(copy);
+		m_store.swap(copy);
 		copy = container();
 		m_tail.swap(copy);
 	} else {
-		m_base.swap(m_tail);
+		m_store.swap(m_tail);
+	}
+	m_base = delta_queue_view(m_store);
+
+	m_seekStore.resize(seek_count(m_base.size()));
+	m_numSeek = m_seekStore.size();
+	if (m_numSeek) {
+		find_seek(m_base, &m_seekStore.front());
+		m_seek = &m_seekStore.front();
 	}
 #else
 	m_base.swap(m_tail);
 #endif
 }
 
+void imageIdIndex_list<true, true>::find_seek(const delta_queue_view& base, delta_queue_view::position* seek) {
+	if (base.size() <= seek_interval) return;
+
+	size_t num = 0;
+	for (delta_queue_view::const_iterator itr = base.begin(); itr != base.end(); ++itr, ++num)
+		if (!(num % seek_interval)) *seek++ = base.save(itr);
+}
+
+void imageIdIndex_list<true, true>::set_base(const delta_queue_view& base, const delta_queue_view::position* seek, size_t num_seek) {
+	if (!m_base.empty()) throw internal_error("Base list already set.");
+
+#if defined(USE_BLOCK_QUEUE)
+	m_base.reserve(base.size());
+	for (delta_queue_view::const_iterator itr = base.begin(); itr != base.end(); ++itr)
+		m_base.push_back(*itr);
+	m_base.finish();
+#elif defined(USE_DELTA_QUEUE)
+	m_base = base;
+	m_seek = seek;
+	m_numSeek = num_seek;
+#else
+	m_base.reserve(base.size());
+	for (delta_queue_view::const_iterator itr = base.begin(); itr != base.end(); ++itr)
+		m_base.push_back(image_id_index(*itr, true));
+#endif
+}
+
+void imageIdIndex_list<true, true>::set_base(const delta_queue_view& base, delta_queue_view::position* seek) {
+#ifdef USE_DELTA_QUEUE
+	find_seek(base, seek);
+#endif
+	set_base(base, seek, seek_count(base.size()));
+}
+
+void imageIdIndex_list<true, true>::relocate(const delta_value* begin, const delta_value* end, ptrdiff_t offset) {
+#ifdef USE_DELTA_QUEUE
+	if (!uses(begin, end)) return;
+	m_base = delta_queue_view((const delta_value*) ((const char*) m_base.words() + offset), m_base.num_words(), m_base.size());
+	if (m_seek) m_seek = (const delta_queue_view::position*) ((const char*) m_seek + offset);
+#endif
+}
+
+bool imageIdIndex_list<true, true>::uses(const delta_value* begin, const delta_value* end) const {
+#ifdef USE_DELTA_QUEUE
+	return m_base.words() >= begin && m_base.words() < end;
+#else
+	return false;
+#endif
+}
+
+// The index of a base or tail list entry, with or without delta queues.
+static inline size_t index_of(size_t ind) { return ind; }
+static inline size_t index_of(const image_id_index& ind) { return ind.index; }
+
+void imageIdIndex_list<true, true>::compact(const std::vector<bool>& removed, const size_t* renumber, bool copy) {
+	if (m_tail.empty() && !renumber && !copy) {
+		// Only rewrite the base list if it has removed images.
+		if (removed.empty()) return;
+		base_list::const_iterator itr(m_base.begin());
+		for (; itr != m_base.end(); ++itr) {
+			size_t ind = index_of(*itr);
+			if (ind < removed.size() && removed[ind]) break;
+		}
+		if (itr == m_base.end()) return;
+	}
+
+	container merged;
+	merged.reserve(size());
+	for (base_list::const_iterator itr(m_base.begin()); itr != m_base.end(); ++itr) {
+		size_t ind = index_of(*itr);
+		if (ind >= removed.size() || !removed[ind]) merged.push_back(image_id_index(renumber ? renumber[ind] : ind, true));
+	}
+	for (container::const_iterator itr(m_tail.begin()); itr != m_tail.end(); ++itr) {
+		size_t ind = index_of(*itr);
+		if (ind >= removed.size() || !removed[ind]) merged.push_back(image_id_index(renumber ? renumber[ind] : ind, true));
+	}
+
+	// Then make it the new base list, as if it had just been loaded.
+	m_base = base_list();
+#ifdef USE_DELTA_QUEUE
+	m_seek = NULL;
+	m_numSeek = 0;
+	m_seekStore.clear();
+	m_store = container();
+#endif
+	m_tail.swap(merged);
+	set_base();
+}
+
+struct seek_less {
+	bool operator() (const delta_queue_view::position& pos, size_t ind) const { return pos.bval < ind; }
+};
+
+imageIdIndex_map<true>::iterator imageIdIndex_list<true, true>::seek(const imageIdIndex_map<true>& map, size_t ind) const {
+#if defined(USE_BLOCK_QUEUE)
+	return m_base.lower_bound(ind);
+#elif defined(USE_DELTA_QUEUE)
+	// Start from the last remembered position before ind, then skip forward.
+	const delta_queue_view::position* start = std::lower_bound(m_seek, m_seek + m_numSeek, ind, seek_less());
+	imageIdIndex_map<true>::iterator itr = start == m_seek ? map.m_img : imageIdIndex_map<true>::iterator(m_base.restore(*(start - 1)));
+	while (itr != map.m_end && *itr < ind) ++itr;
+	return itr;
+#else
+	imageIdIndex_map<true>::iterator itr = map.m_img;
+	itr.m_p = std::lower_bound(map.m_img.m_p, map.m_end.m_p, image_id_index(ind, true), index_less());
+	return itr;
+#endif
+}
+
+void bucket_arena::allocate(const delta_counter* counters, size_t count) {
+	release();
+	if (!count) return;
+
+	m_offsets.resize(count);
+	size_t words = 0, seek = 0;
+	for (size_t bucket = 0; bucket < count; bucket++) {
+		m_offsets[bucket].words = words;
+		m_offsets[bucket].seek = seek;
+		words += counters[bucket].words();
+		seek += imageIdIndex_list<true, true>::seek_count(counters[bucket].size());
+	}
+
+	size_t length = words * sizeof(delta_value) + seek * sizeof(delta_queue_view::position);
+	void* base = mem_policy::map(length);
+
+	m_map = mapped_file(base, length);
+	m_words = (delta_value*) base;
+	m_seek = (delta_queue_view::position*) (m_words + words);
+}
+
+void bucket_arena::release() {
+	release_old();
+	for (std::vector<mapped_file>::iterator itr = m_copies.begin(); itr != m_copies.end(); ++itr)
+		itr->unmap();
+	m_copies.clear();
+	m_local.clear();
+
+	m_map.unmap();
+	m_map = mapped_file();
+	m_offsets.clear();
+	m_words = NULL;
+	m_seek = NULL;
+}
+
+ptrdiff_t bucket_arena::replicate() {
+	unsigned int nodes = mem_policy::nodes();
+	if (nodes < 2 || !m_map.m_base || !m_copies.empty()) return 0;
+
+	// Each copy is written by a thread on its node, so that its pages are put there.
+	std::vector<mapped_file> copies;
+	try {
+		for (unsigned int node = 0; node < nodes; node++) {
+			mem_policy::bind_node bind(node);
+			size_t length = m_map.m_length;
+			void* base = mem_policy::map(length);
+			copies.push_back(mapped_file(base, length));
+			memcpy(base, m_map.m_base, m_map.m_length);
+		}
+	} catch (const memory_error&) {
+		for (std::vector<mapped_file>::iterator itr = copies.begin(); itr != copies.end(); ++itr)
+			itr->unmap();
+		throw;
+	}
+
+	ptrdiff_t moved = (char*) copies.front().m_base - (char*) m_map.m_base;
+	m_old = m_map;
+	m_map = copies.front();
+	m_words = (delta_value*) ((char*) m_words + moved);
+	m_seek = (delta_queue_view::position*) ((char*) m_seek + moved);
+
+	m_local.resize(nodes);
+	for (unsigned int node = 0; node < nodes; node++)
+		m_local[node] = (char*) copies[node].m_base - (char*) m_map.m_base;
+	m_copies.assign(copies.begin() + 1, copies.end());
+	return moved;
+}
+
+void bucket_arena::release_old() {
+	m_old.unmap();
+	m_old = mapped_file();
+}
+
+ptrdiff_t bucket_arena::local() const {
+	return m_local.empty() ? 0 : m_local[mem_policy::node()];
+}
+
 int dbSpace::mode_from_name(const char* mode_name) {
+	// A simple or read-only mode DB split into shards, e.g. "simple:8".
+	const char* shards = strchr(mode_name, ':');
+	if (shards) {
+		char* end;
+		unsigned long num = strtoul(shards + 1, &end, 10);
+		if (end == shards + 1 || *end || !num || num > (dbSpaceCommon::mode_mask_shards >> dbSpaceCommon::mode_shift_shards))
+			throw param_error("Invalid number of shards.");
+
+		int mode = mode_from_name(std::string(mode_name, shards).c_str());
+		if ((mode & (dbSpaceCommon::mode_mask_simple | dbSpaceCommon::mode_mask_alter)) != dbSpaceCommon::mode_mask_simple)
+			throw param_error("Only simple and read-only mode can be sharded.");
+		return mode | num << dbSpaceCommon::mode_shift_shards;
+	}
+
 	if (!strcmp(mode_name, "normal"))
 		return imgdb::dbSpace::mode_normal;
 	else if (!strcmp(mode_name, "readonly"))
@@ -299,17 +670,16 @@ int dbSpace::mode_from_name(const char* mode_name) {
 		throw param_error("Unknown mode name.");
 }
 
-// Specializations accessing images as SigStruct* or size_t map, and imageIdIndex_map as imageId or index map.
-template<> inline dbSpaceImpl<false>::imageIterator dbSpaceImpl<false>::image_begin() { return imageIterator(m_images.begin(), *this); }
-template<> inline dbSpaceImpl<false>::imageIterator dbSpaceImpl<false>::image_end() { return imageIterator(m_images.end(), *this); }
-template<> inline dbSpaceImpl<true>::imageIterator dbSpaceImpl<true>::image_begin() { return imageIterator(m_info.begin(), *this); }
-template<> inline dbSpaceImpl<true>::imageIterator dbSpaceImpl<true>::image_end() { return imageIterator(m_info.end(), *this); }
+template<bool is_simple>
+inline typename dbSpaceImpl<is_simple>::imageIterator dbSpaceImpl<is_simple>::image_begin() { return imageIterator(m_info.begin(), *this); }
+template<bool is_simple>
+inline typename dbSpaceImpl<is_simple>::imageIterator dbSpaceImpl<is_simple>::image_end() { return imageIterator(m_info.end(), *this); }
 
 template<bool is_simple>
 inline typename dbSpaceImpl<is_simple>::imageIterator dbSpaceImpl<is_simple>::find(imageId i) { 
-	map_iterator itr = m_images.find(i);
-	if (itr == m_images.end()) throw invalid_id("Invalid image ID.");
-	return imageIterator(itr, *this);
+	size_t ind = m_images.find(i);
+	if (ind == image_index_hash::npos) throw invalid_id("Invalid image ID.");
+	return imageIterator(m_info.begin() + ind, *this);
 }
 
 inline dbSpaceAlter::ImageMap::iterator dbSpaceAlter::find(imageId i) {
@@ -318,8 +688,6 @@ inline dbSpaceAlter::ImageMap::iterator dbSpaceAlter::find(imageId i) {
 	return itr;
 }
 
-static const size_t no_cacheOfs = ~size_t();
-
 void initImgBin()
 {
 	imgBinInited = 1;
@@ -364,7 +732,7 @@ void initImgBin()
 
 template<bool is_simple>
 bool dbSpaceImpl<is_simple>::hasImage(imageId id) {
-	return m_images.find(id) != m_images.end();
+	return m_images.find(id) != image_index_hash::npos;
 }
 
 bool dbSpaceAlter::hasImage(imageId id) {
@@ -372,10 +740,10 @@ bool dbSpaceAlter::hasImage(imageId id) {
 }
 
 template<bool is_simple>
-inline ImgData dbSpaceImpl<is_simple>::get_sig_from_cache(imageId id) {
-	if (is_simple && m_sigFile == -1) throw usage_error("Not supported in simple mode.");
+inline ImgData dbSpaceImpl<is_simple>::get_sig(imageId id) {
+	if (!m_withSigs) throw usage_error("Not supported in simple mode.");
 	ImgData sig;
-	read_sig_cache(find(id).cOfs(), &sig);
+	m_sigs.read(find(id).index(), &sig);
 	return sig;
 }
 
@@ -414,10 +782,44 @@ bool dbSpaceCommon::isImageGrayscale(imageId id) {
 	return is_grayscale(avgl);
 }
 
+struct dbSpaceCommon::sig_workspace {
+	unsigned char chan[3][NUM_PIXELS*NUM_PIXELS];
+	Unit cdata[3][NUM_PIXELS*NUM_PIXELS];
+#if LIB_GD
+	box_scaler scaler;
+#endif
+
+	// The calling thread's workspace, created when first used and deleted when the thread exits.
+	static sig_workspace& get();
+
+private:
+	static void create_key() { if (pthread_key_create(&key, &destroy)) key_failed = true; }
+	static void destroy(void* ws) { delete (sig_workspace*) ws; }
+
+	static pthread_key_t key;
+	static pthread_once_t once;
+	static bool key_failed;
+};
+
+pthread_key_t dbSpaceCommon::sig_workspace::key;
+pthread_once_t dbSpaceCommon::sig_workspace::once = PTHREAD_ONCE_INIT;
+bool dbSpaceCommon::sig_workspace::key_failed = false;
+
+dbSpaceCommon::sig_workspace& dbSpaceCommon::sig_workspace::get() {
+	pthread_once(&once, &create_key);
+	if (key_failed) throw memory_error("Can't create signature workspace key.");
+
+	sig_workspace* ws = (sig_workspace*) pthread_getspecific(key);
+	if (!ws) {
+		AutoCleanPtr<sig_workspace> new_ws(new sig_workspace);
+		if (pthread_setspecific(key, new_ws)) throw memory_error("Can't set signature workspace.");
+		ws = new_ws.detach();
+	}
+	return *ws;
+}
+
 void dbSpaceCommon::sigFromImage(Image* image, imageId id, ImgData* sig) {
-	AutoCleanArray<unsigned char> rchan(NUM_PIXELS*NUM_PIXELS);
-	AutoCleanArray<unsigned char> gchan(NUM_PIXELS*NUM_PIXELS);
-	AutoCleanArray<unsigned char> bchan(NUM_PIXELS*NUM_PIXELS);
+	sig_workspace& ws = sig_workspace::get();
 
 #if LIB_ImageMagick
 	AutoExceptionInfo exception;
@@ -444,9 +846,9 @@ void dbSpaceCommon::sigFromImage(Image* image, imageId id, ImgData* sig) {
 	const PixelPacket *pixel_cache = AcquireImagePixels(image, 0, 0, NUM_PIXELS, NUM_PIXELS, &exception);
 
 	for (int idx = 0; idx < NUM_PIXELS*NUM_PIXELS; idx++) {
-		rchan[idx] = pixel_cache->red >> (QuantumDepth - 8);
-		gchan[idx] = pixel_cache->green >> (QuantumDepth - 8);
-		bchan[idx] = pixel_cache->blue >> (QuantumDepth - 8);
+		ws.chan[0][idx] = pixel_cache->red >> (QuantumDepth - 8);
+		ws.chan[1][idx] = pixel_cache->green >> (QuantumDepth - 8);
+		ws.chan[2][idx] = pixel_cache->blue >> (QuantumDepth - 8);
 		pixel_cache++;
 	}
 #elif LIB_GD
@@ -462,7 +864,7 @@ void dbSpaceCommon::sigFromImage(Image* image, imageId id, ImgData* sig) {
 		image = resized;
 	}
 
-	unsigned char* red = rchan.ptr(), *green = gchan.ptr(), *blue = bchan.ptr();
+	unsigned char* red = ws.chan[0], *green = ws.chan[1], *blue = ws.chan[2];
 	for (int** row = image->tpixels; row < image->tpixels + NUM_PIXELS; row++)
 	    for (int* col = *row, *end = *row + NUM_PIXELS; col < end; col++) {
 		*red++ = gdTrueColorGetRed(*col);
@@ -473,17 +875,18 @@ void dbSpaceCommon::sigFromImage(Image* image, imageId id, ImgData* sig) {
 #	error Unsupported image library.
 #endif
 
-	AutoCleanArray<Unit> cdata1(NUM_PIXELS*NUM_PIXELS);
-	AutoCleanArray<Unit> cdata2(NUM_PIXELS*NUM_PIXELS);
-	AutoCleanArray<Unit> cdata3(NUM_PIXELS*NUM_PIXELS);
-	transformChar(rchan.ptr(), gchan.ptr(), bchan.ptr(), cdata1.ptr(), cdata2.ptr(), cdata3.ptr());
-	calcHaar(cdata1.ptr(), cdata2.ptr(), cdata3.ptr(), sig->sig1, sig->sig2, sig->sig3, sig->avglf);
+	sigFromChannels(ws, sig);
+}
+
+void dbSpaceCommon::sigFromChannels(sig_workspace& ws, ImgData* sig) {
+	transformChar(ws.chan[0], ws.chan[1], ws.chan[2], ws.cdata[0], ws.cdata[1], ws.cdata[2]);
+	calcHaar(ws.cdata[0], ws.cdata[1], ws.cdata[2], sig->sig1, sig->sig2, sig->sig3, sig->avglf);
 }
 
 template<typename B>
 inline void dbSpaceCommon::bucket_set<B>::add(const ImgData& nsig, count_t index) {
 	lumin_int avgl;
-	SigStruct::avglf2i(nsig.avglf, avgl);
+	image_info::avglf2i(nsig.avglf, avgl);
 	for (int i = 0; i < NUM_COEFS; i++) {	// populate buckets
 
 
@@ -532,6 +935,19 @@ inline void dbSpaceCommon::bucket_set<B>::add(const ImgData& nsig, count_t index
 	}
 }
 
+template<typename B>
+template<typename F>
+inline void dbSpaceCommon::bucket_set<B>::for_each(const ImgData& nsig, F& f) {
+	lumin_int avgl;
+	image_info::avglf2i(nsig.avglf, avgl);
+	// Like add(), ignore the I/Q coefficients if chrominance is too low.
+	int colors = is_grayscale(avgl) ? 1 : 3;
+	const Idx* sig[3] = { nsig.sig1, nsig.sig2, nsig.sig3 };
+	for (int c = 0; c < colors; c++)
+		for (int i = 0; i < NUM_COEFS; i++)
+			if (sig[c][i]) f(at(c, sig[c][i]));
+}
+
 template<typename B>
 inline B& dbSpaceCommon::bucket_set<B>::at(int col, int coeff, int* idxret) {
 	int pn, idx;
@@ -553,25 +969,19 @@ inline B& dbSpaceCommon::bucket_set<B>::at(int col, int coeff, int* idxret) {
 	return buckets[col][pn][idx];
 }
 
-template<>
-void dbSpaceImpl<false>::addImageData(const ImgData* img) {
-	if (hasImage(img->id)) // image already in db
-		throw duplicate_id("Image already in database.");
-
-	SigStruct *nsig = new SigStruct(get_sig_cache());
-	nsig->init(img);
-	write_sig_cache(nsig->cacheOfs, img);
-
-	// insert into sigmap
-	m_images.add_sig(img->id, nsig);
-	// insert into ids bloom filter
-	//imgIdsFilter->insert(id);
-
-	imgbuckets.add(*img, m_nextIndex++);
+template<bool is_simple>
+inline void dbSpaceImpl<is_simple>::set_info(size_t ind, const ImgData& sig) {
+	image_info& info = m_info.at(ind);
+	info.id = sig.id;
+	image_info::avglf2i(sig.avglf, info.avgl);
+	info.width = sig.width;
+	info.height = sig.height;
+	m_lumin.set(ind, info);
+	m_images.add_index(sig.id, ind);
 }
 
-template<>
-void dbSpaceImpl<true>::addImageData(const ImgData* img) {
+template<bool is_simple>
+void dbSpaceImpl<is_simple>::addImageData(const ImgData* img) {
 	if (hasImage(img->id)) // image already in db
 		throw duplicate_id("Image already in database.");
 
@@ -579,22 +989,22 @@ void dbSpaceImpl<true>::addImageData(const ImgData* img) {
 	if (ind > m_info.size())
 		throw internal_error("Index incremented too much!");
 	if (ind == m_info.size()) {
-		if (ind >= m_info.capacity()) m_info.reserve(10 + ind + ind / 40);
+		if (ind >= m_info.capacity()) {
+			m_info.reserve(10 + ind + ind / 40);
+			m_lumin.reserve(10 + ind + ind / 40);
+		}
 		m_info.resize(ind+1);
+		m_lumin.resize(ind+1);
 	}
-	m_info.at(ind).id = img->id;
-	SigStruct::avglf2i(img->avglf, m_info[ind].avgl);
-	m_info[ind].width = img->width;
-	m_info[ind].height = img->height;
-	m_images.add_index(img->id, ind);
+	set_info(ind, *img);
 
-	if (m_sigFile != -1) {
-		size_t ofs = get_sig_cache();
-		if (ofs != ind * sizeof(ImgData)) throw internal_error("Index and cache out of sync!");
-		write_sig_cache(ofs, img);
+	if (m_withSigs) {
+		if (m_sigs.size() != ind) throw internal_error("Index and signatures out of sync!");
+		m_sigs.write(ind, img);
 	}
 
 	imgbuckets.add(*img, ind);
+	if (is_simple) m_deltaCount++;
 }
 
 void dbSpaceAlter::addImageData(const ImgData* img) {
@@ -603,6 +1013,8 @@ void dbSpaceAlter::addImageData(const ImgData* img) {
 	if (hasImage(img->id)) // image already in db
 		throw duplicate_id("Image already in database.");
 
+	copy_file();
+
 	size_t ind;
 	if (!m_deleted.empty()) {
 		ind = m_deleted.back();
@@ -677,32 +1089,37 @@ void dbSpaceCommon::imgDataFromBlob(const void* data, size_t data_size, imageId
 }
 
 #elif LIB_GD
+// JPEGs are decoded straight into the channels, other formats are resized with gd.
+void dbSpaceCommon::sigFromImageData(const unsigned char* data, size_t length, imageId id, ImgData* sig) {
+	sig_workspace& ws = sig_workspace::get();
+	if (!resize_jpeg_channels(data, length, NUM_PIXELS, NUM_PIXELS, ws.chan[0], ws.chan[1], ws.chan[2], &ws.scaler)) {
+		AutoGDImage image(resize_image_data(data, length, NUM_PIXELS, NUM_PIXELS, true));
+		return sigFromImage(image, id, sig);
+	}
+
+	// Same as what sigFromImage finds in the resized image.
+	sig->id = id;
+	sig->width = NUM_PIXELS;
+	sig->height = NUM_PIXELS;
+	sigFromChannels(ws, sig);
+}
+
 void dbSpaceCommon::addImageBlob(imageId id, const void *blob, size_t length) {
 	if (hasImage(id)) // image already in db
 		throw duplicate_id("Image already in database.");
 
-	::image_info info;
-	get_image_info((const unsigned char*) blob, length, &info);
-
-	AutoGDImage image(resize_image_data((const unsigned char*) blob, length, NUM_PIXELS, NUM_PIXELS, true));
-
 	ImgData sig;
-	sigFromImage(image, id, &sig);
+	sigFromImageData((const unsigned char*) blob, length, id, &sig);
 	return addImageData(&sig);
 }
 
 void dbSpaceCommon::imgDataFromFile(const char* filename, imageId id, ImgData* img) {
 	AutoClean<mapped_file, &mapped_file::unmap> map(mapped_file(filename, false));
-	AutoGDImage image(resize_image_data((const unsigned char*) map.m_base, map.m_length, NUM_PIXELS, NUM_PIXELS, true));
-	sigFromImage(image, id, img);
+	sigFromImageData((const unsigned char*) map.m_base, map.m_length, id, img);
 }
 
 void dbSpaceCommon::imgDataFromBlob(const void* data, size_t data_size, imageId id, ImgData* img) {
-	::image_info info;
-	get_image_info((const unsigned char*) data, data_size, &info);
-
-	AutoGDImage image(resize_image_data((const unsigned char*) data, data_size, NUM_PIXELS, NUM_PIXELS, true));
-	sigFromImage(image, id, img);
+	sigFromImageData((const unsigned char*) data, data_size, id, img);
 }
 
 #endif
@@ -724,20 +1141,19 @@ void dbSpace::imgDataFromBlob(const void* data, size_t data_size, imageId id, Im
 	return dbSpaceCommon::imgDataFromBlob(data, data_size, id, img);
 }
 
-template<>
-void dbSpaceImpl<false>::setImageRes(imageId id, int width, int height) {
+template<bool is_simple>
+void dbSpaceImpl<is_simple>::setImageRes(imageId id, int width, int height) {
 	imageIterator itr = find(id);
+	itr->width = width;
+	itr->height = height;
+	m_lumin.set(itr.index(), *itr);
+	if (!m_withSigs) return;
+
 	ImgData sig;
-	read_sig_cache(itr.cOfs(), &sig);
+	m_sigs.read(itr.index(), &sig);
 	sig.width = width;
 	sig.height = height;
-	write_sig_cache(itr.cOfs(), &sig);
-}
-
-template<> void dbSpaceImpl<true>::setImageRes(imageId id, int width, int height) {
-	imageIterator itr = find(id);
-	itr->width = width;
-	itr->height = height;
+	m_sigs.write(itr.index(), &sig);
 }
 
 void dbSpaceAlter::setImageRes(imageId id, int width, int height) {
@@ -745,6 +1161,7 @@ void dbSpaceAlter::setImageRes(imageId id, int width, int height) {
 		throw usage_error("Not possible in imgdata mode.");
 
 	size_t ind = find(id)->second;
+	copy_file();
 	ImgData sig = get_sig(ind);
 	m_f->seekg(m_sigOff + ind * sizeof(ImgData));
 	m_f->read(&sig);
@@ -754,6 +1171,137 @@ void dbSpaceAlter::setImageRes(imageId id, int width, int height) {
 	m_f->write(sig);
 }
 
+// With several parts, the images are added in chunks. Each part first sorts
+// the bucket entries of its share of the chunk by the part of the bucket.
+// Then each part adds the entries of its buckets, those of the first share
+// of images first, so that the buckets get them in the same order as when
+// adding one image at a time.
+//
+// Instead of adding them to the buckets, the entries can also be counted by
+// a delta_counter or written by a delta_writer for each bucket.
+template<bool is_simple>
+class dbSpaceImpl<is_simple>::load_job : public worker_pool::job {
+public:
+	load_job(buckets_t& buckets, worker_pool* pool, unsigned int parts)
+	  : m_buckets(buckets), m_pool(pool), m_parts(parts), m_counters(NULL), m_writers(NULL), m_arena(NULL), m_index(0), m_step(step_sort), m_entries(parts * parts) { }
+
+	void set_counters(delta_counter* counters) { m_counters = counters; m_writers = NULL; }
+	// The writers write to the arena, which also gets the seek positions.
+	void set_writers(delta_writer* writers, bucket_arena* arena) { m_counters = NULL; m_writers = writers; m_arena = arena; }
+
+	// Add the entries of the image, which must have the next index.
+	void add(const ImgData& sig, count_t index) {
+		if (m_parts == 1) {
+			adder add(*this, sig.id, index);
+			m_buckets.for_each(sig, add);
+			return;
+		}
+
+		if (m_chunk.empty()) m_index = index;
+		m_chunk.push_back(sig);
+		if (m_chunk.size() == load_chunk_images) flush();
+	}
+
+	// Add the entries of the images still in the chunk.
+	void flush() {
+		if (m_chunk.empty()) return;
+		m_step = step_sort;
+		m_pool->run(*this, m_parts);
+		m_step = step_add;
+		m_pool->run(*this, m_parts);
+		m_chunk.clear();
+	}
+
+	// Move the buckets into their base lists, or use the written words as base lists.
+	void finish() {
+		flush();
+		m_step = step_finish;
+		if (m_parts > 1)
+			m_pool->run(*this, m_parts);
+		else
+			run(0);
+	}
+
+	virtual void run(unsigned int part) {
+		if (m_step == step_sort) {
+			sorter sort(*this, part);
+			for (size_t i = m_chunk.size() * part / m_parts; i < m_chunk.size() * (part + 1) / m_parts; i++) {
+				sort.m_sig = i;
+				m_buckets.for_each(m_chunk[i], sort);
+			}
+		} else if (m_step == step_add) {
+			for (unsigned int share = 0; share < m_parts; share++) {
+				entry_list& entries = m_entries[share * m_parts + part];
+				for (typename entry_list::const_iterator itr = entries.begin(); itr != entries.end(); ++itr)
+					add_entry(itr->bucket, m_chunk[itr->sig].id, m_index + itr->sig);
+				entries.clear();
+			}
+		} else {
+			for (typename buckets_t::iterator itr = m_buckets.begin(); itr != m_buckets.end(); ++itr) {
+				size_t bucket = itr - m_buckets.begin();
+				if (buckets_t::part_of(bucket, m_parts) != part) continue;
+				if (m_writers)
+					itr->set_base(m_writers[bucket].view(), m_arena->seek(bucket));
+				else
+					itr->set_base();
+			}
+		}
+	}
+
+private:
+	enum step { step_sort, step_add, step_finish };
+
+	void add_entry(size_t bucket, imageId id, count_t index) {
+		if (m_counters)
+			m_counters[bucket].push_back(index);
+		else if (m_writers)
+			m_writers[bucket].push_back(index);
+		else
+			m_buckets.begin()[bucket].add(id, index);
+	}
+
+	struct entry {
+		entry(uint32_t b, uint32_t s) : bucket(b), sig(s) { }
+		uint32_t bucket;
+		uint32_t sig;
+	};
+	typedef std::vector<entry> entry_list;
+
+	struct sorter {
+		sorter(load_job& job, unsigned int share) : m_job(job), m_share(share) { }
+		void operator() (bucket_type& bucket) {
+			uint32_t ind = &bucket - m_job.m_buckets.begin();
+			m_job.m_entries[m_share * m_job.m_parts + buckets_t::part_of(ind, m_job.m_parts)].push_back(entry(ind, m_sig));
+		}
+		load_job& m_job;
+		unsigned int m_share;
+		uint32_t m_sig;
+	};
+
+	struct adder {
+		adder(load_job& job, imageId id, count_t index) : m_job(job), m_id(id), m_index(index) { }
+		void operator() (bucket_type& bucket) { m_job.add_entry(&bucket - m_job.m_buckets.begin(), m_id, m_index); }
+		load_job& m_job;
+		imageId m_id;
+		count_t m_index;
+	};
+
+	buckets_t& m_buckets;
+	worker_pool* m_pool;
+	unsigned int m_parts;
+	delta_counter* m_counters;
+	delta_writer* m_writers;
+	bucket_arena* m_arena;
+
+	// The images to add next, the first having index m_index.
+	std::vector<ImgData> m_chunk;
+	count_t m_index;
+	step m_step;
+
+	// Entries of each share of the images, for each part of the buckets.
+	std::vector<entry_list> m_entries;
+};
+
 template<bool is_simple>
 void dbSpaceImpl<is_simple>::load(const char* filename) {
 	db_ifstream f(filename);
@@ -778,15 +1326,15 @@ void dbSpaceImpl<is_simple>::load(const char* filename) {
 		f.read<int>(); f.read<int>(); f.read<int>();
 	}
 
-	if (version > SRZ_V0_9_0) {
-		throw data_error("Database from a version after 0.9.0");
+	if (version > SRZ_V0_10_0) {
+		throw data_error("Database from a version after 0.10.0");
 	} else if (version < SRZ_V0_7_0) {
 		return load_stream_old(f, version);
 	} else if (intsizes != SRZ_V_SZ) {
 		if (CONV_ENDIAN)
 			throw data_error("Cannot load database with both wrong endianness AND data sizes");
 		DEBUG(imgdb)("Loading db (converting data sizes)... ");
-	} else if (version == SRZ_V0_9_0) {
+	} else if (version == SRZ_V0_10_0) {
 		DEBUG(imgdb)("Loading db (cur ver)... ");
 	} else {
 		DEBUG(imgdb)("Loading db (old but compatible ver)... ");
@@ -799,12 +1347,34 @@ void dbSpaceImpl<is_simple>::load(const char* filename) {
 
 	count_t numImg = FLIPPED(f.read_size<count_t>(size_count));
 	offset_t firstOff = FLIPPED(f.read_size<offset_t>(size_offset));
+	offset_t indexOff = version >= SRZ_V0_10_0 ? FLIPPED(f.read_size<offset_t>(size_offset)) : 0;
 	DEBUG_CONT(imgdb)(DEBUG_OUT, "has %"FMT_count_t" images at %llx. ", numImg, (long long)firstOff);
 
+	// A shard only loads its part of the images.
+	count_t first = 0, last = numImg;
+	if (m_shards) {
+		first = (uint64_t) numImg * m_shard / m_shards->size();
+		last = (uint64_t) numImg * (m_shard + 1) / m_shards->size();
+		DEBUG_CONT(imgdb)(DEBUG_OUT, "shard %u has %" FMT_count_t "-%" FMT_count_t ". ", m_shard, first, last);
+	}
+
+	if (is_simple && indexOff && intsizes == SRZ_V_SZ && load_index(filename, indexOff, numImg, first, last)) {
+		// Read-only mode still needs the signatures for image ID queries.
+		if (m_withSigs) m_sigs.map(filename, firstOff + (offset_t) first * sizeof(ImgData), last - first);
+		DEBUG_CONT(imgdb)(DEBUG_OUT, "complete!\n");
+		f.close();
+		return;
+	}
+
+	// The arena needs another pass over the signatures, seeking to them.
+	bool arena = load_arena && is_simple && is_memory && intsizes == SRZ_V_SZ;
+
 	// read bucket sizes and reserve space so that buckets do not
 	// waste memory due to exponential growth of std::vector
-	for (typename buckets_t::iterator itr = imgbuckets.begin(); itr != imgbuckets.end(); ++itr)
-		itr->reserve(FLIPPED(f.read_size<count_t>(size_count)));
+	for (typename buckets_t::iterator itr = imgbuckets.begin(); itr != imgbuckets.end(); ++itr) {
+		count_t size = FLIPPED(f.read_size<count_t>(size_count));
+		if (!arena) itr->reserve((uint64_t) size * (last - first) / std::max<count_t>(numImg, 1));
+	}
 	DEBUG_CONT(imgdb)(DEBUG_OUT, "bucket sizes done at %llx... ", (long long)firstOff);
 
 	// read IDs (for verification only)
@@ -812,19 +1382,63 @@ void dbSpaceImpl<is_simple>::load(const char* filename) {
 	if (sizeof(imageId) == size_imageId) {
 		f.read(ids.ptr(), numImg);
 	} else {
-		for (typename image_map::size_type k = 0; k < numImg; k++)
+		for (count_t k = 0; k < numImg; k++)
 			ids[k] = f.read_size<imageId>(size_imageId);
 	}
 
-	for (typename image_map::size_type k = 0; k < numImg; k++)
+	for (count_t k = 0; k < numImg; k++)
 		FLIP(ids[k]);
 
-	// read sigs
-	f.seekg(firstOff);
-	if (is_simple) m_info.resize(numImg);
-	for (typename image_map::size_type k = 0; k < numImg; k++) {
+	// read sigs, directly from the file if they are in the native format
+	// and it has a query index. Alter mode changes files without an index
+	// in place, which would show through the private mapping.
+	bool mapped = m_withSigs && indexOff && intsizes == SRZ_V_SZ && !CONV_ENDIAN;
+	if (mapped)
+		m_sigs.map(filename, firstOff + (offset_t) first * sizeof(ImgData), last - first);
+	else if (m_withSigs)
+		m_sigs.reserve(last - first);
+
+	// With query threads, fill the buckets from chunks of signatures in parallel.
+	unsigned int parts = is_memory && query_pool ? query_pool->size() : 1;
+	load_job job(imgbuckets, query_pool, parts);
+
+	// With the arena, count the delta_queue words of each bucket first,
+	// then write them in place while loading.
+	std::vector<delta_writer> writers;
+	if (arena) {
+		std::vector<delta_counter> counters(imgbuckets.count());
+		job.set_counters(&counters.front());
+		f.seekg(firstOff + (offset_t) first * sizeof(ImgData));
+		for (count_t k = first; k < last; k++) {
+			ImgData sig;
+			if (mapped)
+				m_sigs.read(k - first, &sig);
+			else
+				f.read(&sig);
+			FLIP(sig.avglf[0]); FLIP(sig.avglf[1]); FLIP(sig.avglf[2]);
+			job.add(sig, m_nextIndex + k - first);
+		}
+		job.flush();
+
+		m_arena.allocate(&counters.front(), counters.size());
+		writers.reserve(counters.size());
+		for (size_t bucket = 0; bucket < counters.size(); bucket++)
+			writers.push_back(delta_writer(m_arena.words(bucket)));
+		job.set_writers(&writers.front(), &m_arena);
+		DEBUG_CONT(imgdb)(DEBUG_OUT, "bucket arena has %zd bytes... ", m_arena.bytes());
+	}
+
+	// Skip the signatures before the first one, by seeking if they have the native size.
+	count_t k = intsizes == SRZ_V_SZ ? first : 0;
+	f.seekg(firstOff + (offset_t) k * sizeof(ImgData));
+	m_info.resize(last - first);
+	m_lumin.resize(last - first);
+	m_images.reserve(last - first);
+	for (; k < last; k++) {
 		ImgData sig;
-		if (intsizes == SRZ_V_SZ) {
+		if (mapped) {
+			m_sigs.read(k - first, &sig);
+		} else if (intsizes == SRZ_V_SZ) {
 			f.read(&sig);
 		} else {
 			memset(&sig, 0, sizeof(sig));
@@ -836,54 +1450,151 @@ void dbSpaceImpl<is_simple>::load(const char* filename) {
 			sig.width = f.read_size<res_t>(size_res);
 			sig.height = f.read_size<res_t>(size_res);
 		}
+		if (k < first) continue;
 		FLIP(sig.id); FLIP(sig.width); FLIP(sig.height); FLIP(sig.avglf[0]); FLIP(sig.avglf[1]); FLIP(sig.avglf[2]);
 
 		size_t ind = m_nextIndex++;
-		imgbuckets.add(sig, ind);
+		job.add(sig, ind);
 
-		if (ids[ind] != sig.id) {
+		if (ids[k] != sig.id) {
 			if (is_simple) {
 				DEBUG_CONT(imgdb)(DEBUG_OUT, "\n");
-				DEBUG(warnings)("WARNING: index %zd DB header ID %08llx mismatch with sig ID %08llx.", ind, (long long)ids[ind], (long long) sig.id);
+				DEBUG(warnings)("WARNING: index %zd DB header ID %08llx mismatch with sig ID %08llx.", (size_t) k, (long long)ids[k], (long long) sig.id);
 			} else {
 				throw data_error("DB header ID mismatch with sig ID.");
 			}
 		}
 
-		if (is_simple) {
-			m_info[ind].id = sig.id;
-			SigStruct::avglf2i(sig.avglf, m_info[ind].avgl);
-			m_info[ind].width = sig.width;
-			m_info[ind].height = sig.height;
-			m_images.add_index(sig.id, ind);
-
-			if (m_sigFile != -1) {
-				size_t ofs = get_sig_cache();
-				if (ofs != ind * sizeof(ImgData)) throw internal_error("Index and cache out of sync!");
-				write_sig_cache(ofs, &sig);
-			}
-
-		} else {
-			SigStruct* nsig = new SigStruct(get_sig_cache());
-			nsig->init(&sig);
-			nsig->index = ind;
-			write_sig_cache(nsig->cacheOfs, &sig);
+		set_info(ind, sig);
 
-			// insert new sig
-			m_images.add_sig(sig.id, nsig);
-		}
+		if (m_withSigs && !mapped) m_sigs.write(ind, &sig);
 	}
 
 	if (is_simple && is_disk_db)
 		DEBUG_CONT(imgdb)(DEBUG_OUT, "map size: %lld... ", (long long int) lseek(imgbuckets[0][0][0].fd(), 0, SEEK_CUR));
 
-	for (typename buckets_t::iterator itr = imgbuckets.begin(); itr != imgbuckets.end(); ++itr)
-		itr->set_base();
+	job.finish();
+	if (arena) replicate_buckets();
 	m_bucketsValid = true;
 	DEBUG_CONT(imgdb)(DEBUG_OUT, "complete!\n");
 	f.close();
 }
 
+template<bool is_simple>
+void dbSpaceImpl<is_simple>::replicate_buckets() {
+	if (!numa_replicas || !m_arena.bytes()) return;
+
+	const delta_value* begin = m_arena.begin(), * end = m_arena.end();
+	ptrdiff_t moved = m_arena.replicate();
+	if (!moved) return;
+
+	for (typename buckets_t::iterator itr = imgbuckets.begin(); itr != imgbuckets.end(); ++itr)
+		itr->relocate(begin, end, moved);
+	m_arena.release_old();
+	DEBUG_CONT(imgdb)(DEBUG_OUT, "copied buckets to %zd NUMA nodes... ", m_arena.copies() + 1);
+}
+
+template<>
+bool dbSpaceImpl<false>::load_index(const char* filename, offset_t indexOff, count_t numImg, count_t first, count_t last) {
+	return false;
+}
+
+// Pass each index first <= i < last of a base list from a query index to
+// list as i - first, starting from the last seek position before first.
+template<typename L>
+static void copy_range(const delta_queue_view& base, const delta_queue_view::position* seek, size_t num_seek, size_t first, size_t last, L& list) {
+	const delta_queue_view::position* start = std::lower_bound(seek, seek + num_seek, first, seek_less());
+	delta_queue_view::const_iterator ind = start == seek ? base.begin() : base.restore(*(start - 1));
+	for (; ind != base.end() && *ind < last; ++ind)
+		if (*ind >= first) list.push_back(*ind - first);
+}
+
+template<>
+bool dbSpaceImpl<true>::load_index(const char* filename, offset_t indexOff, count_t numImg, count_t first, count_t last) {
+#if CONV_ENDIAN || defined(USE_DISK_CACHE)
+	return false;
+#else
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	void* base;
+	if (fd == -1 || fstat(fd, &st) || (base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		if (fd != -1) close(fd);
+		throw io_error(std::string("Can't map DB file ")+filename+": "+strerror(errno));
+	}
+	close(fd);
+	m_indexMap = mapped_file(base, st.st_size);
+
+	const char* index = (const char*) base + indexOff;
+	const db_index_header& hdr = *(const db_index_header*) index;
+	if (indexOff + sizeof(hdr) > (offset_t) st.st_size || indexOff & (sizeof(size_t) - 1))
+		throw data_error("Query index is truncated.");
+
+	if (hdr.word_size != sizeof(size_t) || hdr.images != numImg) {
+		DEBUG_CONT(imgdb)(DEBUG_OUT, "query index %s, ignoring it... ", hdr.images != numImg ? "is out of date" : "has the wrong word size");
+		m_indexMap.unmap();
+		m_indexMap = mapped_file();
+		return false;
+	}
+
+	if (hdr.info != sizeof(hdr) || hdr.buckets != hdr.info + numImg * sizeof(image_info)
+	    || hdr.words != hdr.buckets + imgbuckets.count() * sizeof(db_index_bucket)
+	    || hdr.seek < hdr.words || hdr.length < hdr.seek || indexOff + hdr.length > (offset_t) st.st_size
+	    || (hdr.seek - hdr.words) % sizeof(size_t) || (hdr.length - hdr.seek) % sizeof(delta_queue_view::position))
+		throw data_error("Query index is corrupted.");
+
+	DEBUG_CONT(imgdb)(DEBUG_OUT, "using query index at %llx... ", (long long)indexOff);
+	const image_info* info = (const image_info*) (index + hdr.info);
+	m_info.assign(info + first, info + last);
+	m_lumin.resize(last - first);
+	m_images.reserve(last - first);
+	for (size_t k = 0; k < last - first; k++) {
+		m_lumin.set(k, m_info[k]);
+		m_images.add_index(m_info[k].id, k);
+	}
+	m_nextIndex = last - first;
+
+	const db_index_bucket* bucket = (const db_index_bucket*) (index + hdr.buckets);
+	const delta_value* words = (const delta_value*) (index + hdr.words);
+	const delta_queue_view::position* seek = (const delta_queue_view::position*) (index + hdr.seek);
+	size_t num_words = (hdr.seek - hdr.words) / sizeof(size_t);
+	size_t num_seek = (hdr.length - hdr.seek) / sizeof(delta_queue_view::position);
+	for (size_t b = 0; b < imgbuckets.count(); b++)
+		if (bucket[b].num_words < 2 || bucket[b].words + bucket[b].num_words > num_words || bucket[b].seek + bucket[b].num_seek > num_seek)
+			throw data_error("Query index bucket is corrupted.");
+
+	// Without shards, use the index directly, unless it gets copied to each NUMA node.
+	if (!m_shards && !(load_arena && numa_replicas && mem_policy::nodes() > 1)) {
+		for (buckets_t::iterator itr = imgbuckets.begin(); itr != imgbuckets.end(); ++itr, ++bucket)
+			itr->set_base(delta_queue_view(words + bucket->words, bucket->num_words, bucket->size), seek + bucket->seek, bucket->num_seek);
+
+		m_bucketsValid = true;
+		return true;
+	}
+
+	// Otherwise copy the indices of the range into the arena, counting them first.
+	std::vector<delta_counter> counters(imgbuckets.count());
+	for (size_t b = 0; b < counters.size(); b++)
+		copy_range(delta_queue_view(words + bucket[b].words, bucket[b].num_words, bucket[b].size), seek + bucket[b].seek, bucket[b].num_seek, first, last, counters[b]);
+
+	m_arena.allocate(&counters.front(), counters.size());
+	for (buckets_t::iterator itr = imgbuckets.begin(); itr != imgbuckets.end(); ++itr, ++bucket) {
+		size_t b = itr - imgbuckets.begin();
+		delta_writer writer(m_arena.words(b));
+		copy_range(delta_queue_view(words + bucket->words, bucket->num_words, bucket->size), seek + bucket->seek, bucket->num_seek, first, last, writer);
+		itr->set_base(writer.view(), m_arena.seek(b));
+	}
+
+	// They have copied everything they need, block queues and vectors even from the arena.
+	m_indexMap.unmap();
+	m_indexMap = mapped_file();
+	if (!load_arena) m_arena.release();
+	replicate_buckets();
+
+	m_bucketsValid = true;
+	return true;
+#endif
+}
+
 void dbSpaceAlter::load(const char* filename) {
 	m_f = new db_fstream(filename);
 	m_fname = filename;
@@ -908,13 +1619,17 @@ void dbSpaceAlter::load(const char* filename) {
 			throw data_error("Database incompatible with this system");
 		}
 
-		if (version != SRZ_V0_7_0 && version != SRZ_V0_9_0)
+		if (version != SRZ_V0_7_0 && version != SRZ_V0_9_0 && version != SRZ_V0_10_0)
 			throw data_error("Only current version is supported in alter mode, upgrade first using normal mode.");
 
+		// Version 7 has the same layout as version 9.
+		m_version = std::max(version, SRZ_V0_9_0);
+
 		DEBUG(imgdb)("Loading db header (cur ver)... ");
 		m_hdrOff = m_f->tellg();
 		count_t numImg = FLIPPED(m_f->read<count_t>());
 		m_sigOff = FLIPPED(m_f->read<offset_t>());
+		m_idxOff = m_version >= SRZ_V0_10_0 ? FLIPPED(m_f->read<offset_t>()) : 0;
 
 		DEBUG_CONT(imgdb)(DEBUG_OUT, "has %"FMT_count_t" images. ", numImg);
 		// read bucket sizes
@@ -927,6 +1642,7 @@ void dbSpaceAlter::load(const char* filename) {
 			m_images[FLIPPED(m_f->read<count_t>())] = k;
 
 		m_rewriteIDs = false;
+		m_copied = false;
 		DEBUG_CONT(imgdb)(DEBUG_OUT, "complete!\n");
 	} catch (const base_error& e) {
 		if (m_f) {
@@ -975,7 +1691,7 @@ void dbSpaceImpl<false>::load_stream_old(db_ifstream& f, uint version) {
 		if (m_bucketsValid)
 			f.seekg(sz * sizeof(imageId), f.cur);
 	}
-	image_map::size_type szt;
+	size_t szt;
 	f.read((char *) &(szt), sizeof(szt));
 	FLIP(szt);
 	f.seekg(old_pos);
@@ -1031,9 +1747,11 @@ void dbSpaceImpl<false>::load_stream_old(db_ifstream& f, uint version) {
 	DEBUG_CONT(imgdb)(DEBUG_OUT, "%zd images... ", szt);
 	if (version == SRZ_V0_6_0) DEBUG_CONT(imgdb)(DEBUG_OUT, "converting from v6.0... ");
 
-	if (is_simple) m_info.resize(szt);
+	m_info.resize(szt);
+	m_lumin.resize(szt);
+	m_images.reserve(szt);
 
-		for (image_map::size_type k = 0; k < szt; k++) {
+		for (size_t k = 0; k < szt; k++) {
 			ImgData sig;
 
 			if (version == SRZ_V0_6_0) {
@@ -1056,34 +1774,9 @@ void dbSpaceImpl<false>::load_stream_old(db_ifstream& f, uint version) {
 			if (!m_bucketsValid)
 				imgbuckets.add(sig, ind);
 
-			if (is_simple) {
-				m_info[ind].id = sig.id;
-				SigStruct::avglf2i(sig.avglf, m_info[ind].avgl);
-				m_info[ind].width = sig.width;
-				m_info[ind].height = sig.height;
-				m_images.add_index(sig.id, ind);
-
-				if (m_sigFile == -1) {
-					int szk;
-					f.read((char *) &(szk), sizeof(int));
-					FLIP(szk);
-					if (szk) throw data_error("Can't use keywords in simple DB mode.");
-					continue;
-				}
-
-				size_t ofs = get_sig_cache();
-				if (ofs != ind * sizeof(ImgData)) throw internal_error("Index and cache out of sync!");
-				write_sig_cache(ofs, &sig);
-
-			} else {
-				SigStruct* nsig = new SigStruct(get_sig_cache());
-				nsig->init(&sig);
-				nsig->index = ind;
-				write_sig_cache(nsig->cacheOfs, &sig);
+			set_info(ind, sig);
+			m_sigs.write(ind, &sig);
 
-				// insert new sig
-				m_images.add_sig(sig.id, nsig);
-			}
 			// insert into ids bloom filter
 			// imgIdsFilter->insert(sig.id);
 			// read kwds
@@ -1117,31 +1810,140 @@ void dbSpaceImpl<false>::load_stream_old(db_ifstream& f, uint version) {
 }
 
 static inline dbSpace* make_dbSpace(int mode) {
+	unsigned int shards = (mode & dbSpaceCommon::mode_mask_shards) >> dbSpaceCommon::mode_shift_shards;
 	return	  mode & dbSpaceCommon::mode_mask_alter
 			? static_cast<dbSpace*>(new dbSpaceAlter(mode & dbSpaceCommon::mode_mask_readonly))
+		: shards > 1
+			? static_cast<dbSpace*>(new dbSpaceSharded(mode & dbSpaceCommon::mode_mask_readonly, shards))
 		: mode & dbSpaceCommon::mode_mask_simple
 			? static_cast<dbSpace*>(new dbSpaceImpl<true>(mode & dbSpaceCommon::mode_mask_readonly))
 		: static_cast<dbSpace*>(new dbSpaceImpl<false>(true));
 };
 
+void dbSpace::setQueryThreads(unsigned int threads) {
+	delete query_pool;
+	query_pool = threads > 1 ? new worker_pool(threads - 1) : NULL;
+}
+
+void dbSpace::setHugePages(int pages) {
+	switch (pages) {
+		case pages_normal: mem_policy::set_pages(mem_policy::pages_normal); break;
+		case pages_transparent: mem_policy::set_pages(mem_policy::pages_transparent); break;
+		case pages_reserved: mem_policy::set_pages(mem_policy::pages_reserved); break;
+		default: throw param_error("Invalid page size.");
+	}
+}
+
+void dbSpace::setNumaReplicas(bool replicas) {
+	numa_replicas = replicas;
+}
+
+void dbSpace::setQueryTile(size_t images) {
+	query_tile_images = images;
+}
+
+void dbSpace::setRerank(size_t candidates, double entries) {
+	rerank_candidates = candidates;
+	rerank_entries = entries;
+}
+
 dbSpace* dbSpace::load_file(const char *filename, int mode) {
 	dbSpace* db = make_dbSpace(mode);
 	db->load(filename);
 	return db;
 }
 
-template<>
-void dbSpaceImpl<false>::save_file(const char* filename) {
-	/*
-	Serialization order:
-	[image_map::size_type] number of images
+class dbSpaceCommon::index_writer {
+public:
+	index_writer(size_t num) : m_buckets(new buckets_t) { m_info.reserve(num); }
+
+	// Add the next image, in the order of the signatures in the DB file.
+	void add(const ImgData& sig);
+
+	void write(db_ofstream& f);
+
+private:
+	// Same posting lists as imageIdIndex_list<true, true> builds in memory.
+	struct bucket_type : public delta_queue {
+		void add(image_id_index id, count_t index) { push_back(index); }
+	};
+	typedef bucket_set<bucket_type> buckets_t;
+
+	image_info_list m_info;
+	AutoCleanPtr<buckets_t> m_buckets;
+};
+
+void dbSpaceCommon::index_writer::add(const ImgData& sig) {
+	image_info info;
+	info.id = sig.id;
+	image_info::avglf2i(sig.avglf, info.avgl);
+	info.width = sig.width;
+	info.height = sig.height;
+
+	m_buckets->add(sig, m_info.size());
+	m_info.push_back(info);
+}
+
+void dbSpaceCommon::index_writer::write(db_ofstream& f) {
+	static const size_t seek_interval = imageIdIndex_list<true, true>::seek_interval;
+
+	db_index_header hdr;
+	hdr.images = m_info.size();
+	hdr.word_size = sizeof(size_t);
+	hdr.info = sizeof(hdr);
+	hdr.buckets = hdr.info + m_info.size() * sizeof(image_info);
+	hdr.words = hdr.buckets + m_buckets->count() * sizeof(db_index_bucket);
+
+	std::vector<db_index_bucket> buckets;
+	buckets.reserve(m_buckets->count());
+	offset_t words = 0, seek = 0;
+	for (buckets_t::iterator itr = m_buckets->begin(); itr != m_buckets->end(); ++itr) {
+		db_index_bucket bucket;
+		bucket.size = itr->size();
+		bucket.words = words;
+		bucket.num_words = itr->base_size();
+		bucket.seek = seek;
+		bucket.num_seek = imageIdIndex_list<true, true>::seek_count(bucket.size);
+		words += bucket.num_words;
+		seek += bucket.num_seek;
+		buckets.push_back(bucket);
+	}
+	hdr.seek = hdr.words + words * sizeof(size_t);
+	hdr.length = hdr.seek + seek * sizeof(delta_queue_view::position);
+
+	f.write(hdr);
+	if (!m_info.empty()) f.write(&m_info.front(), m_info.size());
+	f.write(&buckets.front(), buckets.size());
+
+	for (buckets_t::iterator itr = m_buckets->begin(); itr != m_buckets->end(); ++itr) {
+		delta_queue_view view(*itr);
+		f.write(view.words(), view.num_words());
+	}
+
+	for (buckets_t::iterator itr = m_buckets->begin(); itr != m_buckets->end(); ++itr) {
+		delta_queue_view view(*itr);
+		if (view.size() <= seek_interval) continue;
+
+		size_t num = 0;
+		for (delta_queue_view::const_iterator pos = view.begin(); pos != view.end(); ++pos, ++num)
+			if (!(num % seek_interval)) f.write(view.save(pos));
+	}
+}
+
+template<>
+void dbSpaceImpl<false>::save_file(const char* filename) {
+	/*
+	Serialization order:
+	[count_t] number of images
 	[off_t] offset to first signature in file
+	[off_t] offset to query index
 	for each bucket:
 	[size_t] number of images in bucket
 	for each image:
 	[imageId] image id at this index
 	...hole in file until offset to first signature in file, to allow adding more image ids
 	then follow image signatures, see struct ImgData
+	...and from the next page on the query index, see index_writer::write
 	 */
 
 	DEBUG(imgdb)("Saving to %s... ", filename);
@@ -1161,23 +1963,37 @@ void dbSpaceImpl<false>::save_file(const char* filename) {
 	DEBUG_CONT(imgdb)(DEBUG_OUT, "sig off: %llx... ", (long long int) firstOff);
 	f.write<offset_t>(firstOff);
 
+	// The index is written in native byte order only.
+	off_t indexOff = CONV_ENDIAN ? 0 : (firstOff + m_images.size() * sizeof(ImgData) + pageMask) & ~pageMask;
+	f.write<offset_t>(indexOff);
+
 	// save bucket sizes
 	for (buckets_t::iterator itr = imgbuckets.begin(); itr != imgbuckets.end(); ++itr)
 		f.write<count_t>(itr->size());
 
 	// save IDs
 	for (imageIterator it = image_begin(); it != image_end(); it++)
-		f.write<imageId>(it.id());
+		if (!is_deleted(it.index()))
+			f.write<imageId>(it.id());
 
 	// skip to firstOff
 	f.seekp(firstOff);
 
 	DEBUG_CONT(imgdb)(DEBUG_OUT, "sigs... ");
 	// save sigs
+	index_writer index(m_images.size());
 	for (imageIterator it = image_begin(); it != image_end(); it++) {
+		if (is_deleted(it.index())) continue;
 		ImgData dsig;
-		read_sig_cache(it.cOfs(), &dsig);
+		m_sigs.read(it.index(), &dsig);
 		f.write(dsig);
+		if (indexOff) index.add(dsig);
+	}
+
+	if (indexOff) {
+		DEBUG_CONT(imgdb)(DEBUG_OUT, "index... ");
+		f.seekp(indexOff);
+		index.write(f);
 	}
 	f.close();
 	if (rename(temp.c_str(), filename)) throw io_error(std::string("Cannot rename temp file ")+temp+" to DB file "+filename+": "+strerror(errno));
@@ -1261,10 +2077,11 @@ void dbSpaceAlter::save_file(const char* filename) {
 
 	DEBUG_CONT(imgdb)(DEBUG_OUT, "saving header... ");
 	m_f->seekp(0);
-	m_f->write<uint32_t>(SRZ_V_CODE);
+	m_f->write<uint32_t>(m_version | (SRZ_V_SZ << 8));
 	m_f->seekp(m_hdrOff);
 	m_f->write<count_t>(m_images.size());
 	m_f->write(m_sigOff);
+	if (m_version >= SRZ_V0_10_0) m_f->write(m_idxOff);
 	m_f->write(m_buckets);
 
 	DEBUG_CONT(imgdb)(DEBUG_OUT, "done!\n");
@@ -1299,157 +2116,589 @@ void dbSpaceAlter::resize_header() {
   m_rewriteIDs = true;
 }
 
+// The query index is only valid for the signatures it was made from, and
+// servers may have mapped the signatures and the query index of the DB file.
+// So rather than changing a file with a query index in place, the first change
+// copies everything before the index to a new file, replaces the DB file with
+// that and continues with it. Files without an index are changed in place,
+// servers read their signatures into memory instead of mapping them.
+void dbSpaceAlter::copy_file() {
+	if (m_copied) return;
+	if (!m_idxOff) {
+		m_copied = true;
+		return;
+	}
+
+	struct stat st;
+	if (stat(m_fname.c_str(), &st)) throw io_error(std::string("Cannot stat DB file ")+m_fname+": "+strerror(errno));
+
+	DEBUG(imgdb)("Copying %s without its query index... ", m_fname.c_str());
+	std::string temp = m_fname + ".temp";
+	db_ofstream f(temp.c_str());
+	if (!f.is_open()) throw io_error(std::string("Cannot open temp file ")+temp+" for writing: "+strerror(errno));
+
+	char buf[65536];
+	m_f->seekg(0);
+	for (offset_t left = m_idxOff; left; ) {
+		size_t len = std::min<offset_t>(left, sizeof(buf));
+		m_f->read(buf, len);
+		f.write(buf, len);
+		left -= len;
+	}
+
+	m_idxOff = 0;
+	f.seekp(m_hdrOff + sizeof(count_t) + sizeof(offset_t));
+	f.write(m_idxOff);
+	f.close();
+	if (f.fail()) throw io_error(std::string("Cannot write temp file ")+temp+": "+strerror(errno));
+
+	// Keep the owner and mode of the DB file. Only root may give the file
+	// away, so a failed chown is not an error if the owner is unchanged anyway.
+	if (chown(temp.c_str(), st.st_uid, st.st_gid) && (st.st_uid != geteuid() || errno != EPERM))
+		DEBUG(warnings)("Cannot change owner of %s: %s\n", temp.c_str(), strerror(errno));
+	if (chmod(temp.c_str(), st.st_mode & 07777)) throw io_error(std::string("Cannot change mode of temp file ")+temp+": "+strerror(errno));
+
+	m_f->close();
+	if (rename(temp.c_str(), m_fname.c_str())) throw io_error(std::string("Cannot rename temp file ")+temp+" to DB file "+m_fname+": "+strerror(errno));
+	m_f->exceptions(std::fstream::goodbit);
+	m_f->open(m_fname.c_str(), std::ios::binary | std::ios::in | std::ios::out);
+	if (!m_f->is_open()) throw io_error(std::string("Cannot reopen DB file ")+m_fname+": "+strerror(errno));
+	m_f->exceptions(std::fstream::badbit | std::fstream::failbit);
+	m_copied = true;
+	DEBUG_CONT(imgdb)(DEBUG_OUT, "done.\n");
+}
+
 template<bool is_simple>
 struct sim_result : public index_iterator<is_simple>::base_type {
 	typedef typename index_iterator<is_simple>::base_type itr_type;
-	sim_result(Score s, const itr_type& i) : itr_type(i), score(s) { }
-	bool operator< (const sim_result& other) const { return score < other.score; }
+	sim_result(Score s, size_t i, const itr_type& itr) : itr_type(itr), score(s), index(i) { }
+	// Equal scores are ordered by index, so the results do not depend on
+	// how the images were split up between query threads.
+	bool operator< (const sim_result& other) const { return score < other.score || (score == other.score && index < other.index); }
 	Score score;
+	size_t index;
+};
+
+// Collects the numres best results, or with flag_uniqueset only the best
+// result of each of the numres best sets.
+template<bool is_simple>
+class sim_queue {
+public:
+	typedef index_iterator<is_simple> imageIterator;
+	typedef std::vector<sim_result<is_simple> > result_list;
+
+	sim_queue(dbSpaceImpl<is_simple>& db, const queryArg& q)
+	  : m_db(&db), m_uniqueset(q.flags & dbSpace::flag_uniqueset), m_need(q.numres) { }
+
+	// Quick check whether an image with this score might make it into the results.
+	bool wants(Score s) const { return m_queue.size() < m_need || (!m_queue.empty() && s <= m_queue.top().score); }
+
+	// Once full, only images with a score of at most worst() can still make it.
+	bool full() const { return !m_queue.empty() && m_queue.size() >= m_need; }
+	Score worst() const { return m_queue.top().score; }
+	void add(const sim_result<is_simple>& res);
+
+	// Add the results collected for several index ranges.
+	void merge(result_list& list);
+
+	// Remove all results, worst first.
+	result_list take();
+
+	// Final results, best first.
+	sim_vector results(Score scale);
+
+private:
+	struct by_index {
+		bool operator() (const sim_result<is_simple>& one, const sim_result<is_simple>& two) const { return one.index < two.index; }
+	};
+
+	uint16_t set(const sim_result<is_simple>& res) { return imageIterator(res, *m_db).set(); }
+
+	typedef std::priority_queue<sim_result<is_simple> > sigPriorityQueue;
+	typedef std::map<int, size_t> set_map;
+
+	dbSpaceImpl<is_simple>* m_db;
+	bool m_uniqueset;
+	unsigned int m_need;
+	set_map m_sets;
+	sigPriorityQueue m_queue;		/* results priority queue; largest at top */
 };
 
 template<bool is_simple>
-inline bool dbSpaceImpl<is_simple>::skip_image(const imageIterator& itr, const queryArg& query) {
-	return
-		(is_simple && !itr.avgl()[0])
-		||
-		((query.flags & flag_mask) && ((itr.mask() & query.mask_and) != query.mask_xor))
-	;
+void sim_queue<is_simple>::add(const sim_result<is_simple>& res) {
+	// Fill up the numres-bounded priority queue (largest at top):
+	if (m_queue.size() < m_need) {
+		m_queue.push(res);
+		if (m_uniqueset)
+			m_need += ++m_sets[set(res)] > 1;
+		return;
+	}
+
+	// only consider if it is a better match than the current worst match
+	if (m_queue.empty() || !(res < m_queue.top())) return;
+
+	// Make room by dropping largest entry:
+	m_queue.push(res);
+	if (!m_uniqueset) {
+		m_queue.pop();
+		return;
+	}
+
+	m_need += ++m_sets[set(res)] > 1;
+	while (m_queue.size() > m_need || m_sets[set(m_queue.top())] > 1) {
+		m_need -= m_sets[set(m_queue.top())]-- > 1;
+		m_queue.pop();
+	}
 }
 
 template<bool is_simple>
-template<int num_colors>
-sim_vector dbSpaceImpl<is_simple>::do_query(queryArg q) {
-	int c;
-	Score scale = 0;
-	int sketch = q.flags & flag_sketch ? 1 : 0;
-//fprintf(stderr, is_simple?"In do_query<true%d>.\n":"In do_query<false%d>.\n", num_colors);
+void sim_queue<is_simple>::merge(result_list& list) {
+	// Add them in index order, same as a single pass over all images would.
+	std::sort(list.begin(), list.end(), by_index());
+	for (typename result_list::const_iterator itr = list.begin(); itr != list.end(); ++itr)
+		add(*itr);
+}
 
-	if (!m_bucketsValid) throw usage_error("Can't query with invalid buckets.");
+template<bool is_simple>
+typename sim_queue<is_simple>::result_list sim_queue<is_simple>::take() {
+	result_list list;
+	list.reserve(m_queue.size());
+	for (; !m_queue.empty(); m_queue.pop())
+		list.push_back(m_queue.top());
 
-	size_t count = m_nextIndex;
-	AutoCleanArray<Score> scores(count);
+	m_sets.clear();
+	return list;
+}
 
-	// Luminance score (DC coefficient).
-	for (imageIterator itr = image_begin(); itr != image_end(); ++itr) {
-		Score s = 0;
-		for (c = 0; c < num_colors; c++)
-			s += (((DScore)weights[sketch][0][c]) * abs(itr.avgl()[c] - q.avgl[c])) >> ScoreScale;
-		scores[itr.index()] = s;
+template<bool is_simple>
+sim_vector sim_queue<is_simple>::results(Score scale) {
+	sim_vector V;
+	V.reserve(m_queue.size());
+
+//fprintf(stderr, "Have %zd images in result set.\n", m_queue.size());
+	for (; !m_queue.empty(); m_queue.pop()) {
+		const sim_result<is_simple>& curResTmp = m_queue.top();
+
+		imageIterator itr(curResTmp, *m_db);
+		if (!m_uniqueset || m_sets[itr.set()]-- < 2)
+			V.push_back(sim_value(itr.id(), (((DScore)curResTmp.score) * 100 * scale) >> ScoreScale, itr.width(), itr.height()));
 	}
 
-#if QUERYSTATS
-	size_t coefcnt = 0, coeflen = 0, coefmax = 0;
-	size_t setcnt[NUM_COEFS * num_colors];
-	AutoCleanArray<uint8_t> counts(count);
-	memset(counts.ptr(), 0, sizeof(counts[0])*count);
-	memset(setcnt, 0, sizeof(setcnt));
-#endif
-	for (int b = (q.flags & flag_fast) ? NUM_COEFS : 0; b < NUM_COEFS; b++) {	// for every coef on a sig
-		for (c = 0; c < num_colors; c++) {
-			int idx;
-			bucket_type& bucket = imgbuckets.at(c, q.sig[c][b], &idx);
-			if (bucket.empty()) continue;
-			if (q.flags & flag_nocommon && bucket.size() > count / 10) continue;
+	std::reverse(V.begin(), V.end());
+	return V;
+}
 
-			Score weight = weights[sketch][imgBin[idx]][c]; 
-//fprintf(stderr, "%d:%d=%d has %zd=%d, ", b, c, sig[c][b], dbSpace[dbId]->imgbuckets[c][pn][idx].size(), weight);
-			scale -= weight;
+template<bool is_simple>
+struct dbSpaceImpl<is_simple>::query_bucket {
+	// A query of the batch which has this coefficient, and its weight.
+	struct use {
+		use(size_t q, Score w) : query(q), weight(w) { }
+		size_t query;
+		Score weight;
+	};
+	typedef std::vector<use> use_list;
+
+	query_bucket(bucket_type& b) : bucket(&b), map(b.map_all(false)) { }
+
+	// Highest weight of all its uses.
+	Score weight() const {
+		Score w = 0;
+		for (typename use_list::const_iterator u = uses.begin(); u != uses.end(); ++u)
+			w = std::max(w, u->weight);
+		return w;
+	}
+	struct heavier {
+		bool operator() (const query_bucket& one, const query_bucket& two) const { return one.weight() > two.weight(); }
+	};
 
-			// update the score of every image which has this coef
-			AutoImageIdIndex_map<is_simple> map(bucket.map_all(false));
-#if QUERYSTATS
-			size_t len = bucket.size();
-			coeflen += len; coefmax = std::max(coefmax, len);
-			coefcnt++;
-#endif
-			for (idIndexIterator itr(map.begin(), *this); itr != map.end(); ++itr) {
-				scores[itr.index()] -= weight;
-#if QUERYSTATS
-				counts[itr.index()]++;
-#endif
-			}
-			for (idIndexTailIterator itr(bucket.tail().begin(), *this); itr != bucket.tail().end(); ++itr) {
-				scores[itr.index()] -= weight;
-#if QUERYSTATS
-				counts[itr.index()]++;
+	bucket_type* bucket;
+	imageIdIndex_map<is_simple> map;
+	use_list uses;
+};
+
+template<bool is_simple>
+struct dbSpaceImpl<is_simple>::query_bucket_list : public std::vector<query_bucket> {
+	~query_bucket_list() {
+		for (typename std::vector<query_bucket>::iterator itr = this->begin(); itr != this->end(); ++itr)
+			itr->map.unmap();
+	}
+};
+
+template<bool is_simple>
+struct dbSpaceImpl<is_simple>::query_batch {
+	query_batch(const queryArg* q, size_t n) : queries(q), num(n) { }
+
+	const queryArg* queries;
+	size_t num;
+
+	std::vector<int> colors;	// Number of color channels to compare for each query.
+	std::vector<Score> scales;	// Sum of the weights of each query's buckets.
+	query_bucket_list buckets;
+
+	// With flag_prune, the buckets are sorted by weight, heaviest first. Before
+	// the bucket at each checkpoint, the queries check whether any image of the
+	// tile could still make it into their results with the remaining weight
+	// of query i from checkpoint k on, at remaining[k * num + i].
+	std::vector<size_t> checkpoints;
+	std::vector<Score> remaining;
+};
+
+// Number of query tiles and bucket scans, and how many of them flag_prune skipped.
+template<bool is_simple>
+struct dbSpaceImpl<is_simple>::prune_stats {
+	prune_stats() : tiles(0), pruned(0), scans(0), skipped(0) { }
+	prune_stats& operator+= (const prune_stats& other) {
+		tiles += other.tiles; pruned += other.pruned;
+		scans += other.scans; skipped += other.skipped;
+		return *this;
+	}
+
+	size_t tiles, pruned;
+	size_t scans, skipped;
+};
+
+// Runs a batch of queries over one part of the images per thread.
+template<bool is_simple>
+class dbSpaceImpl<is_simple>::query_job : public worker_pool::job {
+public:
+	typedef typename sim_queue<is_simple>::result_list result_list;
+
+	query_job(dbSpaceImpl& db, const query_batch& batch, size_t count, unsigned int parts)
+	  : m_db(db), m_batch(batch), m_count(count), m_parts(parts), m_results(parts), m_stats(parts) { }
+
+	virtual void run(unsigned int part) {
+		std::vector<sim_queue<is_simple> > results;
+		results.reserve(m_batch.num);
+		for (size_t i = 0; i < m_batch.num; i++)
+			results.push_back(sim_queue<is_simple>(m_db, m_batch.queries[i]));
+
+		m_db.query_range(m_batch, m_count * part / m_parts, m_count * (part + 1) / m_parts, results, m_stats[part]);
+
+		m_results[part].resize(m_batch.num);
+		for (size_t i = 0; i < m_batch.num; i++)
+			m_results[part][i] = results[i].take();
+	}
+
+	// All results of all parts for one query.
+	result_list results(size_t query) const {
+		result_list all;
+		for (typename std::vector<std::vector<result_list> >::const_iterator itr = m_results.begin(); itr != m_results.end(); ++itr)
+			all.insert(all.end(), (*itr)[query].begin(), (*itr)[query].end());
+		return all;
+	}
+
+	prune_stats stats() const {
+		prune_stats all;
+		for (typename std::vector<prune_stats>::const_iterator itr = m_stats.begin(); itr != m_stats.end(); ++itr)
+			all += *itr;
+		return all;
+	}
+
+private:
+	dbSpaceImpl& m_db;
+	const query_batch& m_batch;
+	size_t m_count;
+	unsigned int m_parts;
+	std::vector<std::vector<result_list> > m_results;
+	std::vector<prune_stats> m_stats;
+};
+
+// Move an iterator of a base list in the bucket arena to its copy offset
+// bytes away. Only delta queue lists stay in the arena.
+template<typename I>
+inline void localize(I& itr, const bucket_arena& arena, ptrdiff_t offset) { }
+#ifdef USE_DELTA_QUEUE
+inline void localize(map_iterator<true>& itr, const bucket_arena& arena, ptrdiff_t offset) {
+	if (offset) arena.localize(itr, offset);
+}
 #endif
-			}
-		}
+
+// Subtract the weight from the scores of all images in [lo, hi) in a bucket,
+// starting at itr. Leaves itr at the first image not below hi.
+template<typename I, typename E>
+inline void scan_bucket(I& itr, const E& end, size_t lo, size_t hi, Score* scores, Score weight) {
+	for (; itr != end; ++itr) {
+		size_t index = itr.index();
+		if (index >= hi) break;
+		scores[index - lo] -= weight;
 	}
+}
 
-	typedef std::priority_queue<sim_result<is_simple> > sigPriorityQueue;
+#if defined(USE_BLOCK_QUEUE)
+// Block queue buckets and their tails are decoded a block at a time.
+struct subtract_weight {
+	subtract_weight(Score* scores, size_t lo, Score weight) : m_scores(scores), m_lo(lo), m_weight(weight) { }
+	void operator()(size_t index) { m_scores[index - m_lo] -= m_weight; }
 
-	sigPriorityQueue pqResults;		/* results priority queue; largest at top */
+	Score* m_scores;
+	size_t m_lo;
+	Score m_weight;
+};
 
-	imageIterator itr = image_begin();
+template<typename U>
+struct subtract_uses {
+	subtract_uses(Score* scores, size_t lo, size_t tile, const U& uses) : m_scores(scores), m_lo(lo), m_tile(tile), m_uses(uses) { }
+	void operator()(size_t index) {
+		for (typename U::const_iterator u = m_uses.begin(); u != m_uses.end(); ++u)
+			m_scores[u->query * m_tile + index - m_lo] -= u->weight;
+	}
 
-	sim_vector V;
+	Score* m_scores;
+	size_t m_lo;
+	size_t m_tile;
+	const U& m_uses;
+};
 
-	typedef std::map<int, size_t> set_map;
-	set_map sets;
-	unsigned int need = q.numres;
+inline void scan_bucket(id_index_iterator<true, map_iterator<true> >& itr, const map_iterator<true>& end, size_t lo, size_t hi, Score* scores, Score weight) {
+	subtract_weight f(scores, lo, weight);
+	block_queue::scan(itr, end, hi, f);
+}
+inline void scan_bucket(id_index_iterator<true, imageIdIndex_list<true, true>::container::const_iterator>& itr, const block_queue::const_iterator& end, size_t lo, size_t hi, Score* scores, Score weight) {
+	subtract_weight f(scores, lo, weight);
+	block_queue::scan(itr, end, hi, f);
+}
+template<typename U>
+inline void scan_bucket(id_index_iterator<true, map_iterator<true> >& itr, const map_iterator<true>& end, size_t lo, size_t hi, Score* scores, size_t tile, const U& uses) {
+	subtract_uses<U> f(scores, lo, tile, uses);
+	block_queue::scan(itr, end, hi, f);
+}
+template<typename U>
+inline void scan_bucket(id_index_iterator<true, imageIdIndex_list<true, true>::container::const_iterator>& itr, const block_queue::const_iterator& end, size_t lo, size_t hi, Score* scores, size_t tile, const U& uses) {
+	subtract_uses<U> f(scores, lo, tile, uses);
+	block_queue::scan(itr, end, hi, f);
+}
+#elif defined(USE_DELTA_QUEUE)
+// Delta queue buckets can be decoded a word at a time, as can their tails.
+inline void scan_bucket(id_index_iterator<true, map_iterator<true> >& itr, const map_iterator<true>& end, size_t lo, size_t hi, Score* scores, Score weight) {
+	delta_scan::scan(itr, end, lo, hi, scores, weight);
+}
+inline void scan_bucket(id_index_iterator<true, imageIdIndex_list<true, true>::container::const_iterator>& itr, const delta_iterator& end, size_t lo, size_t hi, Score* scores, Score weight) {
+	delta_scan::scan(itr, end, lo, hi, scores, weight);
+}
+#endif
 
-	// Fill up the numres-bounded priority queue (largest at top):
-	while (pqResults.size() < need && itr != image_end()) {
-//fprintf(stderr, "ID %08lx mask %x qflm %d %x -> %x = %x?\n", itr.id(), itr.mask(), q.flags & flag_mask, q.mask_and, itr.mask() & q.mask_and,q.mask_xor);
-		if (skip_image(itr, q)) { ++itr; continue; }
+// Same for a bucket used by several queries of a batch, decoding it only once.
+// The scores of each query are tile entries apart.
+template<typename I, typename E, typename U>
+inline void scan_bucket(I& itr, const E& end, size_t lo, size_t hi, Score* scores, size_t tile, const U& uses) {
+	for (; itr != end; ++itr) {
+		size_t index = itr.index();
+		if (index >= hi) break;
+		for (typename U::const_iterator u = uses.begin(); u != uses.end(); ++u)
+			scores[u->query * tile + index - lo] -= u->weight;
+	}
+}
 
 #if QUERYSTATS
-		setcnt[counts[itr.index()]]++;
+// Same, also counting the coefficients each image has in common with each query.
+template<typename I, typename E, typename U>
+inline void scan_bucket(I& itr, const E& end, size_t lo, size_t hi, Score* scores, uint8_t* counts, size_t tile, const U& uses) {
+	for (; itr != end; ++itr) {
+		size_t index = itr.index();
+		if (index >= hi) break;
+		for (typename U::const_iterator u = uses.begin(); u != uses.end(); ++u) {
+			scores[u->query * tile + index - lo] -= u->weight;
+			counts[u->query * tile + index - lo]++;
+		}
+	}
+}
 #endif
-		pqResults.push(sim_result<is_simple>(scores[itr.index()], itr));
 
-		if (q.flags & flag_uniqueset) //{
-			need += ++sets[itr.set()] > 1;
-//imageIterator top(pqResults.top(), *this);fprintf(stderr, "Added id=%08lx score=%.2f set=%x, now need %d. Worst is id %08lx score %.2f set %x has %zd\n", itr.id(), (double)scores[itr.index()]/ScoreMax, itr.set(), need, top.id(), (double)pqResults.top().score/ScoreMax, top.set(), sets[top.set()]); }
-		++itr;
+// Luminance score (DC coefficient) of the images in [lo, hi).
+template<bool is_simple>
+void dbSpaceImpl<is_simple>::score_luminance(const queryArg& query, int colors, size_t lo, size_t hi, Score* scores) {
+	int sketch = query.flags & dbSpace::flag_sketch ? 1 : 0;
+	lumin_scan::query q;
+	q.colors = colors;
+	for (int c = 0; c < 3; c++) {
+		q.avgl[c] = query.avgl[c];
+		q.weight[c] = weights[sketch][0][c];
+	}
+	q.shift = ScoreScale;
+	q.use_mask = query.flags & flag_mask;
+	q.mask_and = query.mask_and;
+	q.mask_xor = query.mask_xor;
+
+	const Score* avgl[3] = { &m_lumin.avgl[0][lo], &m_lumin.avgl[1][lo], &m_lumin.avgl[2][lo] };
+	lumin_scan::scan(q, avgl, &m_lumin.mask[lo], hi - lo, scores);
+
+	// Deleted images are rare, and m_deleted only goes up to the last one.
+	if (m_deletedCount)
+		for (size_t ind = lo; ind < std::min(hi, m_deleted.size()); ind++)
+			if (m_deleted[ind]) scores[ind - lo] = lumin_scan::skipped;
+}
+
+// Whether all scores are above the limit. Checks blocks of them at a time, with
+// four minimums so they don't wait on each other, and stops at the first block
+// with a lower score.
+static bool all_above(const Score* scores, size_t num, Score limit) {
+	static const size_t block = 256;
+	size_t i = 0;
+	for (; i + block <= num; i += block) {
+		Score m[4] = { scores[i], scores[i + 1], scores[i + 2], scores[i + 3] };
+		for (size_t j = i + 4; j < i + block; j += 4)
+			for (int k = 0; k < 4; k++)
+				m[k] = std::min(m[k], scores[j + k]);
+		if (std::min(std::min(m[0], m[1]), std::min(m[2], m[3])) <= limit) return false;
 	}
+	for (; i < num; i++)
+		if (scores[i] <= limit) return false;
+	return true;
+}
+
+// Whether all queries using a bucket have been pruned for this tile.
+template<typename U>
+static inline bool all_pruned(const U& uses, const std::vector<bool>& pruned) {
+	for (typename U::const_iterator u = uses.begin(); u != uses.end(); ++u)
+		if (!pruned[u->query]) return false;
+	return true;
+}
+
+template<bool is_simple>
+void dbSpaceImpl<is_simple>::query_range(const query_batch& batch, size_t lo, size_t hi, std::vector<sim_queue<is_simple> >& results, prune_stats& stats) {
+	// Only in-memory buckets in simple mode are sorted, so that the images can be
+	// scored one tile at a time. Other modes always query all images at once.
+	// The scores of all queries of a batch share the cache.
+	size_t tile = hi - lo;
+	if (is_simple && is_memory && query_tile_images)
+		tile = std::min(tile, std::max(query_tile_images / batch.num, query_tile_min));
+
+	// Scores of query i are at [i * tile, (i + 1) * tile), in a buffer of this thread.
+	mem_policy::scratch<Score> scores(tile * batch.num);
+
+	// Where to continue with each bucket and its tail in the next tile. The
+	// tail holds the images added since the bucket was last compacted, which
+	// have the highest indices, so it can be scanned the same way after the
+	// rest of the bucket. With copies of the bucket arena on each NUMA node,
+	// the cursors and ends point into the one of this thread's node.
+	typedef std::vector<typename imageIdIndex_map<is_simple>::iterator> cursor_list;
+	typedef std::vector<typename imageIdIndex_list<is_simple, is_memory>::container::const_iterator> tail_cursor_list;
+	ptrdiff_t local = m_arena.local();
+	cursor_list cursors, ends;
+	tail_cursor_list tail_cursors;
+	cursors.reserve(batch.buckets.size());
+	ends.reserve(batch.buckets.size());
+	tail_cursors.reserve(batch.buckets.size());
+	for (typename query_bucket_list::const_iterator b = batch.buckets.begin(); b != batch.buckets.end(); ++b) {
+		cursors.push_back(lo ? b->bucket->seek(b->map, lo) : b->map.m_img);
+		ends.push_back(b->map.m_end);
+		localize(cursors.back(), m_arena, local);
+		localize(ends.back(), m_arena, local);
+
+		idIndexTailIterator tail(b->bucket->tail().begin(), *this);
+		while (lo && tail != b->bucket->tail().end() && tail.index() < lo) ++tail;
+		tail_cursors.push_back(tail);
+	}
+
+	// Queries pruned in the current tile, and buckets skipped in the last
+	// tile, whose cursors still have to seek to the current one.
+	std::vector<bool> pruned(batch.num);
+	std::vector<bool> behind(batch.buckets.size());
+
+#if QUERYSTATS
+	size_t coefcnt = 0, coeflen = 0, coefmax = 0, tiles = 0;
+	size_t setcnt[NUM_COEFS * 3 + 1];
+	AutoCleanArray<uint8_t> counts(tile * batch.num);
+	memset(setcnt, 0, sizeof(setcnt));
+	for (typename query_bucket_list::const_iterator b = batch.buckets.begin(); b != batch.buckets.end(); ++b) {
+		size_t len = b->bucket->size();
+		coeflen += len * b->uses.size(); coefmax = std::max(coefmax, len);
+		coefcnt += b->uses.size();
+	}
+	struct timespec time_start, time_end;
+	clock_gettime(CLOCK_MONOTONIC, &time_start);
+#endif
+	for (size_t tlo = lo, thi; tlo < hi; tlo = thi) {
+		thi = std::min(hi, tlo + tile);
+
+		imageIterator start(m_info.begin() + tlo, *this);
+
+		for (size_t i = 0; i < batch.num; i++)
+			score_luminance(batch.queries[i], batch.colors[i], tlo, thi, scores.ptr() + i * tile);
 
-	for (; itr != image_end(); ++itr) {
-		// only consider if not ignored due to keywords and if is a better match than the current worst match
 #if QUERYSTATS
-		if (!skip_image(itr, q)) setcnt[counts[itr.index()]]++;
+		tiles++;
+		memset(counts.ptr(), 0, sizeof(counts[0]) * tile * batch.num);
 #endif
-		if (scores[itr.index()] < pqResults.top().score) {
-//fprintf(stderr, "ID %08lx mask %x qflm %d %x -> %x = %x?\n", itr.id(), itr.mask(), q.flags & flag_mask, q.mask_and, itr.mask() & q.mask_and,q.mask_xor);
-			if (skip_image(itr, q)) continue;
-
-			// Make room by dropping largest entry:
-			if (q.flags & flag_uniqueset) {
-				pqResults.push(sim_result<is_simple>(scores[itr.index()], itr));
-				need += ++sets[itr.set()] > 1;
-//imageIterator top(pqResults.top(), *this);fprintf(stderr, "Added id=%08lx score=%.2f set=%x, now need %d. Worst is id %08lx score %.2f set %x has %zd\n", itr.id(), (double)scores[itr.index()]/ScoreMax, itr.set(), need, top.id(), (double)pqResults.top().score/ScoreMax, top.set(), sets[top.set()]);
-
-				while (pqResults.size() > need || sets[imageIterator(pqResults.top(), *this).set()] > 1) {
-					need -= sets[imageIterator(pqResults.top(), *this).set()]-- > 1;
-					pqResults.pop();
-//imageIterator top(pqResults.top(), *this);fprintf(stderr, "Dropped worst, now need %d. New worst is id %08lx score %.2f set %x has %zd\n", need, top.id(), (double)pqResults.top().score/ScoreMax, top.set(), sets[top.set()]);
+		stats.tiles += batch.num;
+		pruned.assign(batch.num, false);
+		size_t checkpoint = 0, num_pruned = 0;
+
+		typename cursor_list::iterator cursor = cursors.begin();
+		typename tail_cursor_list::iterator tail_cursor = tail_cursors.begin();
+		for (typename query_bucket_list::const_iterator b = batch.buckets.begin(); b != batch.buckets.end(); ++b, ++cursor, ++tail_cursor) {
+			size_t pos = b - batch.buckets.begin();
+
+			// A query is done with this tile when none of its images could make it into
+			// the full results anymore, even if they had all the remaining coefficients.
+			if (checkpoint < batch.checkpoints.size() && pos == batch.checkpoints[checkpoint]) {
+				for (size_t i = 0; i < batch.num; i++) {
+					if (pruned[i] || !(batch.queries[i].flags & flag_prune) || !results[i].full()) continue;
+					Score limit = results[i].worst() + batch.remaining[checkpoint * batch.num + i];
+					if (!all_above(scores.ptr() + i * tile, thi - tlo, limit)) continue;
+					pruned[i] = true;
+					num_pruned++;
 				}
+				checkpoint++;
+			}
+
+			if (num_pruned && all_pruned(b->uses, pruned)) {
+				behind[pos] = true;
+				stats.skipped++;
+				continue;
+			}
+			stats.scans++;
+
+			// update the score of every image which has this coef
+			if (behind[pos]) {
+				*cursor = b->bucket->seek(b->map, tlo);
+				localize(*cursor, m_arena, local);
+				idIndexTailIterator tail(*tail_cursor, *this);
+				while (tail != b->bucket->tail().end() && tail.index() < tlo) ++tail;
+				*tail_cursor = tail;
+				behind[pos] = false;
+			}
+			idIndexIterator itr(*cursor, *this);
+			idIndexTailIterator tail(*tail_cursor, *this);
+#if QUERYSTATS
+			scan_bucket(itr, ends[pos], tlo, thi, scores.ptr(), counts.ptr(), tile, b->uses);
+			scan_bucket(tail, b->bucket->tail().end(), tlo, thi, scores.ptr(), counts.ptr(), tile, b->uses);
+#else
+			if (b->uses.size() == 1) {
+				scan_bucket(itr, ends[pos], tlo, thi, scores.ptr() + b->uses.front().query * tile, b->uses.front().weight);
+				scan_bucket(tail, b->bucket->tail().end(), tlo, thi, scores.ptr() + b->uses.front().query * tile, b->uses.front().weight);
 			} else {
-				pqResults.pop();
-				// Insert new entry:
-				pqResults.push(sim_result<is_simple>(scores[itr.index()], itr));
+				scan_bucket(itr, ends[pos], tlo, thi, scores.ptr(), tile, b->uses);
+				scan_bucket(tail, b->bucket->tail().end(), tlo, thi, scores.ptr(), tile, b->uses);
 			}
+#endif
+			*cursor = itr;
+			*tail_cursor = tail;
 		}
-	}
 
-//fprintf(stderr, "Have %zd images in result set.\n", pqResults.size());
-	scale = ((DScore) ScoreMax) * ScoreMax / scale;
-	while (!pqResults.empty()) {
-		const sim_result<is_simple>& curResTmp = pqResults.top();
+		// Skipped images still have a score above lumin_scan::skipped / 2.
+		stats.pruned += num_pruned;
+		for (size_t i = 0; i < batch.num; i++) {
+			if (pruned[i]) continue;
+			for (imageIterator itr = start; itr != image_end() && itr.index() < thi; ++itr) {
+				Score s = scores[i * tile + itr.index() - tlo];
+				if (s >= lumin_scan::skipped / 2) continue;
+#if QUERYSTATS
+				setcnt[counts[i * tile + itr.index() - tlo]]++;
+#endif
+				if (!results[i].wants(s)) continue;
 
-		imageIterator itr(curResTmp, *this);
-//fprintf(stderr, "Candidate %08lx = %.2f, set %x has %zd.\n", itr.id(), (double)curResTmp.score/ScoreMax, itr.set(), sets[itr.set()]);
-		if (!(q.flags & flag_uniqueset) || sets[itr.set()]-- < 2)
-			V.push_back(sim_value(itr.id(), (((DScore)curResTmp.score) * 100 * scale) >> ScoreScale, itr.width(), itr.height()));
-//else fprintf(stderr, "Skipped!\n");
-		pqResults.pop();
+				results[i].add(sim_result<is_simple>(s, itr.index(), itr));
+			}
+		}
 	}
 
 #if QUERYSTATS
 	size_t num = 0;
 	for (size_t i = 0; i < sizeof(setcnt)/sizeof(setcnt[0]); i++) num += setcnt[i];
-	DEBUG(imgdb)("Query complete, coefcnt=%zd coeflen=%zd coefmax=%zd numset=%zd/%zd\nCounts: ", coefcnt, coeflen, coefmax, num, m_images.size());
+	clock_gettime(CLOCK_MONOTONIC, &time_end);
+	DEBUG(imgdb)("Query complete, queries=%zd coefcnt=%zd coeflen=%zd coefmax=%zd numset=%zd/%zd tiles=%zd time=%.3fms\nCounts: ", batch.num, coefcnt, coeflen, coefmax, num, m_images.size(), tiles,
+		(time_end.tv_sec - time_start.tv_sec) * 1e3 + (time_end.tv_nsec - time_start.tv_nsec) / 1e6);
 	num = 0;
 	for (size_t i = sizeof(setcnt)/sizeof(setcnt[0]) - 1; i > 0 && num < 10; i--) if (setcnt[i]) {
 		num++;
@@ -1462,19 +2711,305 @@ sim_vector dbSpaceImpl<is_simple>::do_query(queryArg q) {
 	|* counts on match: ~100-120 1  counts on semi-match: ~60-95 1-2  counts on no match: ~50 and lower
 	\*/
 #endif
-	std::reverse(V.begin(), V.end());
-//fprintf(stderr, "Returning %zd images.\n", V.size());
-	return V;
+}
 
+template<bool is_simple>
+void dbSpaceImpl<is_simple>::set_checkpoints(query_batch& batch) {
+	std::stable_sort(batch.buckets.begin(), batch.buckets.end(), typename query_bucket::heavier());
+
+	// Check each time the remaining weight of the batch has halved. Queries only
+	// get pruned close to the end, when little weight is left.
+	Score total = 0;
+	for (typename query_bucket_list::const_iterator b = batch.buckets.begin(); b != batch.buckets.end(); ++b)
+		for (typename query_bucket::use_list::const_iterator u = b->uses.begin(); u != b->uses.end(); ++u)
+			total += u->weight;
+
+	Score rest = total, next = total / 2;
+	for (typename query_bucket_list::const_iterator b = batch.buckets.begin(); b != batch.buckets.end(); ++b) {
+		if (rest <= next) {
+			batch.checkpoints.push_back(b - batch.buckets.begin());
+			while (next && rest <= next) next /= 2;
+		}
+		for (typename query_bucket::use_list::const_iterator u = b->uses.begin(); u != b->uses.end(); ++u)
+			rest -= u->weight;
+	}
+
+	// Weight of each query in the buckets from each checkpoint on.
+	batch.remaining.assign(batch.checkpoints.size() * batch.num, 0);
+	std::vector<Score> weight(batch.num);
+	size_t pos = batch.buckets.size();
+	for (size_t k = batch.checkpoints.size(); k-- > 0; ) {
+		for (; pos > batch.checkpoints[k]; pos--)
+			for (typename query_bucket::use_list::const_iterator u = batch.buckets[pos - 1].uses.begin(); u != batch.buckets[pos - 1].uses.end(); ++u)
+				weight[u->query] += u->weight;
+		std::copy(weight.begin(), weight.end(), batch.remaining.begin() + k * batch.num);
+	}
+}
+
+// The coefficients of a query for each color, to find them in image signatures.
+class coef_set {
+public:
+	coef_set() { memset(m_bits, 0, sizeof(m_bits)); }
+	void add(int c, Idx coef) { size_t i = coef + NUM_PIXELS_SQUARED; m_bits[c][i / 32] |= 1U << (i % 32); }
+	bool has(int c, Idx coef) const { size_t i = coef + NUM_PIXELS_SQUARED; return m_bits[c][i / 32] & (1U << (i % 32)); }
+
+private:
+	uint32_t m_bits[3][2 * NUM_PIXELS_SQUARED / 32];
+};
+
+// Buckets with the highest weight for the fewest entries first.
+template<typename B>
+struct better_ratio {
+	bool operator() (const B& one, const B& two) const {
+		return (DScore) one.uses.front().weight * two.bucket->size() > (DScore) two.uses.front().weight * one.bucket->size();
+	}
+};
+
+template<bool is_simple>
+bool dbSpaceImpl<is_simple>::use_bucket(const queryArg& query, int c, int coef) {
+	size_t size = 0, count = 0;
+	if (!m_shards) {
+		size = imgbuckets.at(c, coef).size();
+		count = m_nextIndex;
+	} else {
+		for (typename std::vector<dbSpaceImpl*>::const_iterator itr = m_shards->begin(); itr != m_shards->end(); ++itr) {
+			size += (*itr)->imgbuckets.at(c, coef).size();
+			count += (*itr)->m_nextIndex;
+		}
+	}
+	return size && !(query.flags & flag_nocommon && size > count / 10);
+}
+
+template<bool is_simple>
+sim_vector dbSpaceImpl<is_simple>::query_candidates(const queryArg& query) {
+	size_t count = m_nextIndex;
+	int num_colors = (query.flags & flag_grayscale) || is_grayscale(query.avgl) ? 1 : 3;
+	int sketch = query.flags & flag_sketch ? 1 : 0;
+
+	// Same buckets and weights as do_query.
+	query_bucket_list buckets;
+	coef_set coefs;
+	Score scale = 0;
+	for (int b = (query.flags & flag_fast) ? NUM_COEFS : 0; b < NUM_COEFS; b++) {
+		for (int c = 0; c < num_colors; c++) {
+			int idx;
+			bucket_type& bucket = imgbuckets.at(c, query.sig[c][b], &idx);
+			if (!use_bucket(query, c, query.sig[c][b])) continue;
+
+			Score weight = weights[sketch][imgBin[idx]][c];
+			scale -= weight;
+			coefs.add(c, query.sig[c][b]);
+			if (bucket.empty()) continue;
+			buckets.push_back(query_bucket(bucket));
+			buckets.back().uses.push_back(typename query_bucket::use(0, weight));
+		}
+	}
+	// Without any bucket to find candidates in, all images are ranked by
+	// their luminance alone, which only the full query does.
+	if (buckets.empty()) {
+		queryArg full(query);
+		full.flags &= ~flag_rerank;
+		return do_query(&full, 1).front();
+	}
+
+	// First sum up the weights in the buckets with the most weight per entry,
+	// up to rerank_entries per image but at least one bucket.
+	std::sort(buckets.begin(), buckets.end(), better_ratio<query_bucket>());
+	size_t budget = rerank_entries * count, entries = 0;
+	typename query_bucket_list::const_iterator last = buckets.begin();
+	for (; last != buckets.end() && (last == buckets.begin() || entries + last->bucket->size() <= budget); ++last)
+		entries += last->bucket->size();
+
+	mem_policy::scratch<Score> scores(count);
+	memset(scores.ptr(), 0, sizeof(Score) * count);
+	ptrdiff_t local = m_arena.local();
+	for (typename query_bucket_list::const_iterator b = buckets.begin(); b != last; ++b) {
+		typename imageIdIndex_map<is_simple>::iterator begin = b->map.m_img, end = b->map.m_end;
+		localize(begin, m_arena, local);
+		localize(end, m_arena, local);
+		idIndexIterator itr(begin, *this);
+		idIndexTailIterator tail(b->bucket->tail().begin(), *this);
+		scan_bucket(itr, end, 0, count, scores.ptr(), b->uses.front().weight);
+		scan_bucket(tail, b->bucket->tail().end(), 0, count, scores.ptr(), b->uses.front().weight);
+	}
+
+	// The candidates are the images with the highest sums, worst at the top,
+	// leaving out those the query skips. With equal sums, the image with the
+	// lower index wins.
+	typedef std::pair<Score, size_t> candidate;
+	std::priority_queue<candidate> best;
+	size_t num = std::max<size_t>(rerank_candidates, query.numres);
+	bool use_mask = query.flags & flag_mask;
+	Score limit = 0;
+	for (size_t ind = 0; ind < count; ind++) {
+		if (scores[ind] >= limit || is_deleted(ind)) continue;
+		if (use_mask && (m_lumin.mask[ind] & query.mask_and) != query.mask_xor) continue;
+		if (best.size() == num) best.pop();
+		best.push(candidate(scores[ind], ind));
+		if (best.size() == num) limit = best.top().first;
+	}
+
+	std::vector<size_t> candidates;
+	candidates.reserve(best.size());
+	for (; !best.empty(); best.pop())
+		candidates.push_back(best.top().second);
+	std::sort(candidates.begin(), candidates.end());
+
+	// Then score them fully, in index order like do_query. Grayscale images
+	// are only in the buckets of the first color.
+	sim_queue<is_simple> results(*this, query);
+	for (std::vector<size_t>::const_iterator itr = candidates.begin(); itr != candidates.end(); ++itr) {
+		Score s;
+		score_luminance(query, num_colors, *itr, *itr + 1, &s);
+		if (s >= lumin_scan::skipped / 2) continue;
+
+		ImgData sig;
+		m_sigs.read(*itr, &sig);
+		const Idx* const sigs[3] = { sig.sig1, sig.sig2, sig.sig3 };
+		int colors = is_grayscale(m_info[*itr].avgl) ? 1 : num_colors;
+		for (int c = 0; c < colors; c++)
+			for (int i = 0; i < NUM_COEFS; i++)
+				if (coefs.has(c, sigs[c][i])) s -= weights[sketch][imgBin[abs(sigs[c][i])]][c];
+
+		if (results.wants(s))
+			results.add(sim_result<is_simple>(s, *itr, imageIterator(m_info.begin() + *itr, *this)));
+	}
+
+	DEBUG(imgdb)("Scored %zd candidates from %zd bucket entries.\n", candidates.size(), entries);
+	return results.results(((DScore) ScoreMax) * ScoreMax / scale);
+}
+
+template<bool is_simple>
+sim_vector_list dbSpaceImpl<is_simple>::do_query(const queryArg* queries, size_t num) {
+	if (!m_bucketsValid) throw usage_error("Can't query with invalid buckets.");
+
+	// Without signatures, flag_rerank queries have to score all images too.
+	if (m_withSigs) {
+		std::vector<queryArg> rest;
+		std::vector<size_t> positions;
+		sim_vector_list V(num);
+		for (size_t i = 0; i < num; i++) {
+			if (queries[i].flags & flag_rerank) {
+				V[i] = query_candidates(queries[i]);
+			} else {
+				rest.push_back(queries[i]);
+				positions.push_back(i);
+			}
+		}
+		if (rest.size() < num) {
+			sim_vector_list R = rest.empty() ? sim_vector_list() : do_query(&rest.front(), rest.size());
+			for (size_t i = 0; i < R.size(); i++)
+				V[positions[i]].swap(R[i]);
+			return V;
+		}
+	}
+
+	// Scores of a batch take tile * num entries, and only simple mode tiles
+	// the images, so split up batches that would need too many.
+	size_t tile = is_simple && is_memory && query_tile_images ? query_tile_min : m_nextIndex;
+	size_t most = std::max<size_t>(1, query_batch_scores / std::max<size_t>(tile, 1));
+	if (num > most) {
+		sim_vector_list V;
+		V.reserve(num);
+		for (size_t i = 0; i < num; i += most) {
+			sim_vector_list R = do_query(queries + i, std::min(most, num - i));
+			for (sim_vector_list::iterator itr = R.begin(); itr != R.end(); ++itr) {
+				V.push_back(sim_vector());
+				V.back().swap(*itr);
+			}
+		}
+		return V;
+	}
+
+	size_t count = m_nextIndex;
+
+	// Find the buckets of all queries, each one only once.
+	query_batch batch(queries, num);
+	typedef std::map<const bucket_type*, size_t> bucket_map;
+	bucket_map positions;
+	bool prune = false;
+	batch.buckets.reserve(NUM_COEFS * 3);
+	for (size_t i = 0; i < num; i++) {
+		const queryArg& q = queries[i];
+		int num_colors = (q.flags & flag_grayscale) || is_grayscale(q.avgl) ? 1 : 3;
+		int sketch = q.flags & flag_sketch ? 1 : 0;
+		Score scale = 0, all = 0;
+
+		for (int b = (q.flags & flag_fast) ? NUM_COEFS : 0; b < NUM_COEFS; b++) {	// for every coef on a sig
+			for (int c = 0; c < num_colors; c++) {
+				int idx;
+				bucket_type& bucket = imgbuckets.at(c, q.sig[c][b], &idx);
+				Score weight = weights[sketch][imgBin[idx]][c]; 
+				all -= weight;
+				if (!use_bucket(q, c, q.sig[c][b])) continue;
+
+				scale -= weight;
+				if (bucket.empty()) continue;
+
+				std::pair<typename bucket_map::iterator, bool> pos = positions.insert(std::make_pair(&bucket, batch.buckets.size()));
+				if (pos.second) batch.buckets.push_back(query_bucket(bucket));
+				batch.buckets[pos.first->second].uses.push_back(typename query_bucket::use(i, weight));
+			}
+		}
+
+		// If none of its buckets is used, the query only ranks the images by
+		// luminance, scaled by the weights of all its coefficients.
+		batch.colors.push_back(num_colors);
+		batch.scales.push_back(scale ? scale : all);
+		prune |= q.flags & flag_prune;
+	}
+	if (prune) set_checkpoints(batch);
+
+	std::vector<sim_queue<is_simple> > results;
+	results.reserve(num);
+	for (size_t i = 0; i < num; i++)
+		results.push_back(sim_queue<is_simple>(*this, queries[i]));
+
+	// Only in-memory buckets in simple mode are sorted and can be split up by index.
+	unsigned int parts = 1;
+#if !QUERYSTATS
+	if (is_simple && is_memory && query_pool)
+		parts = std::min<size_t>(query_pool->size(), count / query_part_images);
+#endif
+
+	prune_stats stats;
+	if (parts > 1) {
+		query_job job(*this, batch, count, parts);
+		query_pool->run(job, parts);
+
+		for (size_t i = 0; i < num; i++) {
+			typename sim_queue<is_simple>::result_list all = job.results(i);
+			results[i].merge(all);
+		}
+		stats = job.stats();
+	} else {
+		query_range(batch, 0, count, results, stats);
+	}
+
+	if (prune)
+		DEBUG(imgdb)("Pruned %zd of %zd query tiles, skipped %zd of %zd bucket scans.\n",
+			stats.pruned, stats.tiles, stats.skipped, stats.scans + stats.skipped);
+
+	sim_vector_list V;
+	V.reserve(num);
+	for (size_t i = 0; i < num; i++) {
+		Score scale = ((DScore) ScoreMax) * ScoreMax / batch.scales[i];
+		V.push_back(results[i].results(scale));
+	}
+	return V;
 }
 
 template<bool is_simple>
 inline sim_vector
 dbSpaceImpl<is_simple>::queryImg(const queryArg& query) {
-	if ((query.flags & flag_grayscale) || is_grayscale(query.avgl))
-		return do_query<1>(query);
-	else
-		return do_query<3>(query);
+	return do_query(&query, 1).front();
+}
+
+template<bool is_simple>
+sim_vector_list
+dbSpaceImpl<is_simple>::queryImgBatch(const queryArg_list& queries) {
+	if (queries.empty()) return sim_vector_list();
+	return do_query(&queries.front(), queries.size());
 }
 
 // cluster by similarity. Returns list of list of imageIds (img ids)
@@ -1519,23 +3054,34 @@ imageId_list_2 clusterSim(const int dbId, float thresd, int fast = 0) {
 }
  */
 
+template<bool is_simple>
+inline void dbSpaceImpl<is_simple>::set_deleted(size_t ind) {
+	if (ind >= m_deleted.size()) m_deleted.resize(ind + 1);
+	m_deleted[ind] = true;
+	m_deletedCount++;
+}
+
+// The image keeps its place in the image table until the next purge.
 template<>
 void dbSpaceImpl<false>::removeImage(imageId id) {
-	SigStruct* isig = find(id).sig();
+	size_t ind = find(id).index();
 	ImgData nsig;
-	read_sig_cache(isig->cacheOfs, &nsig);
+	m_sigs.read(ind, &nsig);
 	imgbuckets.remove(nsig);
 	m_bucketsValid = false;
+	set_deleted(ind);
 	m_images.erase(id);
-	delete isig;
 }
 
 template<>
 void dbSpaceImpl<true>::removeImage(imageId id) {
 	// Can't efficiently remove it from buckets, just mark it as
-	// invalid and remove it from query results.
-	m_info[find(id).index()].avgl[0] = 0;
+	// deleted and remove it from query results. The next compaction
+	// then leaves it out of the buckets.
+	set_deleted(find(id).index());
 	m_images.erase(id);
+	m_removedCount++;
+	m_deltaCount++;
 }
 
 void dbSpaceAlter::removeImage(imageId id) {
@@ -1543,6 +3089,7 @@ void dbSpaceAlter::removeImage(imageId id) {
 		throw usage_error("Not possible in imgdata mode.");
 
 	ImageMap::iterator itr = find(id);
+	copy_file();
 	m_deleted.push_back(itr->second);
 	m_images.erase(itr);
 }
@@ -1550,7 +3097,7 @@ void dbSpaceAlter::removeImage(imageId id) {
 template<typename B>
 inline void dbSpaceCommon::bucket_set<B>::remove(const ImgData& nsig) {
 	lumin_int avgl;
-	SigStruct::avglf2i(nsig.avglf, avgl);
+	image_info::avglf2i(nsig.avglf, avgl);
 	for (int i = 0; 0 && i < NUM_COEFS; i++) {
 		FLIP(nsig.sig1[i]); FLIP(nsig.sig2[i]); FLIP(nsig.sig3[i]);
 //fprintf(stderr, "\r%d %d %d %d", i, nsig.sig1[i], nsig.sig2[i], nsig.sig3[i]);
@@ -1633,8 +3180,9 @@ void dbSpaceImpl<false>::rehash() {
 	}
 
 	for (imageIterator itr = image_begin(); itr != image_end(); ++itr) {
+		if (is_deleted(itr.index())) continue;
 		ImgData dsig;
-		read_sig_cache(itr.cOfs(), &dsig);
+		m_sigs.read(itr.index(), &dsig);
 		imgbuckets.add(dsig, itr.index());
 	}
 
@@ -1643,6 +3191,94 @@ void dbSpaceImpl<false>::rehash() {
 
 template<> void dbSpaceImpl<true>::rehash() { throw usage_error("Invalid for read-only db."); }
 
+// Normal mode modifies the buckets directly.
+template<> size_t dbSpaceImpl<false>::getDeltaCount() { return 0; }
+template<> bool dbSpaceImpl<false>::compact(size_t max_buckets) { return true; }
+
+template<> size_t dbSpaceImpl<true>::getDeltaCount() { return m_deltaCount; }
+
+template<>
+bool dbSpaceImpl<true>::compact(size_t max_buckets) {
+	// Start with the delta segment as it is now. Images added or removed
+	// while compacting are left for the next time.
+	if (!m_compactNext) {
+		if (!m_deltaCount) return true;
+		m_compactDelta = m_deltaCount;
+		m_compactRemoved = m_removedCount;
+	}
+
+	// Only look for removed images in the buckets if there are any new ones.
+	static const std::vector<bool> none;
+	const std::vector<bool>& removed = m_compactRemoved ? m_deleted : none;
+
+	// Also move unchanged buckets out of the arena, so that it can be released.
+	size_t end = std::min<size_t>(imgbuckets.count(), m_compactNext + max_buckets);
+	for (buckets_t::iterator itr = imgbuckets.begin() + m_compactNext; itr != imgbuckets.begin() + end; ++itr)
+		itr->compact(removed, NULL, itr->uses(m_arena.begin(), m_arena.end()));
+
+	m_compactNext = end;
+	if (m_compactNext < imgbuckets.count()) return false;
+
+	DEBUG(imgdb)("Compacted %zd added or removed images.\n", m_compactDelta);
+	m_arena.release();
+	m_compactNext = 0;
+	m_deltaCount -= m_compactDelta;
+	m_removedCount -= m_compactRemoved;
+	return true;
+}
+
+template<bool is_simple>
+size_t dbSpaceImpl<is_simple>::getArenaSize() { return m_arena.bytes() * (m_arena.copies() + 1); }
+
+template<bool is_simple>
+size_t dbSpaceImpl<is_simple>::getDeletedCount() { return m_deletedCount; }
+
+template<bool is_simple>
+void dbSpaceImpl<is_simple>::purge() {
+	if (is_simple && !is_memory) throw usage_error("Can't purge the disk cache.");
+	if (!m_deletedCount) return;
+
+	// Move the remaining images down in the same order, so that their
+	// indices in the buckets stay sorted when renumbering them.
+	AutoCleanArray<size_t> renumber(m_nextIndex);
+	size_t count = 0;
+	for (size_t ind = 0; ind < m_nextIndex; ind++) {
+		if (is_deleted(ind)) continue;
+		renumber[ind] = count;
+		if (ind != count) {
+			m_info[count] = m_info[ind];
+			m_lumin.set(count, m_info[count]);
+			m_images.add_index(m_info[count].id, count);
+			if (m_withSigs) {
+				ImgData sig;
+				m_sigs.read(ind, &sig);
+				m_sigs.write(count, &sig);
+			}
+		}
+		count++;
+	}
+
+	// In normal mode, the buckets hold image IDs, so only the images need new indices.
+	// Renumbering rewrites all buckets, so none are left in the arena.
+	if (is_simple) {
+		for (typename buckets_t::iterator itr = imgbuckets.begin(); itr != imgbuckets.end(); ++itr)
+			itr->compact(m_deleted, renumber.ptr());
+		m_arena.release();
+	}
+
+	DEBUG(imgdb)("Purged %zd deleted images, %zd left.\n", m_nextIndex - count, count);
+	image_info_list(m_info.begin(), m_info.begin() + count).swap(m_info);
+	m_lumin.truncate(count);
+	m_sigs.truncate(count);
+	m_nextIndex = count;
+	std::vector<bool>().swap(m_deleted);
+	m_deletedCount = 0;
+
+	// All buckets are compacted now.
+	m_deltaCount = m_removedCount = 0;
+	m_compactNext = 0;
+}
+
 void dbSpaceAlter::rehash() {
 	if (m_readonly)
 		throw usage_error("Not possible in imgdata mode.");
@@ -1655,7 +3291,7 @@ void dbSpaceAlter::rehash() {
 
 template<bool is_simple>
 void dbSpaceImpl<is_simple>::getImgQueryArg(imageId id, queryArg* query) {
-	ImgData img = get_sig_from_cache(id);
+	ImgData img = get_sig(id);
 	queryFromImgData(img, query);
 }
 
@@ -1677,6 +3313,7 @@ stats_t dbSpaceImpl<is_simple>::getCoeffStats() {
 	typedef std::tr1::unordered_map<int, size_t> deltas_t;
 	deltas_t deltas;
 	size_t total = 0, b4 = 0, b70 = 0, b16k = 0, a16k = 0, b255 = 0;
+	size_t delta_bytes = 0, block_bytes = 0;
 #endif
 
 	for (typename buckets_t::iterator itr = imgbuckets.begin(); itr != imgbuckets.end(); ++itr) {
@@ -1696,6 +3333,20 @@ stats_t dbSpaceImpl<is_simple>::getCoeffStats() {
 			deltas[delta]++;
 			last = itr.index();
 		}
+
+		// Memory the base list needs with either codec. Only simple and
+		// read-only mode have them in ascending order.
+		if (is_simple) {
+			delta_queue delta;
+			block_queue block;
+			for (idIndexIterator itr(map.begin(), *this); itr != map.end(); ++itr) {
+				delta.push_back(itr.index());
+				block.push_back(itr.index());
+			}
+			block.finish();
+			delta_bytes += delta.base_size() * sizeof(delta_value);
+			block_bytes += block.bytes();
+		}
 #endif
 	}
 
@@ -1720,6 +3371,12 @@ stats_t dbSpaceImpl<is_simple>::getCoeffStats() {
 	ret.push_back(std::make_pair(16454, b16k));
 	ret.push_back(std::make_pair(~size_t(), a16k));
 	ret.push_back(std::make_pair(255, b255));
+	ret.push_back(std::make_pair(sizeof(delta_value), delta_bytes));
+	ret.push_back(std::make_pair(block_queue::block_size, block_bytes));
+
+	size_t count = std::max<size_t>(getImgCount(), 1);
+	DEBUG(imgdb)("Base lists: %zd entries, delta_queue %zd bytes (%zd per image), block_queue %zd bytes (%zd per image).\n",
+		total, delta_bytes, delta_bytes / count, block_bytes, block_bytes / count);
 #endif
 
 	return ret;
@@ -1737,7 +3394,7 @@ imageId_list dbSpaceImpl<is_simple>::getImgIdList() {
 
 	ids.reserve(getImgCount());
 	for (imageIterator it = image_begin(); it != image_end(); ++it)
-	    if (!is_simple || it.avgl()[0] != 0)
+	    if (!is_deleted(it.index()))
 		ids.push_back(it.id());
 
 	return ids;
@@ -1753,17 +3410,17 @@ imageId_list dbSpaceAlter::getImgIdList() {
 	return ids;
 }
 
-template<> image_info_list dbSpaceImpl<false>::getImgInfoList() {
-	image_info_list info;
+template<bool is_simple>
+image_info_list dbSpaceImpl<is_simple>::getImgInfoList() {
+	if (!m_deletedCount) return m_info;
 
-	// TODO is there a faster way for getting a maps key list and returning a vector from it ?
-	for (imageIterator it = image_begin(); it != image_end(); ++it) {
-		info.push_back(image_info(it.id(), it.avgl(), it.width(), it.height()));
-	}
+	image_info_list info;
+	info.reserve(m_info.size() - m_deletedCount);
+	for (size_t k = 0; k < m_info.size(); k++)
+		if (!is_deleted(k)) info.push_back(m_info[k]);
 
 	return info;
 }
-template<> image_info_list dbSpaceImpl<true>::getImgInfoList() { return m_info; }
 
 /*
 // return structure containing filter with all image ids that have this keyword
@@ -2002,18 +3659,20 @@ dbSpace::~dbSpace() { }
 
 template<bool is_simple>
 dbSpaceImpl<is_simple>::dbSpaceImpl(bool with_struct) :
-	m_sigFile(-1),
-	m_cacheOfs(0),
+	m_withSigs(with_struct),
 	m_nextIndex(0),
-	m_bucketsValid(true) {
+	m_shards(NULL),
+	m_shard(0),
+	m_bucketsValid(true),
+	m_deltaCount(0),
+	m_removedCount(0),
+	m_deletedCount(0),
+	m_compactNext(0) {
 
 	if (!imgBinInited) initImgBin();
 	if (imgbuckets.count() != sizeof(imgbuckets) / sizeof(imgbuckets[0][0][0]))
 		throw internal_error("bucket_set.count() is wrong!");
 
-	if (with_struct)
-		m_sigFile = tempfile();
-
 	// imgIdsFilter = new bloom_filter(AVG_IMGS_PER_DBSPACE, 1.0/(100.0 * AVG_IMGS_PER_DBSPACE),random_bloom_seed);
 }
 
@@ -2023,15 +3682,12 @@ dbSpaceAlter::dbSpaceAlter(bool readonly) : m_f(NULL), m_readonly(readonly) {
 
 template<>
 dbSpaceImpl<false>::~dbSpaceImpl() {
-	close(m_sigFile);
 	// delete imgIdsFilter;
-	for (imageIterator itr = image_begin(); itr != image_end(); ++itr)
-		delete itr.sig();
 }
 
 template<>
 dbSpaceImpl<true>::~dbSpaceImpl() {
-	if (m_sigFile != -1) close(m_sigFile);
+	m_indexMap.unmap();
 	// delete imgIdsFilter;
 }
 
@@ -2045,25 +3701,202 @@ dbSpaceAlter::~dbSpaceAlter() {
 	}
 }
 
-template<bool is_simple>
-size_t dbSpaceImpl<is_simple>::get_sig_cache() {
-	size_t ofs = m_cacheOfs;
-	m_cacheOfs += sizeof(ImgData);
-	return ofs;
+dbSpaceSharded::dbSpaceSharded(bool readonly, unsigned int shards) : m_pool(NULL) {
+	try {
+		for (unsigned int i = 0; i < shards; i++) {
+			m_shards.push_back(new shard_type(readonly));
+			m_shards.back()->set_shard(&m_shards, i);
+		}
+		m_pool = new worker_pool(shards - 1);
+	} catch (...) {
+		for (shard_list::iterator itr = m_shards.begin(); itr != m_shards.end(); ++itr)
+			delete *itr;
+		throw;
+	}
 }
 
-template<bool is_simple>
-void dbSpaceImpl<is_simple>::read_sig_cache(size_t ofs, ImgData* sig) {
-	if (m_sigFile == -1) throw internal_error("Can't read sig cache when using simple db.");
-	if (lseek(m_sigFile, ofs, SEEK_SET) == -1) throw io_error("Can't seek in sig cache.");
-	if (read(m_sigFile, sig, sizeof(ImgData)) != sizeof(ImgData)) throw io_error("Can't read sig cache.");
+dbSpaceSharded::~dbSpaceSharded() {
+	delete m_pool;
+	for (shard_list::iterator itr = m_shards.begin(); itr != m_shards.end(); ++itr)
+		delete *itr;
 }
 
-template<bool is_simple>
-void dbSpaceImpl<is_simple>::write_sig_cache(size_t ofs, const ImgData* sig) {
-	if (m_sigFile == -1) throw internal_error("Can't write sig cache when using simple db.");
-	if (lseek(m_sigFile, ofs, SEEK_SET) == -1) throw io_error("Can't seek in sig cache.");
-	if (write(m_sigFile, sig, sizeof(ImgData)) != sizeof(ImgData)) throw io_error("Can't write to sig cache.");
+class dbSpaceSharded::load_job : public worker_pool::job {
+public:
+	load_job(shard_list& shards, const char* filename) : m_shards(shards), m_filename(filename) { }
+	virtual void run(unsigned int part) { m_shards[part]->load(m_filename); }
+
+private:
+	shard_list& m_shards;
+	const char* m_filename;
+};
+
+class dbSpaceSharded::query_job : public worker_pool::job {
+public:
+	query_job(shard_list& shards, const queryArg_list& queries) : m_shards(shards), m_queries(queries), m_results(shards.size()) { }
+	virtual void run(unsigned int part) { m_results[part] = m_shards[part]->queryImgBatch(m_queries); }
+
+	const std::vector<sim_vector_list>& results() const { return m_results; }
+
+private:
+	shard_list& m_shards;
+	const queryArg_list& m_queries;
+	std::vector<sim_vector_list> m_results;
+};
+
+void dbSpaceSharded::load(const char* filename) {
+	load_job job(m_shards, filename);
+	m_pool->run(job, m_shards.size());
+}
+
+// A result of one shard: its score, then the shard and position, so that
+// equal scores keep the order of the image indices in the DB file.
+struct shard_result {
+	shard_result(Score s, unsigned int sh, size_t p) : score(s), shard(sh), pos(p) { }
+	bool operator< (const shard_result& other) const {
+		return score > other.score || (score == other.score && (shard < other.shard || (shard == other.shard && pos < other.pos)));
+	}
+	Score score;
+	unsigned int shard;
+	size_t pos;
+};
+
+sim_vector dbSpaceSharded::merge(const queryArg& query, const std::vector<sim_vector_list>& results, size_t ind) {
+	std::vector<shard_result> all;
+	for (unsigned int shard = 0; shard < results.size(); shard++)
+		for (size_t pos = 0; pos < results[shard][ind].size(); pos++)
+			all.push_back(shard_result(results[shard][ind][pos].score, shard, pos));
+	std::sort(all.begin(), all.end());
+
+	// Each shard has the best result of its best sets, keep the best one of each set.
+	sim_vector V;
+	std::set<uint16_t> sets;
+	for (std::vector<shard_result>::const_iterator itr = all.begin(); itr != all.end() && V.size() < query.numres; ++itr) {
+		const sim_value& res = results[itr->shard][ind][itr->pos];
+		if (query.flags & flag_uniqueset && !sets.insert(m_shards[itr->shard]->find(res.id).set()).second)
+			continue;
+		V.push_back(res);
+	}
+	return V;
+}
+
+sim_vector dbSpaceSharded::queryImg(const queryArg& query) {
+	return queryImgBatch(queryArg_list(1, query)).front();
+}
+
+sim_vector_list dbSpaceSharded::queryImgBatch(const queryArg_list& queries) {
+	if (queries.empty()) return sim_vector_list();
+
+	query_job job(m_shards, queries);
+	m_pool->run(job, m_shards.size());
+
+	sim_vector_list V;
+	V.reserve(queries.size());
+	for (size_t i = 0; i < queries.size(); i++)
+		V.push_back(merge(queries[i], job.results(), i));
+	return V;
+}
+
+dbSpaceSharded::shard_list::iterator dbSpaceSharded::find(imageId id) {
+	shard_list::iterator itr = m_shards.begin();
+	while (itr != m_shards.end() && !(*itr)->hasImage(id)) ++itr;
+	return itr;
+}
+
+dbSpaceSharded::shard_type& dbSpaceSharded::shard(imageId id) {
+	shard_list::iterator itr = find(id);
+	if (itr == m_shards.end()) throw invalid_id("Invalid image ID.");
+	return **itr;
+}
+
+void dbSpaceSharded::getImgQueryArg(imageId id, queryArg* query) { shard(id).getImgQueryArg(id, query); }
+bool dbSpaceSharded::hasImage(imageId id) { return find(id) != m_shards.end(); }
+int dbSpaceSharded::getImageHeight(imageId id) { return shard(id).getImageHeight(id); }
+int dbSpaceSharded::getImageWidth(imageId id) { return shard(id).getImageWidth(id); }
+void dbSpaceSharded::setImageRes(imageId id, int width, int height) { shard(id).setImageRes(id, width, height); }
+void dbSpaceSharded::removeImage(imageId id) { shard(id).removeImage(id); }
+void dbSpaceSharded::getImgDataByID(imageId id, ImgData* img) { shard(id).getImgDataByID(id, img); }
+void dbSpaceSharded::getImgAvgl(imageId id, lumin_int avgl) { shard(id).getImgAvgl(id, avgl); }
+
+size_t dbSpaceSharded::getImgCount() {
+	size_t count = 0;
+	for (shard_list::iterator itr = m_shards.begin(); itr != m_shards.end(); ++itr)
+		count += (*itr)->getImgCount();
+	return count;
+}
+
+stats_t dbSpaceSharded::getCoeffStats() {
+	stats_t ret = m_shards.front()->getCoeffStats();
+	for (shard_list::iterator itr = m_shards.begin() + 1; itr != m_shards.end(); ++itr) {
+		stats_t shard = (*itr)->getCoeffStats();
+		for (size_t i = 0; i < ret.size() && i < shard.size(); i++)
+			ret[i].second += shard[i].second;
+	}
+	return ret;
+}
+
+imageId_list dbSpaceSharded::getImgIdList() {
+	imageId_list ids;
+	ids.reserve(getImgCount());
+	for (shard_list::iterator itr = m_shards.begin(); itr != m_shards.end(); ++itr) {
+		imageId_list shard = (*itr)->getImgIdList();
+		ids.insert(ids.end(), shard.begin(), shard.end());
+	}
+	return ids;
+}
+
+image_info_list dbSpaceSharded::getImgInfoList() {
+	image_info_list info;
+	for (shard_list::iterator itr = m_shards.begin(); itr != m_shards.end(); ++itr) {
+		image_info_list shard = (*itr)->getImgInfoList();
+		info.insert(info.end(), shard.begin(), shard.end());
+	}
+	return info;
+}
+
+void dbSpaceSharded::addImageData(const ImgData* img) {
+	if (hasImage(img->id))
+		throw duplicate_id("Image already in database.");
+
+	m_shards.back()->addImageData(img);
+}
+
+void dbSpaceSharded::rehash() {
+	for (shard_list::iterator itr = m_shards.begin(); itr != m_shards.end(); ++itr)
+		(*itr)->rehash();
+}
+
+size_t dbSpaceSharded::getDeltaCount() {
+	size_t count = 0;
+	for (shard_list::iterator itr = m_shards.begin(); itr != m_shards.end(); ++itr)
+		count += (*itr)->getDeltaCount();
+	return count;
+}
+
+size_t dbSpaceSharded::getArenaSize() {
+	size_t size = 0;
+	for (shard_list::iterator itr = m_shards.begin(); itr != m_shards.end(); ++itr)
+		size += (*itr)->getArenaSize();
+	return size;
+}
+
+bool dbSpaceSharded::compact(size_t max_buckets) {
+	bool done = true;
+	for (shard_list::iterator itr = m_shards.begin(); itr != m_shards.end(); ++itr)
+		done &= (*itr)->compact(max_buckets);
+	return done;
+}
+
+size_t dbSpaceSharded::getDeletedCount() {
+	size_t count = 0;
+	for (shard_list::iterator itr = m_shards.begin(); itr != m_shards.end(); ++itr)
+		count += (*itr)->getDeletedCount();
+	return count;
+}
+
+void dbSpaceSharded::purge() {
+	for (shard_list::iterator itr = m_shards.begin(); itr != m_shards.end(); ++itr)
+		(*itr)->purge();
 }
 
 } // namespace
@@ -50,10 +50,28 @@ Count	Size		Content
 1	int32_t		DB file version and data size code
 1	count_t		Number of images
 1	offset_t	Offset to image signatures
+1	offset_t	Offset to query index, or 0 (only since version 10)
 98304	count_t		Bucket sizes
 num_img	imageId		Image IDs
 ?	?		<unused space left for future image IDs up to above offset>
 num_img	ImgData		Image signatures
+?	?		<padding up to the query index offset>
+
+The query index has all data needed for queries in simple and read-only mode,
+in the layout used in memory, so it can be memory mapped instead of adding
+each image signature to the buckets again. Its offsets are relative to its
+start:
+
+1	db_index_header	Number of images, word size and offsets of the parts
+num_img	image_info	Image infos, in the same order as the signatures
+98304	db_index_bucket	Size and location of each bucket's posting list
+?	size_t		delta_queue words of the posting lists
+?	position	delta_queue_view::position to seek in the posting lists
+
+The index is only used if the word size and endianness match. Alter mode
+drops the index before changing the DB, and since a server may have it
+mapped at the time, it writes a copy of the DB without the index instead of
+changing the file in place. A normal mode save writes a new index.
 
 When removing images would leave holes in the image signatures and they were
 not filled by new images, signatures from the end will be relocated to fill
@@ -196,6 +214,7 @@ struct image_info {
 };
 
 typedef std::vector<sim_value> sim_vector;
+typedef std::vector<sim_vector> sim_vector_list;
 typedef std::vector<std::pair<uint32_t, size_t> > stats_t;
 typedef std::vector<imageId> imageId_list;
 typedef std::vector<image_info> image_info_list;
@@ -262,6 +281,7 @@ struct queryArg : public queryOpt {
 	lumin_int	avgl;
 	unsigned int	numres;
 };
+typedef std::vector<queryArg> queryArg_list;
 
 class dbSpace {
 public:
@@ -278,13 +298,52 @@ public:
 	static const int flag_uniqueset	= 0x08;	// Return only best match from each set.
 	static const int flag_nocommon	= 0x10;	// Disregard common coefficients (those which are present in at least 10% of the images).
 	static const int flag_fast	= 0x20;	// Check only DC coefficient (luminance).
+	static const int flag_prune	= 0x40;	// Stop scoring images once they can't make it into the results anymore. Same results, only faster.
+	static const int flag_rerank	= 0x80;	// Only fully score the images sharing the most heavy coefficients with the query. Much faster for near-duplicates, needs signatures.
 
 	// Used internally.
 	static const int flags_internal	= 0xff000000;
 	static const int flag_mask	= 0x10000000;	// Use AND and XOR masks, and only return image if result is zero.
 
+	// Mode by name. "simple:N" and "readonly:N" split the DB into N shards
+	// of up to 255, which are loaded and queried in parallel on their own
+	// threads. Results are the same, except that images with equal scores
+	// may be in a different order. Sharded DBs cannot be saved.
 	static int         mode_from_name(const char* mode);
 
+	// Number of threads to split up each query into. Only used in read-only
+	// and simple mode, and only for large databases. Not thread-safe, set it
+	// before running any queries. Loading a DB file without query index in
+	// these modes also fills the buckets with this many threads.
+	static void        setQueryThreads(unsigned int threads);
+
+	// Pages for the buckets that read-only and simple mode build while
+	// loading, and for the query scores: normal ones, transparent huge pages
+	// (the default), or huge pages the system must have reserved, using
+	// transparent ones if there aren't enough. Buckets used directly from the
+	// query index of a DB file are not affected. Not thread-safe either.
+	static const int pages_normal		= 0;
+	static const int pages_transparent	= 1;
+	static const int pages_reserved		= 2;
+	static void        setHugePages(int pages);
+
+	// Whether read-only and simple mode keep a copy of the buckets on each
+	// NUMA node, for queries to read from the memory of the node they run
+	// on. Needs more memory, and copies the query index of a DB file
+	// instead of using it directly. Set it before loading. Not thread-safe
+	// either.
+	static void        setNumaReplicas(bool replicas);
+
+	// Number of images to score at a time in simple mode, so that their
+	// scores stay in the CPU cache while applying all coefficients.
+	// Use 0 to score all images at once. Not thread-safe either.
+	static void        setQueryTile(size_t images);
+
+	// Number of images that flag_rerank queries score from their signatures
+	// (at least the number of results), and how many bucket entries per image
+	// in the DB they read to find them. Not thread-safe either.
+	static void        setRerank(size_t candidates, double entries);
+
 	static dbSpace*    load_file(const char* filename, int mode);
 	virtual void       save_file(const char* filename) = 0;
 
@@ -293,6 +352,11 @@ public:
 	// Image queries.
 	virtual sim_vector queryImg(const queryArg& query) = 0;
 
+	// Run several queries at once, returning the same results as querying
+	// them one at a time. Buckets shared by several of the queries are
+	// only scanned once.
+	virtual sim_vector_list queryImgBatch(const queryArg_list& queries) = 0;
+
 	// Image data.
 	static void imgDataFromFile(const char* filename, imageId id, ImgData* img);
 	static void imgDataFromBlob(const void* data, size_t data_size, imageId id, ImgData* img);
@@ -320,6 +384,31 @@ public:
 	virtual void removeImage(imageId id) = 0;
 	virtual void rehash() = 0;
 
+	// In read-only and simple mode, images added or removed after loading
+	// the DB are kept in a delta segment next to the query buckets, which
+	// makes queries slower as it grows. Removed images are not returned, but
+	// still use space in the buckets. Compacting folds the delta segment into
+	// the buckets. It handles at most max_buckets of the 98304 buckets per
+	// call and returns true once all are done, so that queries and changes
+	// can run between calls. Other modes have no delta segment.
+	virtual size_t getDeltaCount() = 0;
+	virtual bool compact(size_t max_buckets) = 0;
+
+	// Read-only and simple mode load the buckets into one block of memory,
+	// unless they use the query index of the DB file directly, with a copy
+	// on each NUMA node if enabled. getArenaSize() returns its size in bytes,
+	// including copies, or 0 if there is none. Compacting moves the buckets
+	// out of it, so it is freed after the first full compaction or purge.
+	virtual size_t getArenaSize() = 0;
+
+	// In read-only, simple and normal mode, removed images keep their place
+	// in the list of images until it is purged, which makes queries slower
+	// and uses memory. Purging also compacts the DB, all at once, so the DB
+	// can't be used while it runs. In alter mode, removed images are
+	// dropped from the DB file when saving.
+	virtual size_t getDeletedCount() = 0;
+	virtual void purge() = 0;
+
 	// Similarity.
 	virtual Score calcAvglDiff(imageId id1, imageId id2) = 0;
 	virtual Score calcSim(imageId id1, imageId id2, bool ignore_color = false) = 0;
@@ -36,15 +36,24 @@ There is an additional "alter" version that modifies the DB file directly
 instead of first loading it into memory, like the other modes do.
 
 The advantage of this design is maximum code re-use for the two DB usage
-patterns: maintenance and querying. Both implementation classes use
-different variables, and specifically different iterators to iterate over
-all images. The implementation details of the iterators are of course
-different but the majority of the actual code is the same for both types.
+patterns: maintenance and querying. Both implementation classes keep the
+images in the same table in index order, with a hash of the index of each
+image ID, but their buckets differ: in normal mode they hold image IDs, in
+read-only mode the indices. The implementation details of the bucket
+iterators are of course different but the majority of the actual code is
+the same for both types.
 \**************************************************************************/
 
 #ifndef IMGDBLIB_H
 #define IMGDBLIB_H
 
+// Block queues replace delta queues if both are enabled.
+#ifdef USE_BLOCK_QUEUE
+#undef USE_DELTA_QUEUE
+#endif
+
+#include <algorithm>
+#include <functional>
 #include <list>
 
 #include <fstream>
@@ -59,10 +68,13 @@ different but the majority of the actual code is the same for both types.
 #endif
 
 #include "auto_clean.h"
+#include "block_queue.h"
 #include "delta_queue.h"
 #include "haar.h"
 #include "imgdb.h"
 
+class worker_pool;
+
 namespace imgdb {
 
 typedef unsigned int uint;
@@ -104,10 +116,15 @@ union image_id_index {
 
 typedef std::vector<image_id_index> IdIndex_list;
 
+// Order image_id_index values by index, for bucket lists that store indices in ascending order.
+struct index_less : public std::binary_function<image_id_index, image_id_index, bool> {
+	bool operator() (const image_id_index& one, const image_id_index& two) const { return one.index < two.index; }
+};
+
 template<bool is_simple> struct map_iterator;
 template<> struct map_iterator<false> : public std::iterator<std::forward_iterator_tag, image_id_index> { 
 	map_iterator(image_id_index* p) : m_p(p) { }
-	map_iterator() { }
+	map_iterator() : m_p(NULL) { }
 
 	image_id_index*	operator->() const { return m_p; }
 	image_id_index&	operator* () const { return *m_p; }
@@ -119,7 +136,19 @@ template<> struct map_iterator<false> : public std::iterator<std::forward_iterat
 
 	image_id_index* m_p;
 };
-#ifdef USE_DELTA_QUEUE
+#ifdef USE_BLOCK_QUEUE
+#ifdef USE_DISK_CACHE
+#error Sorry, block queue and disk cache cannot be used at the same time.
+#endif
+template<> struct map_iterator<true> : public block_queue::const_iterator {
+	typedef block_queue::const_iterator base_type;
+
+	map_iterator(const base_type& itr) : base_type(itr) { }
+	map_iterator() { }
+
+	size_t get_index() const { return **this; }
+};
+#elif defined(USE_DELTA_QUEUE)
 #ifdef USE_DISK_CACHE
 #error Sorry, delta queue and disk cache cannot be used at the same time.
 #endif
@@ -155,6 +184,80 @@ struct mapped_file {
 	size_t m_length;
 };
 
+// Image signatures by index, in normal and read-only mode. When loaded from
+// a DB file in the native format, they are mapped directly from its signature
+// region, copy-on-write. Otherwise, and for images added later, they are kept
+// in memory after the mapped ones. The mapped signatures need not be aligned,
+// so they are only accessed by copying.
+class sig_store {
+public:
+	sig_store() : m_sigs(NULL), m_mapped(0) { }
+	~sig_store() { clear(); }
+
+	// Map count signatures at the given offset of the DB file. The store must be empty.
+	void map(const char* filename, offset_t offset, size_t count);
+	void reserve(size_t count) { m_added.reserve(count - m_mapped); }
+	void clear();
+
+	size_t size() const { return m_mapped + m_added.size(); }
+	bool is_mapped() const { return m_mapped; }
+
+	void read(size_t ind, ImgData* sig) const;
+	// Replace a signature, or add one if ind is the current size.
+	void write(size_t ind, const ImgData* sig);
+	// Keep only the first count signatures.
+	void truncate(size_t count);
+
+private:
+	sig_store(const sig_store&);
+	sig_store& operator = (const sig_store&);
+
+	mapped_file m_map;
+	char* m_sigs;
+	size_t m_mapped;
+	std::vector<ImgData> m_added;
+};
+
+// Index of each image ID in the image table, in normal and read-only mode.
+// Open addressing with linear probing in a single array, which needs much
+// less memory than a node per image and usually finds an ID in the first
+// cache line. Removing an ID moves the following entries of its run back,
+// so there are no tombstones that slow down later lookups.
+class image_index_hash {
+public:
+	static const size_t npos = ~(size_t)0;
+
+	image_index_hash() : m_size(0), m_mask(0) { }
+
+	// Index of the image, or npos if it is not in the table.
+	size_t find(imageId id) const {
+		if (!m_size) return npos;
+		for (size_t i = slot(id); ; i = (i + 1) & m_mask) {
+			const entry& e = m_slots[i];
+			if (e.index == npos || e.id == id) return e.index;
+		}
+	}
+
+	// Add the image, or change its index.
+	void add_index(imageId id, size_t index);
+	void erase(imageId id);
+	void reserve(size_t count);
+
+	size_t size() const { return m_size; }
+
+private:
+	struct entry {
+		imageId id;
+		size_t index;	// npos for empty slots
+	};
+
+	size_t slot(imageId id) const { return (size_t) (((uint64_t) id * 0x9E3779B97F4A7C15ULL) >> 32) & m_mask; }
+
+	std::vector<entry> m_slots;
+	size_t m_size;
+	size_t m_mask;
+};
+
 template<bool is_simple>
 struct imageIdIndex_map : public mapped_file {
 	typedef map_iterator<is_simple> iterator;
@@ -219,7 +322,20 @@ template<>
 class imageIdIndex_list<true, true> {
 public:
 	static const size_t threshold = 0;
-#ifdef USE_DELTA_QUEUE
+#ifdef USE_BLOCK_QUEUE
+	class container : public block_queue {
+	public:
+		struct const_iterator : public block_queue::const_iterator {
+			const_iterator(const block_queue::const_iterator& itr) : block_queue::const_iterator(itr) { }
+			size_t get_index() const { return **this; }
+		};
+	};
+
+	// The base list is always in memory, also when loaded from the query index of a DB file.
+	typedef block_queue base_list;
+
+	imageIdIndex_list() { }
+#elif defined(USE_DELTA_QUEUE)
 	class container : public delta_queue {
 	public:
 		struct const_iterator : public delta_iterator {
@@ -227,6 +343,11 @@ public:
 			size_t get_index() const { return **this; }
 		};
 	};
+
+	// The base list is in m_store, or in a mapped DB file.
+	typedef delta_queue_view base_list;
+
+	imageIdIndex_list() : m_base(m_store), m_seek(NULL), m_numSeek(0) { }
 #else
 	class container : public IdIndex_list {
 	public:
@@ -236,6 +357,8 @@ public:
 			size_t get_index() const { return (*this)->index; }
 		};
 	};
+
+	typedef container base_list;
 #endif
 
 	imageIdIndex_map<true> map_all(bool writable) { return writable ? imageIdIndex_map<true>(NULL, m_tail.begin(), m_tail.end(), 0) : imageIdIndex_map<true>(NULL, m_base.begin(), m_base.end(), 0); };
@@ -248,13 +371,59 @@ public:
 	void push_back(image_id_index i) { m_tail.push_back(i.index); }
 	void remove(image_id_index i); // unimplemented.
 
+	// Move the tail into the base list, leaving out the indices set in
+	// removed. Does nothing if the tail is empty and none are removed,
+	// unless copy is set. With renumber, also replaces each index i by
+	// renumber[i], which must keep them in the same order.
+	void compact(const std::vector<bool>& removed, const size_t* renumber = NULL, bool copy = false);
+
+	// Use the delta_queue words and seek positions from the query index
+	// of a DB file as base list. They must remain valid until destruction.
+	// With block queues, they are instead copied into blocks.
+	void set_base(const delta_queue_view& base, const delta_queue_view::position* seek, size_t num_seek);
+
+	// Use delta_queue words written elsewhere as base list, like above, and
+	// save its seek positions to seek, which needs room for
+	// seek_count(base.size()) of them.
+	void set_base(const delta_queue_view& base, delta_queue_view::position* seek);
+
+	// If the base list is in the memory from begin to end, move it and its
+	// seek positions to a copy of it offset bytes away.
+	void relocate(const delta_value* begin, const delta_value* end, ptrdiff_t offset);
+
+	// Whether the base list is in the memory from begin to end.
+	bool uses(const delta_value* begin, const delta_value* end) const;
+
+	// Iterator to the first entry of the mapped base list with an index of at
+	// least ind, so that index ranges of a bucket can be scanned separately.
+	imageIdIndex_map<true>::iterator seek(const imageIdIndex_map<true>& map, size_t ind) const;
+
 	const container& tail() { return m_tail; }
 
 	static int fd() { return -1; }
 
+	// Delta queues can only be iterated forwards, so remember the position
+	// every seek_interval entries to start seeking from.
+	static const size_t seek_interval = 512;
+
+	// Number of seek positions of a base list with size entries, and save them.
+	static size_t seek_count(size_t size) { return size > seek_interval ? (size + seek_interval - 1) / seek_interval : 0; }
+	static void find_seek(const delta_queue_view& base, delta_queue_view::position* seek);
+
 protected:
 	container m_tail;
-	container m_base;
+#ifdef USE_DELTA_QUEUE
+	container m_store;
+#endif
+	base_list m_base;
+
+#ifdef USE_DELTA_QUEUE
+	// The seek positions are in m_seekStore when the base list is in m_store.
+	typedef std::vector<delta_queue_view::position> seek_list;
+	const delta_queue_view::position* m_seek;
+	size_t m_numSeek;
+	seek_list m_seekStore;
+#endif
 };
 
 template<>
@@ -281,10 +450,23 @@ public:
 	void resize(size_t num);
 	void loaded(size_t num) { if (num > m_capacity) throw data_error("Loaded too many."); m_size = num; }
 	void set_base() { }
+	void set_base(const delta_queue_view& base, delta_queue_view::position* seek) { throw internal_error("Can't use delta_queue words in the disk cache."); }
+	void relocate(const delta_value* begin, const delta_value* end, ptrdiff_t offset) { }
+	bool uses(const delta_value* begin, const delta_value* end) const { return false; }
 	void push_back(image_id_index i) { m_tail.push_back(i); if (m_tail.size() >= threshold && can_page_out()) page_out(); }
 	void remove(image_id_index i);
 	void clear() { m_tail.clear(); m_size = 0; }
 
+	// Buckets in the disk cache are not compacted, the tail is paged out anyway.
+	void compact(const std::vector<bool>& removed, const size_t* renumber = NULL, bool copy = false) { }
+
+	// Only valid in simple mode, where the map holds indices in ascending order.
+	typename imageIdIndex_map<is_simple>::iterator seek(const imageIdIndex_map<is_simple>& map, size_t ind) const {
+		typename imageIdIndex_map<is_simple>::iterator itr = map.m_img;
+		itr.m_p = std::lower_bound(map.m_img.m_p, map.m_end.m_p, image_id_index(ind, true), index_less());
+		return itr;
+	}
+
 	const container& tail() { return m_tail; }
 
 	static int fd() { return m_fd; }
@@ -304,34 +486,69 @@ protected:
 	container m_tail;
 };
 
-class bloom_filter;
-
-/* in memory signature structure */
-class SigStruct : public image_info {
+// The base lists of all buckets back to back in one allocation, in the same
+// layout as the query index of a DB file: the delta_queue words of each
+// bucket, then the seek positions of each. Their offsets are in a table
+// indexed like a bucket_set, by [color][sign][coef]. With huge pages, a
+// query reading many buckets needs far fewer TLB entries.
+//
+// On a machine with several NUMA nodes it can have a copy on each, so that
+// queries read the lists from memory local to the thread scoring them.
+class bucket_arena {
 public:
-	size_t index;		/* index into score array for queries */
+	bucket_arena() : m_words(NULL), m_seek(NULL) { }
+	~bucket_arena() { release(); }
 
-	//int_hashset* keywords;
+	// Make room for count base lists of the sizes the counters counted,
+	// after releasing the previous ones.
+	void allocate(const delta_counter* counters, size_t count);
+	void release();
 
-	size_t cacheOfs;
+	delta_value* words(size_t bucket) const { return m_words + m_offsets[bucket].words; }
+	delta_queue_view::position* seek(size_t bucket) const { return m_seek + m_offsets[bucket].seek; }
 
-	SigStruct(size_t ofs) : cacheOfs(ofs) { };
+	size_t bytes() const { return m_map.m_base ? m_map.m_length : 0; }
+	size_t copies() const { return m_copies.size(); }
 
-	SigStruct() { };
+	// All of the arena, to tell which lists and iterators are in it.
+	const delta_value* begin() const { return (const delta_value*) m_map.m_base; }
+	const delta_value* end() const { return begin() + bytes() / sizeof(delta_value); }
 
-	~SigStruct()
-	{
-		//delete keywords;
-	}
+	// Copy the arena to each NUMA node, by a thread running there, and use
+	// the copy on the first one as the arena from now on. Returns its offset
+	// from the old arena, which is kept until release_old() so that the
+	// lists can first be moved with imageIdIndex_list::relocate(). Does
+	// nothing and returns 0 with only one node.
+	ptrdiff_t replicate();
+	void release_old();
 
-	void init(const ImgData* nsig) {
-		id = nsig->id;
-		height = nsig->height;
-		width = nsig->width;
-		avglf2i(nsig->avglf, avgl);
-	}
+	// Offset of the copy on the NUMA node the calling thread runs on, and
+	// move an iterator of a list in the arena to it.
+	ptrdiff_t local() const;
+	void localize(delta_iterator& itr, ptrdiff_t offset) const { itr.relocate(begin(), end(), offset); }
+
+private:
+	bucket_arena(const bucket_arena&);
+	bucket_arena& operator = (const bucket_arena&);
+
+	struct offsets {
+		size_t words;
+		size_t seek;
+	};
+
+	std::vector<offsets> m_offsets;
+	mapped_file m_map;
+	mapped_file m_old;
+	delta_value* m_words;
+	delta_queue_view::position* m_seek;
+
+	// Copies of the other nodes, and the offset of each node's copy.
+	std::vector<mapped_file> m_copies;
+	std::vector<ptrdiff_t> m_local;
 };
 
+class bloom_filter;
+
 /*
 class KwdFrequencyStruct {
 public:
@@ -352,73 +569,60 @@ public:
 template<bool is_simple>
 class dbSpaceImpl;
 
-inline Score get_aspect(int width, int height) { return 0; }
+template<bool is_simple>
+class sim_queue;
 
-template<bool is_simple> class sigMap;
+inline Score get_aspect(int width, int height) { return 0; }
 
-template<>
-class sigMap<false> : public imageIdMap<SigStruct*> {
-public:
-	void add_sig(imageId id, SigStruct* sig) { (*this)[id] = sig; }
-	void add_index(imageId id, size_t index) { throw usage_error("Only valid in read-only mode."); }
-};
+// The luminance and mask of each image from the image table, but each in an
+// array of its own, so that the first pass of a query can scan them quickly.
+struct lumin_table {
+	std::vector<Score> avgl[3];
+	std::vector<uint16_t> mask;
 
-template<>
-class sigMap<true> : public imageIdMap<size_t> {
-public:
-	void add_sig(imageId id, SigStruct* sig) { throw usage_error("Not valid in read-only mode."); }
-	void add_index(imageId id, size_t index) { (*this)[id] = index; }
+	void resize(size_t num) {
+		for (int c = 0; c < 3; c++) avgl[c].resize(num);
+		mask.resize(num);
+	}
+	void reserve(size_t num) {
+		for (int c = 0; c < 3; c++) avgl[c].reserve(num);
+		mask.reserve(num);
+	}
+	// Keep only the first num images, freeing the rest.
+	void truncate(size_t num) {
+		for (int c = 0; c < 3; c++) std::vector<Score>(avgl[c].begin(), avgl[c].begin() + num).swap(avgl[c]);
+		std::vector<uint16_t>(mask.begin(), mask.begin() + num).swap(mask);
+	}
+	void set(size_t ind, const image_info& info) {
+		for (int c = 0; c < 3; c++) avgl[c][ind] = info.avgl[c];
+		mask[ind] = info.mask;
+	}
 };
 
+// Iterate over the image table in index order. In simple mode, this is all
+// image data there is, otherwise the signatures are in the sig_store.
 template<bool is_simple>
-struct index_iterator;
-
-// In normal mode, we have image data in the sigMap, so iterate over that.
-template<>
-struct index_iterator<false> : public sigMap<false>::iterator {
-	typedef sigMap<false>::iterator base_type;
-	index_iterator(const base_type& itr, dbSpaceImpl<false>& db) : base_type(itr) { }
-
-	imageId id() const { return (*this)->first; }
-	SigStruct* sig() const { return (*this)->second; }
-	size_t index() const { return sig()->index; }
-	const lumin_int& avgl() const { return sig()->avgl; }
-	int width() const { return sig()->width; }
-	int height() const { return sig()->height; }
-	uint16_t set() const { return sig()->set; }
-	uint16_t mask() const { return sig()->mask; }
-	size_t cOfs() const { return sig()->cacheOfs; }
-	Score asp() const { return get_aspect(sig()->width, sig()->height); }
-};
-
-// In simple mode, we have only the image_info data available, so iterate over that.
-// In read-only mode, we additionally have the index into the image_info array in a sigMap.
-// Using functions that rely on this in simple mode will throw a usage_error.
-template<>
-struct index_iterator<true> : public image_info_list::iterator {
+struct index_iterator : public image_info_list::iterator {
 	typedef image_info_list::iterator base_type;
-	index_iterator(const base_type& itr, dbSpaceImpl<true>& db) : base_type(itr), m_db(db) { }
-	index_iterator(const sigMap<true>::iterator& itr, dbSpaceImpl<true>& db);	// implemented below
+	index_iterator(const base_type& itr, dbSpaceImpl<is_simple>& db) : base_type(itr), m_db(db) { }
 
 	imageId id() const { return (*this)->id; }
-	SigStruct* sig() const { throw usage_error("Not valid in read-only mode."); }
 	size_t index() const;	// implemented below
 	const lumin_int& avgl() const { return (*this)->avgl; }
 	int width() const { return (*this)->width; }
 	int height() const { return (*this)->height; }
 	uint16_t set() const { return (*this)->set; }
 	uint16_t mask() const { return (*this)->mask; }
-	size_t cOfs() const { return index() * sizeof(ImgData); }
-	Score asp() const { return 0; }
+	Score asp() const { return get_aspect((*this)->width, (*this)->height); }
 
-	dbSpaceImpl<true>& m_db;
+	dbSpaceImpl<is_simple>& m_db;
 };
 
 // Iterate over a bucket of imageIdIndex values.
 template<bool is_simple, typename B>
 struct id_index_iterator;
 
-// In normal mode, the imageIdIndex_map stores image IDs. Get the index from the dbSpace's linked SigStruct.
+// In normal mode, the imageIdIndex_map stores image IDs. Look up their index in the dbSpace's image_index_hash.
 template<>
 template<typename B>
 struct id_index_iterator<false,B> : public B {
@@ -501,12 +705,24 @@ public:
 	static const int mode_mask_readonly	= 0x01;
 	static const int mode_mask_simple	= 0x02;
 	static const int mode_mask_alter	= 0x04;
+	static const int mode_mask_shards	= 0xff00;	// Number of shards in simple or read-only mode.
+	static const int mode_shift_shards	= 8;
 
 protected:
 	virtual void getImgDataByID(imageId id, ImgData* img) = 0;
 	virtual void getImgAvgl(imageId id, lumin_int avgl) = 0;
 
+	// Scratch buffers for computing signatures, one for each thread.
+	struct sig_workspace;
+
 	static void sigFromImage(Image* image, imageId id, ImgData* sig);
+	static void sigFromChannels(sig_workspace& ws, ImgData* sig);
+#if LIB_GD
+	static void sigFromImageData(const unsigned char* data, size_t length, imageId id, ImgData* sig);
+#endif
+
+	// Collects the query index data of all images to save with the DB.
+	class index_writer;
 
 	template<typename B>
 	class bucket_set {
@@ -531,6 +747,16 @@ protected:
 		void add(const ImgData& img, count_t index);
 		void remove(const ImgData& img);
 
+		// Call f(bucket) for each bucket that add() adds the image to.
+		template<typename F>
+		void for_each(const ImgData& img, F& f);
+
+		// Which of several parts a bucket belongs to, to fill the parts in
+		// parallel. Each part has runs of part_run consecutive buckets, so
+		// that the parts don't share cache lines.
+		static const size_t part_run = 64;
+		static unsigned int part_of(size_t bucket, unsigned int parts) { return bucket / part_run % parts; }
+
 		iterator begin() { return buckets[0][0]; }
 		iterator end() { return buckets[count_0][0]; }
 
@@ -556,12 +782,14 @@ public:
 
 	// Image queries.
 	virtual sim_vector queryImg(const queryArg& query);
+	virtual sim_vector_list queryImgBatch(const queryArg_list& queries);
 
 	virtual void getImgQueryArg(imageId id, queryArg* query);
 
 	// Stats.
 	virtual size_t getImgCount();
 	virtual stats_t getCoeffStats();
+	virtual size_t getArenaSize();
 	virtual bool hasImage(imageId id);
 	virtual int getImageHeight(imageId id);
 	virtual int getImageWidth(imageId id);
@@ -575,6 +803,12 @@ public:
 	virtual void removeImage(imageId id);
 	virtual void rehash();
 
+	virtual size_t getDeltaCount();
+	virtual bool compact(size_t max_buckets);
+
+	virtual size_t getDeletedCount();
+	virtual void purge();
+
 private:
 #ifdef USE_DISK_CACHE
 	static const bool is_memory = false;
@@ -583,8 +817,6 @@ private:
 #endif
 
 	typedef index_iterator<is_simple> imageIterator;
-	typedef sigMap<is_simple> image_map;
-	typedef typename image_map::iterator map_iterator;
 
 	typedef id_index_iterator<is_simple, typename imageIdIndex_map<is_simple>::iterator> idIndexIterator;
 	typedef id_index_iterator<is_simple, typename imageIdIndex_list<is_simple, is_memory>::container::const_iterator> idIndexTailIterator;
@@ -592,6 +824,7 @@ private:
 	friend struct index_iterator<is_simple>;
 	friend struct id_index_iterator<is_simple, typename imageIdIndex_map<is_simple>::iterator>;
 	friend struct id_index_iterator<is_simple, typename imageIdIndex_list<is_simple, is_memory>::container::const_iterator>;
+	friend class dbSpaceSharded;
 
 	image_info_list& info() { return m_info; }
 	imageIterator find(imageId i);
@@ -599,31 +832,86 @@ private:
 	virtual void load(const char* filename);
 	virtual void load_stream_old(db_ifstream& f, uint version);
 
-	bool skip_image(const imageIterator& itr, const queryArg& query);
+	// Use the query index of the DB file if possible, instead of adding all signatures to the buckets.
+	// Only loads the images with first <= index < last.
+	bool load_index(const char* filename, offset_t indexOff, count_t numImg, count_t first, count_t last);
+
+	// Copy the bucket arena to each NUMA node if set, and move the buckets to the copies.
+	void replicate_buckets();
+
+	// Load only part number shard of the images in the DB file, as one of the given shards.
+	void set_shard(const std::vector<dbSpaceImpl*>* shards, unsigned int shard) { m_shards = shards; m_shard = shard; }
+
+	// Whether a query uses the bucket of this coefficient, i.e. it is not empty
+	// and not too common with flag_nocommon. Shards check the buckets of all
+	// shards, so that they all use the same coefficients for a query.
+	bool use_bucket(const queryArg& query, int c, int coef);
+
+	// Set the initial scores of images lo <= index < hi from their luminance,
+	// or to lumin_scan::skipped for images the query skips.
+	void score_luminance(const queryArg& query, int colors, size_t lo, size_t hi, Score* scores);
+	bool is_deleted(size_t ind) const { return ind < m_deleted.size() && m_deleted[ind]; }
+	void set_deleted(size_t ind);
+
+	// Fill in the image table entry at ind, which must exist already.
+	void set_info(size_t ind, const ImgData& sig);
 
 	imageIterator image_begin();
 	imageIterator image_end();
 
 	void addSigToBuckets(const ImgData* nsig);
 
-	void getImgDataByID(imageId id, ImgData* img) { *img = get_sig_from_cache(id); }
+	void getImgDataByID(imageId id, ImgData* img) { *img = get_sig(id); }
 	void getImgAvgl(imageId id, lumin_int avgl) { memcpy(avgl, find(id).avgl(), sizeof(avgl)); }
 
-	size_t get_sig_cache();
-	ImgData get_sig_from_cache(imageId i);
-	void write_sig_cache(size_t ofs, const ImgData* sig);
-	void read_sig_cache(size_t ofs, ImgData* sig);
+	ImgData get_sig(imageId i);
 
-	template<int num_colors>
-	sim_vector do_query(const queryArg q);
+	// Run a batch of queries, and return the results of each.
+	sim_vector_list do_query(const queryArg* queries, size_t num);
 
-	int m_sigFile;
-	size_t m_cacheOfs;
+	// Run a flag_rerank query. Finds the images sharing the most heavy coefficients
+	// with the query in some of its buckets, then scores only those from their
+	// signatures.
+	sim_vector query_candidates(const queryArg& query);
 
-	image_map m_images;
+	// A bucket of the query signatures, mapped for the duration of the query.
+	struct query_bucket;
+	struct query_bucket_list;
+	struct query_batch;
+	struct prune_stats;
 
-	size_t m_nextIndex;
+	// Sort the buckets of a batch with flag_prune queries and choose the checkpoints.
+	static void set_checkpoints(query_batch& batch);
+
+	// Score the images with index lo <= index < hi and add them to the results of each query.
+	void query_range(const query_batch& batch, size_t lo, size_t hi, std::vector<sim_queue<is_simple> >& results, prune_stats& stats);
+
+	class query_job;
+
+	// Fills the buckets in parallel while loading.
+	class load_job;
+
+	// Whether to keep the signatures, i.e. not in simple mode.
+	bool m_withSigs;
+	sig_store m_sigs;
+
+	// The image table, in index order, and the index of each image ID.
 	image_info_list m_info;
+	lumin_table m_lumin;
+	image_index_hash m_images;
+	size_t m_nextIndex;
+
+	// The DB file, when its query index is used for the buckets.
+	mapped_file m_indexMap;
+
+	// The base lists of the buckets, when they were written in place while
+	// loading. Buckets move out of it when they are compacted, and it is
+	// released once none are left in it.
+	bucket_arena m_arena;
+
+	// All shards of a dbSpaceSharded and the number of this one, or NULL.
+	const std::vector<dbSpaceImpl*>* m_shards;
+	unsigned int m_shard;
 
 	/* Lists of picture ids, indexed by [color-channel][sign][position], i.e.,
 	   R=0/G=1/B=2, pos=0/neg=1, (i*NUM_PIXELS+j)
@@ -637,6 +925,23 @@ private:
 	typedef bucket_set<bucket_type> buckets_t;
 	buckets_t imgbuckets;
 	bool m_bucketsValid;
+
+	// The delta segment in read-only and simple mode: images added or removed
+	// since the buckets were last compacted. Added images are in the tails of
+	// the buckets, removed ones still in the buckets until the next compaction.
+	size_t m_deltaCount;
+	size_t m_removedCount;
+
+	// Removed images by index, until they are purged. Only as large as the
+	// highest removed index.
+	std::vector<bool> m_deleted;
+	size_t m_deletedCount;
+
+	// Compaction in progress: next bucket, and how many images of
+	// m_deltaCount and m_removedCount it covers.
+	size_t m_compactNext;
+	size_t m_compactDelta;
+	size_t m_compactRemoved;
 };
 
 // Directly modify DB file on disk.
@@ -649,11 +954,13 @@ public:
 
 	// Image queries not supported.
 	virtual sim_vector queryImg(const queryArg& query) { throw usage_error("Not supported in alter mode."); }
+	virtual sim_vector_list queryImgBatch(const queryArg_list& queries) { throw usage_error("Not supported in alter mode."); }
 	virtual void getImgQueryArg(imageId id, queryArg* query) { throw usage_error("Not supported in alter mode."); }
 
 	// Stats. Partially unsupported.
 	virtual size_t getImgCount();
 	virtual stats_t getCoeffStats() { throw usage_error("Not supported in alter mode."); }
+	virtual size_t getArenaSize() { return 0; }
 	virtual bool hasImage(imageId id);
 	virtual int getImageHeight(imageId id);
 	virtual int getImageWidth(imageId id);
@@ -667,6 +974,14 @@ public:
 	virtual void removeImage(imageId id);
 	virtual void rehash();
 
+	// The DB file is modified directly, there is nothing to compact.
+	virtual size_t getDeltaCount() { return 0; }
+	virtual bool compact(size_t max_buckets) { return true; }
+
+	// Removed images are dropped from the file when saving.
+	virtual size_t getDeletedCount() { return 0; }
+	virtual void purge() { }
+
 protected:
 	typedef imageIdMap<size_t> ImageMap;
 
@@ -682,6 +997,7 @@ private:
 
 	void resize_header();
 	void move_deleted();
+	void copy_file();
 
 	struct bucket_type {
 		void add(image_id_index id, count_t index) { size++; }
@@ -695,14 +1011,81 @@ private:
 	ImageMap m_images;
 	db_fstream* m_f;
 	std::string m_fname;
-	offset_t m_hdrOff, m_sigOff, m_imgOff;
+	offset_t m_hdrOff, m_sigOff, m_imgOff, m_idxOff;
+	uint m_version;
 	typedef bucket_set<bucket_type> buckets_t;
 	buckets_t m_buckets;
 	DeletedList m_deleted;
 	bool m_rewriteIDs;
+	bool m_copied;
 	bool m_readonly;
 };
 
+// Simple or read-only mode DB split into shards of consecutive images, which
+// are loaded and queried in parallel. Query results are merged as if from a
+// single DB, new images are added to the last shard.
+class dbSpaceSharded : public dbSpaceCommon {
+public:
+	dbSpaceSharded(bool readonly, unsigned int shards);
+	virtual ~dbSpaceSharded();
+
+	virtual void save_file(const char* filename) { throw usage_error("Can't save sharded db."); }
+
+	// Image queries.
+	virtual sim_vector queryImg(const queryArg& query);
+	virtual sim_vector_list queryImgBatch(const queryArg_list& queries);
+
+	virtual void getImgQueryArg(imageId id, queryArg* query);
+
+	// Stats.
+	virtual size_t getImgCount();
+	virtual stats_t getCoeffStats();
+	virtual size_t getArenaSize();
+	virtual bool hasImage(imageId id);
+	virtual int getImageHeight(imageId id);
+	virtual int getImageWidth(imageId id);
+	virtual imageId_list getImgIdList();
+	virtual image_info_list getImgInfoList();
+
+	// DB maintenance.
+	virtual void addImageData(const ImgData* img);
+	virtual void setImageRes(imageId id, int width, int height);
+
+	virtual void removeImage(imageId id);
+	virtual void rehash();
+
+	virtual size_t getDeltaCount();
+	virtual bool compact(size_t max_buckets);
+
+	virtual size_t getDeletedCount();
+	virtual void purge();
+
+protected:
+	void getImgDataByID(imageId id, ImgData* img);
+	void getImgAvgl(imageId id, lumin_int avgl);
+
+	virtual void load(const char* filename);
+
+private:
+	void operator = (const dbSpaceSharded&);
+
+	typedef dbSpaceImpl<true> shard_type;
+	typedef std::vector<shard_type*> shard_list;
+
+	// The shard with the image, or end() if there is none.
+	shard_list::iterator find(imageId id);
+	shard_type& shard(imageId id);
+
+	// Merge the results of all shards for one query.
+	sim_vector merge(const queryArg& query, const std::vector<sim_vector_list>& results, size_t ind);
+
+	class load_job;
+	class query_job;
+
+	shard_list m_shards;
+	worker_pool* m_pool;
+};
+
 /* signature structure */
 static const unsigned int AVG_IMGS_PER_DBSPACE = 20000;
 
@@ -712,6 +1095,7 @@ static const unsigned int	SRZ_V0_6_0			= 2;
 static const unsigned int	SRZ_V0_6_1			= 3;
 static const unsigned int	SRZ_V0_7_0			= 8;
 static const unsigned int	SRZ_V0_9_0			= 9;
+static const unsigned int	SRZ_V0_10_0			= 10;
 
 // Variable size and endianness check
 static const uint32_t		SRZ_V_SZ			= (sizeof(res_t)) |
@@ -720,7 +1104,28 @@ static const uint32_t		SRZ_V_SZ			= (sizeof(res_t)) |
 								  (sizeof(imageId) << 15) |
 								  (3 << 20);	// never matches any of the above for endian check
 
-static const uint32_t		SRZ_V_CODE			= (SRZ_V0_9_0) | (SRZ_V_SZ << 8);
+static const uint32_t		SRZ_V_CODE			= (SRZ_V0_10_0) | (SRZ_V_SZ << 8);
+
+// Query index of a version 10 DB file, see imgdb.h.
+struct db_index_header {
+	count_t images;		// Same as in the DB header, else the index is out of date.
+	count_t word_size;	// Size of the delta_queue words and seek positions.
+
+	// Offsets of each part relative to the start of the index.
+	offset_t info;
+	offset_t buckets;
+	offset_t words;
+	offset_t seek;
+	offset_t length;
+};
+
+struct db_index_bucket {
+	count_t size;		// Number of images in the bucket.
+	offset_t words;		// First word and number of words of its delta_queue.
+	count_t num_words;
+	offset_t seek;		// First and number of seek positions.
+	count_t num_seek;
+};
 
 /* keyword postings structure */
 static const unsigned int	 AVG_IMGS_PER_KWD	= 1000;
@@ -765,10 +1170,8 @@ bloom_filter* getIdsBloomFilter(const int dbId);
 // keywordStruct* getKwdPostings(int hash);
 
 // Delayed implementations.
-inline index_iterator<true>::index_iterator(const sigMap<true>::iterator& itr, dbSpaceImpl<true>& db)
-  : base_type(db.info().begin() + itr->second), m_db(db) { }
-inline size_t index_iterator<true>::index() const { return *this - m_db.info().begin(); }
-template<typename B> inline size_t id_index_iterator<false, B>::index() const { return m_db.find((*this)->id).index(); }
+template<bool is_simple> inline size_t index_iterator<is_simple>::index() const { return *this - m_db.info().begin(); }
+template<typename B> inline size_t id_index_iterator<false, B>::index() const { return m_db.m_images.find((*this)->id); }
 
 } // namespace
 
@@ -31,7 +31,9 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
+#include <time.h>
 
 #ifdef MEMCHECK
 #include <malloc.h>
@@ -39,6 +41,7 @@
 #endif
 
 #include <algorithm>
+#include <deque>
 #include <list>
 #include <vector>
 
@@ -46,6 +49,7 @@
 #define DEBUG_IQDB
 #include "debug.h"
 #include "imgdb.h"
+#include "worker_pool.h"
 
 int debug_level = DEBUG_errors | DEBUG_base | DEBUG_summary | DEBUG_connections | DEBUG_images | DEBUG_imgdb; // | DEBUG_dupe_finder; // | DEBUG_resizer;
 
@@ -69,6 +73,7 @@ public:
 
 	void save() { (*this)->save_file(m_filename.c_str()); }
 	void load(const char* filename, int mode) { this->set(loaddb(filename, mode)); m_filename = filename; }
+	void take(dbSpaceAuto& other) { this->set(other.detach()); m_filename = other.m_filename; }
 	void clear() { this->set(NULL); }
 
 	const std::string& filename() const { return m_filename; }
@@ -83,6 +88,45 @@ private:
 	std::string m_filename;
 };
 
+// Lets any number of threads use the DBs at the same time, but gives
+// exclusive access to a thread that modifies them.
+class db_lock {
+public:
+	db_lock() {
+		pthread_rwlockattr_t attr;
+		pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+		// Otherwise a steady stream of queries could hold off maintenance commands forever.
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+		if (int err = pthread_rwlock_init(&m_lock, &attr)) die("Can't create DB lock: %s\n", strerror(err));
+		pthread_rwlockattr_destroy(&attr);
+	}
+	~db_lock() { pthread_rwlock_destroy(&m_lock); }
+
+	// Hold the lock for reading or writing while in scope.
+	class reader {
+	public:
+		reader(db_lock& lock) : m_lock(lock.m_lock) { pthread_rwlock_rdlock(&m_lock); }
+		~reader() { pthread_rwlock_unlock(&m_lock); }
+	private:
+		pthread_rwlock_t& m_lock;
+	};
+	class writer {
+	public:
+		writer(db_lock& lock) : m_lock(lock.m_lock) { pthread_rwlock_wrlock(&m_lock); }
+		~writer() { pthread_rwlock_unlock(&m_lock); }
+	private:
+		pthread_rwlock_t& m_lock;
+	};
+
+private:
+	db_lock(const db_lock&);
+	db_lock& operator = (const db_lock&);
+
+	pthread_rwlock_t m_lock;
+};
+
 class dbSpaceAutoMap {
 	typedef std::list<dbSpaceAuto> list_type;
 	typedef std::vector<dbSpaceAuto*> array_type;
@@ -105,9 +149,13 @@ public:
 
 	size_t size() const { return m_array.size(); }
 
+	// Must be held while using the DBs or the map.
+	db_lock& lock() { return m_lock; }
+
 private:
 	array_type m_array;
 	list_type  m_list;
+	db_lock    m_lock;
 };
 
 #define ScD(x) ((double)(x)/imgdb::ScoreMax)
@@ -378,31 +426,95 @@ fprintf(stderr, "Min score: %.1f\n", ScD(m));
 	if (!dupes.empty()) throw imgdb::internal_error("Orphaned dupe!");
 }
 
-void add(const char* fn) {
+// Images are read in batches, and their signatures computed by the worker
+// threads, each taking every n-th image of the batch. Only the main thread
+// touches the DB, adding the images and reporting errors in input order.
+struct add_entry {
+	add_entry() : width(-1), height(-1), invalid(false), skip(false) { }
+
+	imgdb::imageId id;
+	int width, height;
+	std::string filename;	// or the whole line if invalid, empty on read errors
+	bool invalid;
+	bool skip;		// already in the DB, only set the resolution
+	std::string error;	// set if the signature could not be computed
+	imgdb::ImgData sig;
+};
+typedef std::vector<add_entry> add_list;
+
+class add_job : public worker_pool::job {
+public:
+	add_job(add_list& entries, unsigned int parts) : m_entries(entries), m_parts(parts) { }
+
+	virtual void run(unsigned int part) {
+		for (size_t i = part; i < m_entries.size(); i += m_parts) {
+			add_entry& e = m_entries[i];
+			if (e.invalid || e.skip) continue;
+			try {
+				imgdb::dbSpace::imgDataFromFile(e.filename.c_str(), e.id, &e.sig);
+			} catch (const imgdb::simple_error& err) {
+				e.error = std::string(err.type()) + " " + err.what();
+			}
+		}
+	}
+
+private:
+	add_list& m_entries;
+	unsigned int m_parts;
+};
+
+void add(const char* fn, unsigned int threads) {
 	dbSpaceAuto db(fn, imgdb::dbSpace::mode_alter);
+	worker_pool pool(threads - 1);
+	size_t batch_size = threads > 1 ? threads * 32 : 1;
+
+	add_list batch;
+	batch.reserve(batch_size);
 	while (!feof(stdin)) {
-		char fn[1024];
-		char line[1024];
-		imgdb::imageId id;
-		int width = -1, height = -1;
-		if (!fgets(line, sizeof(line), stdin)) {
-			DEBUG(errors)("Read error.\n");
-			continue;
-		}
-		if (sscanf(line, "%"FMT_imageId" %d %d:%1023[^\r\n]\n", &id, &width, &height, fn) != 4  &&
-		    sscanf(line, "%"FMT_imageId":%1023[^\r\n]\n", &id, fn) != 2) {
-			DEBUG(errors)("Invalid line %s\n", line);
-			continue;
+		batch.clear();
+		while (batch.size() < batch_size && !feof(stdin)) {
+			char fn[1024];
+			char line[1024];
+			add_entry e;
+			if (!fgets(line, sizeof(line), stdin)) {
+				e.invalid = true;
+			} else if (sscanf(line, "%"FMT_imageId" %d %d:%1023[^\r\n]\n", &e.id, &e.width, &e.height, fn) != 4  &&
+			    sscanf(line, "%"FMT_imageId":%1023[^\r\n]\n", &e.id, fn) != 2) {
+				e.invalid = true;
+				e.filename = line;
+			} else {
+				e.filename = fn;
+				e.skip = db->hasImage(e.id);
+			}
+			batch.push_back(e);
 		}
-		try {
-			if (!db->hasImage(id)) {
-				DEBUG(images)("Adding %s = %08"FMT_imageId"...\r", fn, id);
-				db->addImage(id, fn);
+
+		unsigned int parts = std::min<size_t>(pool.size(), batch.size());
+		add_job job(batch, parts);
+		pool.run(job, parts);
+
+		for (add_list::iterator itr = batch.begin(); itr != batch.end(); ++itr) try {
+			if (itr->invalid) {
+				if (itr->filename.empty()) {
+					DEBUG(errors)("Read error.\n");
+				} else {
+					DEBUG(errors)("Invalid line %s\n", itr->filename.c_str());
+				}
+				continue;
 			}
-			if (width != -1 && height != -1)
-				db->setImageRes(id, width, height);
+			// Skip images that were listed twice in the same batch.
+			if (!itr->skip && !db->hasImage(itr->id)) {
+				DEBUG(images)("Adding %s = %08"FMT_imageId"...\r", itr->filename.c_str(), itr->id);
+				if (!itr->error.empty()) {
+					DEBUG(errors)("%s: %s\n", itr->filename.c_str(), itr->error.c_str());
+					continue;
+				}
+				db->addImageData(&itr->sig);
+			}
+			if (itr->width != -1 && itr->height != -1)
+				db->setImageRes(itr->id, itr->width, itr->height);
 		} catch (const imgdb::simple_error& err) {
-                	DEBUG(errors)("%s: %s %s\n", fn, err.type(), err.what());
+                	DEBUG(errors)("%s: %s %s\n", itr->filename.c_str(), err.type(), err.what());
 		}
 	}
 	db.save();
@@ -476,6 +588,25 @@ std::pair<char*, size_t> read_blob(const char* size_arg, FILE* rd) {
 	return std::make_pair(blob, blob_size);
 }
 
+// Buckets to compact while holding the DB lock, and how often the server
+// checks in the background whether a DB needs compacting.
+static const size_t compact_buckets = 1024;
+static const int compact_interval = 10;	// seconds
+
+// Most queries a batch_query command may run at once.
+static const int max_batch_queries = 1000;
+
+// Compact a DB a few buckets at a time, so that other connections can use
+// it in between. Stops if the DB is dropped meanwhile.
+void compact_db(dbSpaceAutoMap& dbs, unsigned int dbid) {
+	bool done = false;
+	while (!done) {
+		db_lock::writer lock(dbs.lock());
+		if (dbid >= dbs.size() || !dbs[dbid]) return;
+		done = dbs[dbid]->compact(compact_buckets);
+	}
+}
+
 void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 	struct customOpt : public imgdb::queryOpt {
 		customOpt() : mindev(0) {}
@@ -533,13 +664,22 @@ void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 		} else if (!strcmp(command, "list")) {
 			int dbid;
 			if (sscanf(arg, "%i\n", &dbid) != 1) throw imgdb::param_error("Format: list <dbid>");
-			imgdb::imageId_list list = DB->getImgIdList();
+			imgdb::imageId_list list;
+			{
+				db_lock::reader lock(dbs.lock());
+				list = DB->getImgIdList();
+			}
 			for (size_t i = 0; i < list.size(); i++) fprintf(wr, "100 %08"FMT_imageId"\n", list[i]);
 
 		} else if (!strcmp(command, "count")) {
 			int dbid;
 			if (sscanf(arg, "%i\n", &dbid) != 1) throw imgdb::param_error("Format: count <dbid>");
-			fprintf(wr, "101 count=%zd\n", DB->getImgCount());
+			size_t count;
+			{
+				db_lock::reader lock(dbs.lock());
+				count = DB->getImgCount();
+			}
+			fprintf(wr, "101 count=%zd\n", count);
 
 		} else if (!strcmp(command, "query_opt")) {
 			char *opt_arg = strchr(arg, ' ');
@@ -563,8 +703,14 @@ void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 				throw imgdb::param_error("Format: query <dbid> <flags> <numres> <filename>");
 
 			std::pair<char*, size_t> blob_info = filename[0] == ':' ? read_blob(filename + 1, rd) : std::make_pair<char*, size_t>(NULL, 0);
-			imgdb::sim_vector sim = DB->queryImg(blob_info.first ? imgdb::queryArg(blob_info.first, blob_info.second, numres, flags) : imgdb::queryArg(filename, numres, flags).coalesce(queryOpt));
+			imgdb::queryArg query = blob_info.first ? imgdb::queryArg(blob_info.first, blob_info.second, numres, flags) : imgdb::queryArg(filename, numres, flags).coalesce(queryOpt);
 			delete[] blob_info.first;
+
+			imgdb::sim_vector sim;
+			{
+				db_lock::reader lock(dbs.lock());
+				sim = DB->queryImg(query);
+			}
 			if (queryOpt.mindev > 0)
 				stddev_limit(sim, queryOpt.mindev);
 			fprintf(wr, "101 matches=%zd\n", sim.size());
@@ -573,6 +719,51 @@ void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 
 			queryOpt.reset();
 
+		} else if (!strcmp(command, "batch_query")) {
+			int dbid, flags, numres, count;
+			if (sscanf(arg, "%i %i %i %i\n", &dbid, &flags, &numres, &count) != 4 || count < 1)
+				throw imgdb::param_error("Format: batch_query <dbid> <flags> <numres> <count>, followed by <count> lines of <filename> or <:size>");
+			if (count > max_batch_queries)
+				throw imgdb::param_error("Too many queries in batch.");
+
+			// Read all filenames and image data first, so that an unreadable image doesn't
+			// leave the rest of them to be taken as commands.
+			std::vector<std::string> filenames(count), blobs(count);
+			for (int i = 0; i < count; i++) {
+				char filename[1024];
+				if (!fgets(filename, sizeof(filename), rd))
+					throw imgdb::param_error("Error reading batch query filename");
+				char* eol = strpbrk(filename, "\r\n"); if (eol) *eol = 0;
+				filenames[i] = filename;
+
+				if (filename[0] != ':') continue;
+				std::pair<char*, size_t> blob_info = read_blob(filename + 1, rd);
+				blobs[i].assign(blob_info.first, blob_info.second);
+				delete[] blob_info.first;
+			}
+
+			imgdb::queryArg_list queries;
+			queries.reserve(count);
+			for (int i = 0; i < count; i++) {
+				queries.push_back(filenames[i].c_str()[0] == ':' ? imgdb::queryArg(blobs[i].data(), blobs[i].size(), numres, flags) : imgdb::queryArg(filenames[i].c_str(), numres, flags));
+				queries.back().merge(queryOpt);
+			}
+
+			imgdb::sim_vector_list sims;
+			{
+				db_lock::reader lock(dbs.lock());
+				sims = DB->queryImgBatch(queries);
+			}
+			for (imgdb::sim_vector_list::iterator sim = sims.begin(); sim != sims.end(); ++sim) {
+				if (queryOpt.mindev > 0)
+					stddev_limit(*sim, queryOpt.mindev);
+				fprintf(wr, "101 matches=%zd\n", sim->size());
+				for (size_t i = 0; i < sim->size(); i++)
+					fprintf(wr, "200 %08"FMT_imageId" %lf %d %d\n", (*sim)[i].id, (double)(*sim)[i].score / imgdb::ScoreMax, (*sim)[i].width, (*sim)[i].height);
+			}
+
+			queryOpt.reset();
+
 		} else if (!strcmp(command, "multi_query")) {
 			int count;
 			typedef std::vector<query_t> query_list;
@@ -601,7 +792,11 @@ void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 			std::vector<sim_db_value> sim;
 			imgdb::Score merge_min = 100 * imgdb::ScoreMax;
 			for (query_list::iterator itr = queries.begin(); itr != queries.end(); ++itr) {
-				imgdb::sim_vector dbsim = dbs.at(itr->dbid)->queryImg(imgdb::queryArg(img, itr->numres + 1, itr->flags).merge(multiOpt));
+				imgdb::sim_vector dbsim;
+				{
+					db_lock::reader lock(dbs.lock());
+					dbsim = dbs.at(itr->dbid)->queryImg(imgdb::queryArg(img, itr->numres + 1, itr->flags).merge(multiOpt));
+				}
 				if (dbsim.empty()) continue;
 
 				// Scale it so that DBs with different noise levels are all normalized:
@@ -643,7 +838,11 @@ void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 			if (sscanf(arg, "%i %i %i %"FMT_imageId"\n", &dbid, &flags, &numres, &id) != 4)
 				throw imgdb::param_error("Format: sim <dbid> <flags> <numres> <imageId>");
 
-			imgdb::sim_vector sim = DB->queryImg(imgdb::queryArg(DB, id, numres, flags).coalesce(queryOpt));
+			imgdb::sim_vector sim;
+			{
+				db_lock::reader lock(dbs.lock());
+				sim = DB->queryImg(imgdb::queryArg(DB, id, numres, flags).coalesce(queryOpt));
+			}
 			if (queryOpt.mindev > 0)
 				stddev_limit(sim, queryOpt.mindev);
 			fprintf(wr, "101 matches=%zd\n", sim.size());
@@ -662,11 +861,23 @@ void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 				throw imgdb::param_error("Format: add <dbid> <imgid>[ <width> <height>]:<filename>");
 
 			// Could just catch imgdb::param_error, but this is so common here that handling it explicitly is better.
-			if (!DB->hasImage(id)) {
+			bool exists;
+			{
+				db_lock::reader lock(dbs.lock());
+				exists = DB->hasImage(id);
+			}
+
+			// Don't hold up other threads while reading the image.
+			imgdb::ImgData img;
+			if (!exists) {
 				fprintf(wr, "100 Adding %s = %d:%08"FMT_imageId"...\n", fn, dbid, id);
-				DB->addImage(id, fn);
+				imgdb::dbSpace::imgDataFromFile(fn, id, &img);
 			}
 
+			db_lock::writer lock(dbs.lock());
+			if (!exists && !DB->hasImage(id))
+				DB->addImageData(&img);
+
 			if (width > 0 && height > 0)
 				DB->setImageRes(id, width, height);
 
@@ -677,6 +888,7 @@ void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 				throw imgdb::param_error("Format: remove <dbid> <imgid>");
 
 			fprintf(wr, "100 Removing %d:%08"FMT_imageId"...\n", dbid, id);
+			db_lock::writer lock(dbs.lock());
 			DB->removeImage(id);
 
 		} else if (!strcmp(command, "set_res")) {
@@ -686,12 +898,17 @@ void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 				throw imgdb::param_error("Format: set_res <dbid> <imgid> <width> <height>");
 
 			fprintf(wr, "100 Setting %d:%08"FMT_imageId" = %d:%d...\r", dbid, id, width, height);
+			db_lock::writer lock(dbs.lock());
 			DB->setImageRes(id, width, height);
 
 		} else if (!strcmp(command, "list_info")) {
 			int dbid;
 			if (sscanf(arg, "%i\n", &dbid) != 1) throw imgdb::param_error("Format: list_info <dbid>");
-			imgdb::image_info_list list = DB->getImgInfoList();
+			imgdb::image_info_list list;
+			{
+				db_lock::reader lock(dbs.lock());
+				list = DB->getImgInfoList();
+			}
 			for (imgdb::image_info_list::iterator itr = list.begin(); itr != list.end(); ++itr)
 				fprintf(wr, "100 %08"FMT_imageId" %d %d\n", itr->id, itr->width, itr->height);
 
@@ -702,15 +919,62 @@ void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 				throw imgdb::param_error("Format: rehash <dbid>");
 
 			fprintf(wr, "100 Rehashing %d...\n", dbid);
+			db_lock::writer lock(dbs.lock());
 			DB->rehash();
 
+		} else if (!strcmp(command, "compact")) {
+			if (!allow_maint) throw imgdb::usage_error("Not authorized");
+			int dbid;
+			if (sscanf(arg, "%d", &dbid) != 1)
+				throw imgdb::param_error("Format: compact <dbid>");
+
+			size_t delta;
+			{
+				db_lock::reader lock(dbs.lock());
+				delta = DB->getDeltaCount();
+			}
+			fprintf(wr, "100 Compacting %d, %zd images added or removed...\n", dbid, delta);
+			compact_db(dbs, dbid);
+
+		} else if (!strcmp(command, "purge")) {
+			if (!allow_maint) throw imgdb::usage_error("Not authorized");
+			int dbid;
+			if (sscanf(arg, "%d", &dbid) != 1)
+				throw imgdb::param_error("Format: purge <dbid>");
+
+			db_lock::writer lock(dbs.lock());
+			fprintf(wr, "100 Purging %zd deleted images from %d...\n", DB->getDeletedCount(), dbid);
+			DB->purge();
+
+		} else if (!strcmp(command, "db_stats")) {
+			int dbid;
+			if (sscanf(arg, "%d", &dbid) != 1)
+				throw imgdb::param_error("Format: db_stats <dbid>");
+
+			size_t count, deleted, delta, arena;
+			{
+				db_lock::reader lock(dbs.lock());
+				count = DB->getImgCount();
+				deleted = DB->getDeletedCount();
+				delta = DB->getDeltaCount();
+				arena = DB->getArenaSize();
+			}
+			fprintf(wr, "101 count=%zd\n", count);
+			fprintf(wr, "101 deleted=%zd\n", deleted);
+			fprintf(wr, "101 delta=%zd\n", delta);
+			fprintf(wr, "101 arena=%zd\n", arena);
+
 		} else if (!strcmp(command, "coeff_stats")) {
 			int dbid;
 			if (sscanf(arg, "%d", &dbid) != 1)
 				throw imgdb::param_error("Format: coeff_stats <dbid>");
 
 			fprintf(wr, "100 Retrieving coefficient stats for %d...\n", dbid);
-			imgdb::stats_t stats = DB->getCoeffStats();
+			imgdb::stats_t stats;
+			{
+				db_lock::reader lock(dbs.lock());
+				stats = DB->getCoeffStats();
+			}
 			for (imgdb::stats_t::iterator itr = stats.begin(); itr != stats.end(); ++itr)
 				fprintf(wr, "100 %d %zd\n", itr->first, itr->second);
 
@@ -722,6 +986,7 @@ void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 				throw imgdb::param_error("Format: saveas <dbid> <file>");
 
 			fprintf(wr, "100 Saving DB %d to %s...\n", dbid, fn);
+			db_lock::writer lock(dbs.lock());
 			DB.save();
 
 		} else if (!strcmp(command, "load")) {
@@ -730,11 +995,20 @@ void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 			int dbid;
 			if (sscanf(arg, "%d %31[^\r\n ] %1023[^\r\n]\n", &dbid, mode, fn) != 3)
 				throw imgdb::param_error("Format: load <dbid> <mode> <file>");
-			if ((size_t)dbid < dbs.size() && dbs[dbid])
-				throw imgdb::param_error("Format: dbid already in use.");
+			{
+				db_lock::reader lock(dbs.lock());
+				if ((size_t)dbid < dbs.size() && dbs[dbid])
+					throw imgdb::param_error("Format: dbid already in use.");
+			}
 
 			fprintf(wr, "100 Loading DB %d from %s...\n", dbid, fn);
-			dbs.at(dbid, true).load(fn, imgdb::dbSpace::mode_from_name(mode));
+
+			// Load it without blocking the other DBs, then add it.
+			dbSpaceAuto db(fn, imgdb::dbSpace::mode_from_name(mode));
+			db_lock::writer lock(dbs.lock());
+			if ((size_t)dbid < dbs.size() && dbs[dbid])
+				throw imgdb::param_error("Format: dbid already in use.");
+			dbs.at(dbid, true).take(db);
 
 		} else if (!strcmp(command, "drop")) {
 			if (!allow_maint) throw imgdb::usage_error("Not authorized");
@@ -742,10 +1016,14 @@ void do_commands(FILE* rd, FILE* wr, dbSpaceAutoMap& dbs, bool allow_maint) {
 			if (sscanf(arg, "%d", &dbid) != 1)
 				throw imgdb::param_error("Format: drop <dbid>");
 
-			DB.clear();
+			{
+				db_lock::writer lock(dbs.lock());
+				DB.clear();
+			}
 			fprintf(wr, "100 Dropped DB %d.\n", dbid);
 
 		} else if (!strcmp(command, "db_list")) {
+			db_lock::reader lock(dbs.lock());
 			for (size_t i = 0; i < dbs.size(); i++) if (dbs[i]) fprintf(wr, "102 %zd %s\n", i, dbs[i].filename().c_str());
 
 		} else if (!strcmp(command, "ping")) {
@@ -796,11 +1074,17 @@ void command(int numfiles, char** files) {
 }
 
 // Attach rd/wr FILE to fd and automatically close when going out of scope.
+// Each stream has its own descriptor, so that none is closed twice. With
+// several connection threads, the second close could otherwise close a
+// descriptor that was just reused for another connection.
 struct socket_stream {
 	socket_stream(int sock) :
 	  	socket(sock),
 		rd(fdopen(sock, "r")),
-		wr(fdopen(sock, "w")) {
+		wr(NULL) {
+
+		int wr_sock = rd ? dup(sock) : -1;
+		if (wr_sock != -1 && !(wr = fdopen(wr_sock, "w"))) ::close(wr_sock);
 
 	  	if (sock == -1 || !rd || !wr) {
 			close();
@@ -810,11 +1094,11 @@ struct socket_stream {
 	~socket_stream() { close(); }
 	void close() {
 		if (rd) fclose(rd);
+		else if (socket != -1) ::close(socket);
 		rd=NULL;
+		socket=-1;
 		if (wr) fclose(wr);
 		wr=NULL;
-		if (socket != -1) ::close(socket);
-		socket=-1;
 	}
 
 	int socket;
@@ -854,6 +1138,267 @@ void rebind(int fd, struct sockaddr_in& bindaddr) {
 	DEBUG(base)("Listening on port %d.\n", ntohs(bindaddr.sin_port));
 }
 
+struct connection {
+	int fd;
+	struct sockaddr_in client;
+	bool is_high;
+};
+
+// Handles accepted connections in a fixed number of threads. Pending high
+// priority connections are always handled before normal ones.
+class connection_pool {
+public:
+	connection_pool(unsigned int threads, dbSpaceAutoMap& dbs);
+	~connection_pool();
+
+	void add(const connection& conn);
+
+	// Becomes readable when a client sent the quit command.
+	int quit_fd() const { return m_quit_pipe[0]; }
+
+	// Rethrow a fatal error that ended a connection, if any.
+	void check_error();
+
+private:
+	connection_pool(const connection_pool&);
+	connection_pool& operator = (const connection_pool&);
+
+	typedef std::deque<connection> connection_queue;
+
+	static void* thread_main(void* pool);
+	void work();
+	void handle(const connection& conn);
+	void quit();
+	void fatal(const imgdb::base_error& err);
+
+	dbSpaceAutoMap& m_dbs;
+	std::vector<pthread_t> m_threads;
+	connection_queue m_queue[2];	// high and normal priority
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_ready;
+	bool m_quit;
+	int m_quit_pipe[2];
+
+	std::string m_error;
+	bool m_data_error;
+};
+
+connection_pool::connection_pool(unsigned int threads, dbSpaceAutoMap& dbs) : m_dbs(dbs), m_quit(false), m_data_error(false) {
+	if (pipe(m_quit_pipe)) die("Can't create pipe: %s\n", strerror(errno));
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_ready, NULL);
+
+	m_threads.reserve(threads);
+	while (threads--) {
+		pthread_t thread;
+		if (int err = pthread_create(&thread, NULL, &thread_main, this))
+			die("Can't create connection thread: %s\n", strerror(err));
+		m_threads.push_back(thread);
+	}
+}
+
+// Finish connections in progress and drop pending ones.
+connection_pool::~connection_pool() {
+	pthread_mutex_lock(&m_lock);
+	m_quit = true;
+	pthread_cond_broadcast(&m_ready);
+	pthread_mutex_unlock(&m_lock);
+
+	for (std::vector<pthread_t>::iterator itr = m_threads.begin(); itr != m_threads.end(); ++itr)
+		pthread_join(*itr, NULL);
+
+	for (int i = 0; i < 2; i++)
+		for (connection_queue::iterator itr = m_queue[i].begin(); itr != m_queue[i].end(); ++itr)
+			close(itr->fd);
+
+	pthread_cond_destroy(&m_ready);
+	pthread_mutex_destroy(&m_lock);
+	close(m_quit_pipe[0]);
+	close(m_quit_pipe[1]);
+}
+
+void connection_pool::add(const connection& conn) {
+	pthread_mutex_lock(&m_lock);
+	m_queue[!conn.is_high].push_back(conn);
+	pthread_cond_signal(&m_ready);
+	pthread_mutex_unlock(&m_lock);
+}
+
+void* connection_pool::thread_main(void* pool) {
+	((connection_pool*)pool)->work();
+	return NULL;
+}
+
+void connection_pool::work() {
+	pthread_mutex_lock(&m_lock);
+	while (!m_quit) {
+		int prio = m_queue[0].empty();
+		if (m_queue[prio].empty()) {
+			pthread_cond_wait(&m_ready, &m_lock);
+			continue;
+		}
+
+		connection conn = m_queue[prio].front();
+		m_queue[prio].pop_front();
+
+		pthread_mutex_unlock(&m_lock);
+		handle(conn);
+		pthread_mutex_lock(&m_lock);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+void connection_pool::quit() {
+	pthread_mutex_lock(&m_lock);
+	m_quit = true;
+	pthread_mutex_unlock(&m_lock);
+
+	if (write(m_quit_pipe[1], "q", 1) != 1)
+		DEBUG(errors)("Can't signal quit: %s\n", strerror(errno));
+}
+
+// Remember the first fatal error to rethrow in the main thread, then quit.
+void connection_pool::fatal(const imgdb::base_error& err) {
+	pthread_mutex_lock(&m_lock);
+	if (m_error.empty()) {
+		m_error = err.what();
+		m_data_error = dynamic_cast<const imgdb::data_error*>(&err) != NULL;
+	}
+	pthread_mutex_unlock(&m_lock);
+	quit();
+}
+
+void connection_pool::check_error() {
+	if (m_error.empty()) return;
+	if (m_data_error) throw imgdb::data_error(m_error);
+	throw imgdb::fatal_error(m_error);
+}
+
+void connection_pool::handle(const connection& conn) {
+	// inet_ntoa is not thread-safe.
+	char addr[INET_ADDRSTRLEN];
+	if (!inet_ntop(AF_INET, &conn.client.sin_addr, addr, sizeof(addr))) strcpy(addr, "?");
+	int port = conn.client.sin_port;
+
+	DEBUG(connections)("Accepted %s connection from %s:%d\n", conn.is_high ? "high priority" : "normal", addr, port);
+
+	struct timeval tv = { 5, 0 };	// 5 seconds
+	if (setsockopt(conn.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    setsockopt(conn.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))) {
+		DEBUG(errors)("Can't set SO_RCVTIMEO/SO_SNDTIMEO: %s\n", strerror(errno));
+	}
+
+	try {
+		socket_stream stream(conn.fd);
+
+		try {
+			do_commands(stream.rd, stream.wr, m_dbs, conn.is_high);
+
+		} catch (const event_t& event) {
+			if (event == DO_QUITANDSAVE) quit();
+
+		// Unhandled imgdb::base_error means it was fatal or completely unknown.
+		} catch (const imgdb::base_error& err) {
+			fprintf(stream.wr, "302 %s %s\n", err.type(), err.what());
+			fprintf(stderr, "Caught base_error %s: %s\n", err.type(), err.what());
+			fatal(err);
+
+		} catch (const std::exception& err) {
+			fprintf(stream.wr, "300 Caught unhandled exception!\n");
+			fprintf(stderr, "Caught unhandled exception: %s\n", err.what());
+			fatal(imgdb::internal_error(err.what()));
+		}
+
+	} catch (const imgdb::base_error& err) {
+		DEBUG(errors)("Connection failed: %s\n", err.what());
+	}
+
+	DEBUG(connections)("Connection %s:%d closing.\n", addr, port);
+}
+
+// Checks the DBs every compact_interval seconds, and compacts those with
+// at least min_delta images added or removed.
+class compactor {
+public:
+	compactor(dbSpaceAutoMap& dbs, size_t min_delta);
+	~compactor();
+
+private:
+	compactor(const compactor&);
+	compactor& operator = (const compactor&);
+
+	static void* thread_main(void* compactor);
+	void work();
+	void check();
+
+	dbSpaceAutoMap& m_dbs;
+	size_t m_min_delta;
+	pthread_t m_thread;
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_wake;
+	bool m_quit;
+};
+
+compactor::compactor(dbSpaceAutoMap& dbs, size_t min_delta) : m_dbs(dbs), m_min_delta(min_delta), m_quit(false) {
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_wake, NULL);
+
+	if (m_min_delta)
+		if (int err = pthread_create(&m_thread, NULL, &thread_main, this))
+			die("Can't create compaction thread: %s\n", strerror(err));
+}
+
+// Finishes the compaction step in progress, if any.
+compactor::~compactor() {
+	if (m_min_delta) {
+		pthread_mutex_lock(&m_lock);
+		m_quit = true;
+		pthread_cond_signal(&m_wake);
+		pthread_mutex_unlock(&m_lock);
+		pthread_join(m_thread, NULL);
+	}
+
+	pthread_cond_destroy(&m_wake);
+	pthread_mutex_destroy(&m_lock);
+}
+
+void* compactor::thread_main(void* compactor) {
+	((class compactor*)compactor)->work();
+	return NULL;
+}
+
+void compactor::work() {
+	pthread_mutex_lock(&m_lock);
+	while (!m_quit) {
+		struct timespec until = { time(NULL) + compact_interval, 0 };
+		if (pthread_cond_timedwait(&m_wake, &m_lock, &until) != ETIMEDOUT) continue;
+
+		pthread_mutex_unlock(&m_lock);
+		check();
+		pthread_mutex_lock(&m_lock);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+void compactor::check() {
+	for (unsigned int dbid = 0; ; dbid++) try {
+		size_t delta;
+		{
+			db_lock::reader lock(m_dbs.lock());
+			if (dbid >= m_dbs.size()) break;
+			if (!m_dbs[dbid]) continue;
+			delta = m_dbs[dbid]->getDeltaCount();
+		}
+		if (delta < m_min_delta) continue;
+
+		DEBUG(imgdb)("Compacting DB %d, %zd images added or removed.\n", dbid, delta);
+		compact_db(m_dbs, dbid);
+
+	} catch (const imgdb::base_error& err) {
+		DEBUG(errors)("Compacting DB %d failed: %s %s\n", dbid, err.type(), err.what());
+	}
+}
+
 void server(const char* hostport, int numfiles, char** files, bool listen2) {
 	int port;
 	char dummy;
@@ -873,9 +1418,48 @@ void server(const char* hostport, int numfiles, char** files, bool listen2) {
 	if (ret != 2) die("Can't parse host/port `%s', got %d.\n", hostport, ret);
 
 	int replace = 0;
+	int threads = 1;
+	size_t compact_min = 1000;
 	while (numfiles > 0) {
 		if (!strcmp(files[0], "-r")) {
 			replace = 1;
+			numfiles--;
+			files++;
+		} else if (!strncmp(files[0], "-c", 2)) {
+			threads = strtol(files[0] + 2, NULL, 0);
+			if (threads < 1) die("Invalid number of connection threads: %s\n", files[0] + 2);
+			DEBUG(base)("Handling up to %d connections at once.\n", threads);
+
+			numfiles--;
+			files++;
+		} else if (!strncmp(files[0], "-t", 2)) {
+			int threads = strtol(files[0] + 2, NULL, 0);
+			if (threads < 1) die("Invalid number of query threads: %s\n", files[0] + 2);
+			DEBUG(base)("Using %d threads per query.\n", threads);
+			imgdb::dbSpace::setQueryThreads(threads);
+
+			numfiles--;
+			files++;
+		} else if (!strcmp(files[0], "-H")) {
+			DEBUG(base)("Using reserved huge pages for the buckets.\n");
+			imgdb::dbSpace::setHugePages(imgdb::dbSpace::pages_reserved);
+
+			numfiles--;
+			files++;
+		} else if (!strcmp(files[0], "-N")) {
+			DEBUG(base)("Copying the buckets to each NUMA node.\n");
+			imgdb::dbSpace::setNumaReplicas(true);
+
+			numfiles--;
+			files++;
+		} else if (!strncmp(files[0], "-C", 2)) {
+			compact_min = strtoul(files[0] + 2, NULL, 0);
+			if (compact_min) {
+				DEBUG(base)("Compacting DBs after %zd images were added or removed.\n", compact_min);
+			} else {
+				DEBUG(base)("Not compacting DBs in the background.\n");
+			}
+
 			numfiles--;
 			files++;
 		} else if (!strncmp(files[0], "-s", 2)) {
@@ -935,68 +1519,53 @@ void server(const char* hostport, int numfiles, char** files, bool listen2) {
 		rebind(fd_high, bindaddr_high);
 	}
 
+	connection_pool pool(threads, dbs);
+	fd_max = std::max(fd_max, pool.quit_fd());
+
+	compactor compact(dbs, compact_min);
+
 	fd_set read_fds;
 	FD_ZERO(&read_fds);
 
 	while (1) {
 		FD_SET(fd_high, &read_fds);
 		if (listen2) FD_SET(fd_low,  &read_fds);
+		FD_SET(pool.quit_fd(), &read_fds);
 
 		int nfds = select(fd_max + 1, &read_fds, NULL, NULL, NULL);
 		if (nfds < 1) die("select() failed: %s\n", strerror(errno));
 
-		struct sockaddr_in client;
-		socklen_t len = sizeof(client);
+		if (FD_ISSET(pool.quit_fd(), &read_fds)) break;
+
+		connection conn;
+		socklen_t len = sizeof(conn.client);
 
-		bool is_high = FD_ISSET(fd_high, &read_fds);
+		conn.is_high = FD_ISSET(fd_high, &read_fds);
 
-		int fd = accept(is_high ? fd_high : fd_low, (struct sockaddr*) &client, &len);
-		if (fd == -1) {
+		conn.fd = accept(conn.is_high ? fd_high : fd_low, (struct sockaddr*) &conn.client, &len);
+		if (conn.fd == -1) {
 			DEBUG(errors)("accept() failed: %s\n", strerror(errno));
 			continue;
 		}
 
-		if (!source_addr.empty() && source_addr.find(client.sin_addr.s_addr) == source_addr.end()) {
-			DEBUG(connections)("REFUSED connection from %s:%d\n", inet_ntoa(client.sin_addr), client.sin_port);
-			close(fd);
+		if (!source_addr.empty() && source_addr.find(conn.client.sin_addr.s_addr) == source_addr.end()) {
+			DEBUG(connections)("REFUSED connection from %s:%d\n", inet_ntoa(conn.client.sin_addr), conn.client.sin_port);
+			close(conn.fd);
 			continue;
 		}
 
-		DEBUG(connections)("Accepted %s connection from %s:%d\n", is_high ? "high priority" : "normal", inet_ntoa(client.sin_addr), client.sin_port);
-
-		struct timeval tv = { 5, 0 };	// 5 seconds
-		if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
-		    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))) {
-			DEBUG(errors)("Can't set SO_RCVTIMEO/SO_SNDTIMEO: %s\n", strerror(errno));
-		}
-
-		socket_stream stream(fd);
-
-		try {
-			do_commands(stream.rd, stream.wr, dbs, is_high);
-
-		} catch (const event_t& event) {
-			if (event == DO_QUITANDSAVE) return;
-
-		// Unhandled imgdb::base_error means it was fatal or completely unknown.
-		} catch (const imgdb::base_error& err) {
-			fprintf(stream.wr, "302 %s %s\n", err.type(), err.what());
-			fprintf(stderr, "Caught base_error %s: %s\n", err.type(), err.what());
-			throw;
+		pool.add(conn);
+	}
 
-		} catch (const std::exception& err) {
-			fprintf(stream.wr, "300 Caught unhandled exception!\n");
-			fprintf(stderr, "Caught unhandled exception: %s\n", err.what());
-			throw;
-		}
+	close(fd_high);
+	if (listen2) close(fd_low);
 
-		DEBUG(connections)("Connection %s:%d closing.\n", inet_ntoa(client.sin_addr), client.sin_port);
-	}
+	pool.check_error();
 }
 
 void help() {
 	printf(	"Usage: iqdb add|list|help args...\n"
-		"\tadd dbfile - Read images to add in the form ID:filename from stdin.\n"
+		"\tadd dbfile [-t<threads>] - Read images to add in the form ID:filename from stdin.\n"
 		"\tlist dbfile - List all images in database.\n"
 		"\tquery dbfile imagefile [numres] - Find similar images.\n"
 		"\tsim dbfile id [numres] - Find images similar to given ID.\n"
@@ -1023,7 +1592,9 @@ int main(int argc, char** argv) {
 	int flags = 0;
 
 	if (!strcasecmp(argv[1], "add")) {
-		add(filename);
+		int threads = argc < 4 || strncmp(argv[3], "-t", 2) ? 1 : strtol(argv[3] + 2, NULL, 0);
+		if (threads < 1) die("Invalid number of threads: %s\n", argv[3] + 2);
+		add(filename, threads);
 	} else if (!strcasecmp(argv[1], "list")) {
 		list(filename);
 	} else if (!strncasecmp(argv[1], "query", 5)) {
@@ -0,0 +1,182 @@
+/***************************************************************************\
+    lumin_scan.cpp - Initial query scores from the average luminance of all images.
+
+    Copyright (C) 2008 piespy@gmail.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+\**************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lumin_scan.h"
+
+// Function level target options and __builtin_cpu_supports need gcc 4.9.
+#if defined(__x86_64__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define LUMIN_SCAN_SIMD 1
+#include <immintrin.h>
+#else
+#define LUMIN_SCAN_SIMD 0
+#endif
+
+// Score the images from start to num one at a time.
+static inline void scan_tail(const lumin_scan::query& q, const int32_t* const avgl[3], const uint16_t* mask, size_t start, size_t num, int32_t* scores) {
+	for (size_t i = start; i < num; i++) {
+		int32_t s = 0;
+		for (int c = 0; c < q.colors; c++)
+			s += ((int64_t) q.weight[c] * abs(avgl[c][i] - q.avgl[c])) >> q.shift;
+		if (q.use_mask && (mask[i] & q.mask_and) != q.mask_xor)
+			s = lumin_scan::skipped;
+		scores[i] = s;
+	}
+}
+
+static void scan_scalar(const lumin_scan::query& q, const int32_t* const avgl[3], const uint16_t* mask, size_t num, int32_t* scores) {
+	scan_tail(q, avgl, mask, 0, num, scores);
+}
+
+#if LUMIN_SCAN_SIMD
+// The AVX2 vectors only pass between target("avx2") functions inlined into
+// scan_avx2, so gcc's note that this changes the ABI doesn't apply.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+// Vector policies for the scan, with the operations on several 32 bit values at once.
+struct vec_sse41 {
+	typedef __m128i type;
+	static const size_t width = 4;
+
+	__attribute__((target("sse4.1"))) static inline type set1(int32_t x) { return _mm_set1_epi32(x); }
+	__attribute__((target("sse4.1"))) static inline type load(const int32_t* p) { return _mm_loadu_si128((const __m128i*) p); }
+	__attribute__((target("sse4.1"))) static inline type load_mask(const uint16_t* p) { return _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*) p)); }
+	__attribute__((target("sse4.1"))) static inline void store(int32_t* p, type v) { _mm_storeu_si128((__m128i*) p, v); }
+	__attribute__((target("sse4.1"))) static inline type add(type x, type y) { return _mm_add_epi32(x, y); }
+
+	// (weight * abs(x - y)) >> shift, with 64 bit products of the even and odd values.
+	__attribute__((target("sse4.1")))
+	static inline type weigh(type x, type y, type weight, __m128i shift) {
+		type d = _mm_abs_epi32(_mm_sub_epi32(x, y));
+		type even = _mm_srl_epi64(_mm_mul_epi32(d, weight), shift);
+		type odd = _mm_srl_epi64(_mm_mul_epi32(_mm_srli_epi64(d, 32), weight), shift);
+		return _mm_blend_epi16(even, _mm_slli_epi64(odd, 32), 0xcc);
+	}
+
+	// Values of skip where (mask & mask_and) != mask_xor, otherwise those of s.
+	__attribute__((target("sse4.1")))
+	static inline type apply_mask(type s, type mask, type mask_and, type mask_xor, type skip) {
+		return _mm_blendv_epi8(skip, s, _mm_cmpeq_epi32(_mm_and_si128(mask, mask_and), mask_xor));
+	}
+};
+
+struct vec_avx2 {
+	typedef __m256i type;
+	static const size_t width = 8;
+
+	__attribute__((target("avx2"))) static inline type set1(int32_t x) { return _mm256_set1_epi32(x); }
+	__attribute__((target("avx2"))) static inline type load(const int32_t* p) { return _mm256_loadu_si256((const __m256i*) p); }
+	__attribute__((target("avx2"))) static inline type load_mask(const uint16_t* p) { return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) p)); }
+	__attribute__((target("avx2"))) static inline void store(int32_t* p, type v) { _mm256_storeu_si256((__m256i*) p, v); }
+	__attribute__((target("avx2"))) static inline type add(type x, type y) { return _mm256_add_epi32(x, y); }
+
+	__attribute__((target("avx2")))
+	static inline type weigh(type x, type y, type weight, __m128i shift) {
+		type d = _mm256_abs_epi32(_mm256_sub_epi32(x, y));
+		type even = _mm256_srl_epi64(_mm256_mul_epi32(d, weight), shift);
+		type odd = _mm256_srl_epi64(_mm256_mul_epi32(_mm256_srli_epi64(d, 32), weight), shift);
+		return _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xaa);
+	}
+
+	__attribute__((target("avx2")))
+	static inline type apply_mask(type s, type mask, type mask_and, type mask_xor, type skip) {
+		return _mm256_blendv_epi8(skip, s, _mm256_cmpeq_epi32(_mm256_and_si256(mask, mask_and), mask_xor));
+	}
+};
+
+template<typename V>
+static inline void scan_vec(const lumin_scan::query& q, const int32_t* const avgl[3], const uint16_t* mask, size_t num, int32_t* scores) {
+	typedef typename V::type type;
+	type qavgl[3], weight[3];
+	for (int c = 0; c < q.colors; c++) {
+		qavgl[c] = V::set1(q.avgl[c]);
+		weight[c] = V::set1(q.weight[c]);
+	}
+	__m128i shift = _mm_cvtsi32_si128(q.shift);
+	type mask_and = V::set1(q.mask_and), mask_xor = V::set1(q.mask_xor), skip = V::set1(lumin_scan::skipped);
+
+	size_t i = 0;
+	for (; i + V::width <= num; i += V::width) {
+		type s = V::weigh(V::load(avgl[0] + i), qavgl[0], weight[0], shift);
+		for (int c = 1; c < q.colors; c++)
+			s = V::add(s, V::weigh(V::load(avgl[c] + i), qavgl[c], weight[c], shift));
+		if (q.use_mask)
+			s = V::apply_mask(s, V::load_mask(mask + i), mask_and, mask_xor, skip);
+		V::store(scores + i, s);
+	}
+	scan_tail(q, avgl, mask, i, num, scores);
+}
+
+// Flatten to inline the vector policy even though the template itself has no target options.
+__attribute__((target("sse4.1"), flatten))
+static void scan_sse41(const lumin_scan::query& q, const int32_t* const avgl[3], const uint16_t* mask, size_t num, int32_t* scores) {
+	scan_vec<vec_sse41>(q, avgl, mask, num, scores);
+}
+
+__attribute__((target("avx2"), flatten))
+static void scan_avx2(const lumin_scan::query& q, const int32_t* const avgl[3], const uint16_t* mask, size_t num, int32_t* scores) {
+	scan_vec<vec_avx2>(q, avgl, mask, num, scores);
+}
+
+#pragma GCC diagnostic pop
+#endif
+
+const char* lumin_scan::s_impl;
+lumin_scan::scan_func lumin_scan::s_func = lumin_scan::detect();
+
+lumin_scan::scan_func lumin_scan::detect() {
+#if LUMIN_SCAN_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		s_impl = "avx2";
+		return &scan_avx2;
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		s_impl = "sse4.1";
+		return &scan_sse41;
+	}
+#endif
+	s_impl = "scalar";
+	return &scan_scalar;
+}
+
+bool lumin_scan::use(const char* impl) {
+	scan_func func = NULL;
+	if (!strcmp(impl, "scalar")) {
+		func = &scan_scalar;
+		impl = "scalar";
+#if LUMIN_SCAN_SIMD
+	} else if (!strcmp(impl, "sse4.1") && __builtin_cpu_supports("sse4.1")) {
+		func = &scan_sse41;
+		impl = "sse4.1";
+	} else if (!strcmp(impl, "avx2") && __builtin_cpu_supports("avx2")) {
+		func = &scan_avx2;
+		impl = "avx2";
+#endif
+	}
+
+	if (!func) return false;
+	s_func = func;
+	s_impl = impl;
+	return true;
+}
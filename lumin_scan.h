@@ -0,0 +1,82 @@
+#ifndef LUMIN_SCAN_H
+#define LUMIN_SCAN_H
+
+/***************************************************************************\
+    lumin_scan.h - Initial query scores from the average luminance of all images.
+
+    Copyright (C) 2008 piespy@gmail.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+\**************************************************************************/
+
+/* Same as
+
+   for (size_t i = 0; i < num; i++) {
+	scores[i] = 0;
+	for (int c = 0; c < q.colors; c++)
+		scores[i] += ((int64_t) q.weight[c] * abs(avgl[c][i] - q.avgl[c])) >> q.shift;
+	if (q.use_mask && (mask[i] & q.mask_and) != q.mask_xor)
+		scores[i] = lumin_scan::skipped;
+   }
+
+   but with the luminance of each color channel and the masks in separate
+   arrays, several images are scored at once. Depending on the CPU, this
+   uses AVX2, SSE4.1 or plain integer arithmetic, selected when the
+   program starts.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+class lumin_scan {
+public:
+	struct query {
+		int colors;
+		int32_t avgl[3];
+		int32_t weight[3];
+		int shift;
+
+		// Skip images unless their mask ANDed with mask_and equals mask_xor.
+		bool use_mask;
+		uint16_t mask_and;
+		uint16_t mask_xor;
+	};
+
+	// Score of skipped images. It is so much higher than any real score
+	// that it stays above skipped / 2 after subtracting all coefficient
+	// weights of a query.
+	static const int32_t skipped = 1 << 30;
+
+	static void scan(const query& q, const int32_t* const avgl[3], const uint16_t* mask, size_t num, int32_t* scores) {
+		(*s_func)(q, avgl, mask, num, scores);
+	}
+
+	// Name of the implementation in use.
+	static const char* impl() { return s_impl; }
+
+	// Use the given implementation ("avx2", "sse4.1" or "scalar").
+	// Returns false if it is not available.
+	static bool use(const char* impl);
+
+private:
+	typedef void (*scan_func)(const query& q, const int32_t* const avgl[3], const uint16_t* mask, size_t num, int32_t* scores);
+
+	static scan_func detect();
+
+	static scan_func s_func;
+	static const char* s_impl;
+};
+
+#endif // LUMIN_SCAN_H
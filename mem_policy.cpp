@@ -0,0 +1,223 @@
+/***************************************************************************\
+    mem_policy.cpp - Huge pages and NUMA nodes for large arrays.
+
+    Copyright (C) 2008 piespy@gmail.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+\**************************************************************************/
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include "debug.h"
+#include "imgdb.h"
+#include "mem_policy.h"
+
+extern int debug_level;
+
+static const size_t huge_page_size = 2 << 20;
+// Largest scratch buffer a thread keeps for its next use.
+static const size_t scratch_keep = 64 << 20;
+
+static inline size_t round_up(size_t length, size_t align) {
+	return (length + align - 1) & ~(align - 1);
+}
+
+mem_policy::pages mem_policy::s_pages = mem_policy::pages_transparent;
+std::vector<unsigned int> mem_policy::s_nodeOfCpu;
+std::vector<cpu_set_t> mem_policy::s_cpus = mem_policy::detect();
+
+void* mem_policy::map(size_t& length) {
+	void* base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (s_pages == pages_reserved) {
+		size_t huge = round_up(length, huge_page_size);
+		base = mmap(NULL, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (base != MAP_FAILED) {
+			length = huge;
+			return base;
+		}
+		DEBUG(warnings)("WARNING: Could not get %zd bytes of huge pages: %s.\n", huge, strerror(errno));
+	}
+#endif
+
+	if (s_pages == pages_normal || length < huge_page_size) {
+		base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) throw imgdb::memory_error("Failed to map memory.");
+		return base;
+	}
+
+	// Transparent huge pages only cover whole aligned ones, so map a
+	// little more and unmap what lies outside of them.
+	length = round_up(length, huge_page_size);
+	char* over = (char*) mmap(NULL, length + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (over == MAP_FAILED) throw imgdb::memory_error("Failed to map memory.");
+
+	char* start = (char*) round_up((size_t) over, huge_page_size);
+	if (start > over) munmap(over, start - over);
+	if (over + huge_page_size > start) munmap(start + length, over + huge_page_size - start);
+
+#ifdef MADV_HUGEPAGE
+	// Fails if the kernel has them disabled, which is fine.
+	madvise(start, length, MADV_HUGEPAGE);
+#endif
+	return start;
+}
+
+void mem_policy::unmap(void* base, size_t length) {
+	if (base && munmap(base, length))
+		DEBUG(warnings)("WARNING: Could not unmap %zd bytes: %s.\n", length, strerror(errno));
+}
+
+// Parse a list of CPUs like "0-3,8-11".
+static void parse_cpus(const char* list, cpu_set_t& cpus, std::vector<unsigned int>& nodeOfCpu, unsigned int node) {
+	while (*list >= '0' && *list <= '9') {
+		char* end;
+		unsigned long first = strtoul(list, &end, 10), last = first;
+		if (*end == '-') last = strtoul(end + 1, &end, 10);
+		for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, &cpus);
+			if (nodeOfCpu.size() <= cpu) nodeOfCpu.resize(cpu + 1, 0);
+			nodeOfCpu[cpu] = node;
+		}
+		list = *end == ',' ? end + 1 : end;
+	}
+}
+
+std::vector<cpu_set_t> mem_policy::detect() {
+	// Nodes without CPUs don't count, and the others are numbered in order.
+	std::map<unsigned int, std::string> lists;
+	DIR* dir = opendir("/sys/devices/system/node");
+	if (dir) {
+		struct dirent* entry;
+		while ((entry = readdir(dir))) {
+			unsigned int node;
+			char tail;
+			if (sscanf(entry->d_name, "node%u%c", &node, &tail) != 1) continue;
+
+			char name[64], list[4096];
+			snprintf(name, sizeof(name), "/sys/devices/system/node/node%u/cpulist", node);
+			FILE* f = fopen(name, "r");
+			if (!f) continue;
+			if (fgets(list, sizeof(list), f) && list[0] >= '0' && list[0] <= '9')
+				lists[node] = list;
+			fclose(f);
+		}
+		closedir(dir);
+	}
+
+	std::vector<cpu_set_t> cpus(std::max<size_t>(lists.size(), 1));
+	for (size_t node = 0; node < cpus.size(); node++)
+		CPU_ZERO(&cpus[node]);
+
+	if (lists.size() > 1) {
+		unsigned int node = 0;
+		for (std::map<unsigned int, std::string>::const_iterator itr = lists.begin(); itr != lists.end(); ++itr, node++)
+			parse_cpus(itr->second.c_str(), cpus[node], s_nodeOfCpu, node);
+	}
+	return cpus;
+}
+
+unsigned int mem_policy::node() {
+	if (s_cpus.size() < 2) return 0;
+	int cpu = sched_getcpu();
+	return cpu >= 0 && (size_t) cpu < s_nodeOfCpu.size() ? s_nodeOfCpu[cpu] : 0;
+}
+
+mem_policy::bind_node::bind_node(unsigned int node) : m_bound(false) {
+	if (s_cpus.size() < 2 || node >= s_cpus.size()) return;
+	if (sched_getaffinity(0, sizeof(m_old), &m_old)) return;
+
+	if (!sched_setaffinity(0, sizeof(cpu_set_t), &s_cpus[node])) {
+		m_bound = true;
+	} else {
+		DEBUG(warnings)("WARNING: Could not run on NUMA node %d: %s.\n", node, strerror(errno));
+	}
+}
+
+mem_policy::bind_node::~bind_node() {
+	if (m_bound) sched_setaffinity(0, sizeof(m_old), &m_old);
+}
+
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+static bool have_buffer_key = false;
+
+void mem_policy::make_key() {
+	have_buffer_key = !pthread_key_create(&buffer_key, &free_buffer);
+}
+
+void mem_policy::free_buffer(void* buf) {
+	buffer* b = (buffer*) buf;
+	unmap(b->base, b->length);
+	delete b;
+}
+
+mem_policy::buffer* mem_policy::acquire(size_t length) {
+	pthread_once(&buffer_once, &make_key);
+	if (!have_buffer_key) throw imgdb::internal_error("Could not create scratch buffer key.");
+	if (!length) length = 1;
+
+	buffer* buf = (buffer*) pthread_getspecific(buffer_key);
+	if (buf && buf->busy) {
+		// A separate one just for this use.
+		buf = new buffer();
+		buf->length = length;
+		buf->base = map(buf->length);
+		buf->node = node();
+		buf->busy = true;
+		return buf;
+	}
+
+	if (!buf) {
+		buf = new buffer();
+		pthread_setspecific(buffer_key, buf);
+	}
+
+	// Get a new one if it is too small or the thread now runs on another node.
+	unsigned int here = node();
+	if (!buf->base || buf->length < length || buf->node != here) {
+		unmap(buf->base, buf->length);
+		buf->base = NULL;
+		buf->length = length;
+		buf->base = map(buf->length);
+		buf->node = here;
+	}
+	buf->busy = true;
+	return buf;
+}
+
+void mem_policy::release(buffer* buf) {
+	if (buf != pthread_getspecific(buffer_key)) {
+		free_buffer(buf);
+		return;
+	}
+
+	buf->busy = false;
+	if (buf->length > scratch_keep) {
+		unmap(buf->base, buf->length);
+		buf->base = NULL;
+		buf->length = 0;
+	}
+}
@@ -0,0 +1,120 @@
+#ifndef MEM_POLICY_H
+#define MEM_POLICY_H
+
+/***************************************************************************\
+    mem_policy.h - Huge pages and NUMA nodes for large arrays.
+
+    Copyright (C) 2008 piespy@gmail.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+\**************************************************************************/
+
+/* Large arrays that queries read over and over, like the bucket arena and
+   the scores, need far fewer TLB entries in huge pages. These are either
+   transparent huge pages, which the kernel makes of normal pages after
+   madvise(MADV_HUGEPAGE), or huge pages the system has reserved (see
+   vm.nr_hugepages). map() allocates with the page policy in use.
+
+   On a machine with several NUMA nodes, Linux puts a page on the node of
+   the CPU that first touches it. So a thread's scratch buffer is allocated
+   by the thread itself, again when it has moved to another node, and
+   copies meant for a node are made with the thread bound to its CPUs.
+   The nodes are read from /sys when the program starts.
+*/
+
+#include <sched.h>
+#include <stddef.h>
+
+#include <vector>
+
+class mem_policy {
+public:
+	enum pages {
+		pages_normal,
+		pages_transparent,	// The default.
+		pages_reserved		// Transparent ones if there aren't enough.
+	};
+
+	static void set_pages(pages p) { s_pages = p; }
+
+	// Map length bytes of zeroed memory with the page policy. Rounds up
+	// length to the size of the pages used, for unmap().
+	static void* map(size_t& length);
+	static void unmap(void* base, size_t length);
+
+	// Number of NUMA nodes with CPUs, at least one, and the one the
+	// calling thread runs on, from 0 to nodes() - 1.
+	static unsigned int nodes() { return s_cpus.size(); }
+	static unsigned int node();
+
+	// Runs the calling thread on the CPUs of a node while it exists.
+	class bind_node {
+	public:
+		explicit bind_node(unsigned int node);
+		~bind_node();
+
+	private:
+		bind_node(const bind_node&);
+		bind_node& operator = (const bind_node&);
+
+		cpu_set_t m_old;
+		bool m_bound;
+	};
+
+private:
+	struct buffer {
+		void* base;
+		size_t length;
+		unsigned int node;
+		bool busy;
+	};
+
+public:
+	// Array of count T in a buffer of the calling thread, which is kept for
+	// the next one instead of freed, unless it is larger than 64 MB. If the
+	// buffer is still in use further up the stack, a separate one is used
+	// instead. Not initialized.
+	template<typename T>
+	class scratch {
+	public:
+		explicit scratch(size_t count) : m_buf(acquire(count * sizeof(T))) { }
+		~scratch() { release(m_buf); }
+
+		T* ptr() { return (T*) m_buf->base; }
+		T& operator[](size_t ind) { return ptr()[ind]; }
+
+	private:
+		scratch(const scratch&);
+		scratch& operator = (const scratch&);
+
+		buffer* m_buf;
+	};
+
+private:
+	static buffer* acquire(size_t length);
+	static void release(buffer* buf);
+	static void make_key();
+	static void free_buffer(void* buf);
+
+	static std::vector<cpu_set_t> detect();
+
+	static pages s_pages;
+
+	// CPUs of each node, and the node of each CPU.
+	static std::vector<cpu_set_t> s_cpus;
+	static std::vector<unsigned int> s_nodeOfCpu;
+};
+
+#endif // MEM_POLICY_H
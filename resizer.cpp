@@ -21,6 +21,10 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
 
 #include <arpa/inet.h>	// For ntoh*
 
@@ -334,6 +338,159 @@ gdImagePtr resize_jpeg(const unsigned char* data, size_t len, const image_info*
 	return img.detach();
 }
 
+// Split the box filter from src to dst pixels into spans. Source pixel i
+// covers [i*dst, (i+1)*dst) and destination pixel j covers [j*src, (j+1)*src),
+// each span is where they overlap, so the weights of a destination pixel add
+// up to src.
+static void box_spans(unsigned int src, unsigned int dst, std::vector<box_scaler::span>& spans) {
+	spans.clear();
+	unsigned int i = 0, j = 0, pos = 0;
+	while (i < src) {
+		unsigned int end = std::min((i + 1) * dst, (j + 1) * src);
+		box_scaler::span span = { i, j, end - pos };
+		spans.push_back(span);
+		pos = end;
+		if (end == (i + 1) * dst) i++;
+		if (end == (j + 1) * src) j++;
+	}
+}
+
+void box_scaler::start(unsigned int src_x, unsigned int src_y, unsigned int thu_x, unsigned int thu_y, unsigned char* red, unsigned char* green, unsigned char* blue) {
+	box_spans(src_x, thu_x, m_x);
+	box_spans(src_y, thu_y, m_y);
+	m_thu_x = thu_x;
+	m_total = (uint64_t)src_x * src_y;
+	m_row = 0;
+	m_span = 0;
+	m_out[0] = red; m_out[1] = green; m_out[2] = blue;
+	m_sums.resize(3 * thu_x);
+	m_acc.assign(3 * thu_x, 0);
+	m_buffer.resize(3 * src_x);
+	m_started = true;
+}
+
+void box_scaler::add_row(const unsigned char* rgb) {
+	uint32_t* sums = &m_sums[0];
+	memset(sums, 0, 3 * m_thu_x * sizeof(uint32_t));
+	for (std::vector<span>::const_iterator itr = m_x.begin(); itr != m_x.end(); ++itr) {
+		const unsigned char* pixel = rgb + 3 * itr->src;
+		uint32_t* sum = sums + 3 * itr->dst;
+		sum[0] += pixel[0] * itr->len;
+		sum[1] += pixel[1] * itr->len;
+		sum[2] += pixel[2] * itr->len;
+	}
+
+	for (; m_span < m_y.size() && m_y[m_span].src == m_row; m_span++) {
+		uint64_t* acc = &m_acc[0];
+		uint64_t len = m_y[m_span].len;
+		for (unsigned int i = 0; i < 3 * m_thu_x; i++)
+			acc[i] += sums[i] * len;
+		if (m_span + 1 == m_y.size() || m_y[m_span + 1].dst != m_y[m_span].dst)
+			flush(m_y[m_span].dst);
+	}
+	m_row++;
+}
+
+void box_scaler::flush(unsigned int y) {
+	uint64_t* acc = &m_acc[0];
+	for (unsigned int x = 0; x < m_thu_x; x++)
+		for (int c = 0; c < 3; c++, acc++) {
+			m_out[c][y * m_thu_x + x] = (*acc + m_total / 2) / m_total;
+			*acc = 0;
+		}
+}
+
+bool resize_jpeg_channels(const unsigned char* data, size_t len, unsigned int thu_x, unsigned int thu_y, unsigned char* red, unsigned char* green, unsigned char* blue, box_scaler* scaler) {
+	image_info info;
+	if (get_image_info(data, len, &info) || info.type != IMG_JPEG || !info.width || !info.height) return false;
+
+	// Same scaling as resize_jpeg, so that the result matches gdImageCopyResampled.
+	unsigned int scale_bits = find_scale_bits(info.width, info.height, thu_x, thu_y);
+
+	DEBUG(resizer)("Loading JPEG channels rescaled to 1/%d.\n", 1<<scale_bits);
+
+	jpeg_decompress_struct cinfo;
+	jpeg_error jerr;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jerr.error_exit = jpeg_error_exit;
+	jerr.emit_message = jpeg_warning;
+
+	// The decoding state is kept in the scaler, so that it survives the longjmp.
+	AutoCleanPtr<box_scaler> own_scaler;
+	if (!scaler) {
+		own_scaler.set(new box_scaler);
+		scaler = own_scaler;
+	}
+	scaler->reset();
+
+	bool created = 0;
+
+	try {
+
+	if (setjmp(jerr.handler)) {
+		char msg[1024];
+		(*jerr.info->err->format_message)(jerr.info, msg);
+		throw imgdb::image_error(std::string(msg));
+	}
+
+	jpeg_create_decompress(&cinfo);
+	created = 1;
+
+	jpeg_data_reader reader(data, len);
+	cinfo.err->trace_level = 0;
+	cinfo.src = &reader;
+
+	// skip all unhandled APP markers
+	for (int i = JPEG_APP0+1; i <= JPEG_APP0+15; i++)
+		if (i != JPEG_APP0+14)
+			jpeg_set_marker_processor(&cinfo, i, skip_jpeg_marker);
+
+	jpeg_read_header(&cinfo, TRUE);
+
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = 1<<scale_bits;
+	cinfo.out_color_space = JCS_RGB;
+
+	jpeg_start_decompress(&cinfo);
+
+	if (cinfo.output_components != 3)
+		throw imgdb::image_error("JPEG decompress returning wrong component number.");
+
+	scaler->start(cinfo.output_width, cinfo.output_height, thu_x, thu_y, red, green, blue);
+	while (cinfo.output_scanline < cinfo.output_height) {
+		unsigned char* row = scaler->buffer();
+		jpeg_read_scanlines(&cinfo, &row, 1);
+		scaler->add_row(row);
+	}
+
+	jpeg_finish_decompress(&cinfo);
+
+	} catch (imgdb::simple_error& e) {
+		DEBUG(warnings)("resize_jpeg_channels caught %s: %s\n", e.type(), e.what());
+
+		// Let gd handle what libjpeg cannot decode, and broken images that
+		// resize_jpeg would not have prescaled. Otherwise keep however much
+		// we have of the image like resize_jpeg does, the rest is black.
+		if (!scaler->started() || !scale_bits) {
+			if (created) jpeg_destroy_decompress(&cinfo);
+			return false;
+		}
+		memset(scaler->buffer(), 0, cinfo.output_width * cinfo.output_components);
+		while (scaler->rows() < cinfo.output_height)
+			scaler->add_row(scaler->buffer());
+
+	} catch (std::exception& e) {
+		if (created) jpeg_destroy_decompress(&cinfo);
+		throw;
+	}
+
+	if (created) jpeg_destroy_decompress(&cinfo);
+
+	DEBUG(terse)("Resized %s %d x %d via %d x %d to %d x %d channels.\n", info.mime_type, info.width, info.height, cinfo.output_width, cinfo.output_height, thu_x, thu_y);
+	return true;
+}
+
 struct png_mem_info {
 	png_mem_info(const unsigned char* data, size_t len) : m_data(data), m_len(len) { }
 
@@ -19,6 +19,10 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 \**************************************************************************/
 
+#include <stdint.h>
+
+#include <vector>
+
 #include <gd.h>
 
 #include "auto_clean.h"
@@ -67,3 +71,44 @@ size_t get_image_info(const unsigned char* data, size_t length, image_info* info
 // GIF
 resizer_result resize_image_data(const unsigned char* data, size_t len, unsigned int thu_x, unsigned int thu_y, bool allow_prescaled);
 
+
+// Scales RGB rows into planar channels with an area-weighted box filter.
+// Keep one around to reuse its buffers for the next image.
+class box_scaler {
+public:
+	struct span {
+		unsigned int src, dst, len;	// source pixel src overlaps destination pixel dst by len
+	};
+
+	box_scaler() : m_started(false) { }
+
+	void reset() { m_started = false; }
+	void start(unsigned int src_x, unsigned int src_y, unsigned int thu_x, unsigned int thu_y, unsigned char* red, unsigned char* green, unsigned char* blue);
+	void add_row(const unsigned char* rgb);
+
+	bool started() const { return m_started; }
+	unsigned int rows() const { return m_row; }
+	unsigned char* buffer() { return &m_buffer[0]; }	// holds one source row
+
+private:
+	void flush(unsigned int y);
+
+	bool m_started;
+	unsigned int m_thu_x;
+	uint64_t m_total;
+	unsigned int m_row;
+	size_t m_span;
+	unsigned char* m_out[3];
+	std::vector<span> m_x, m_y;
+	std::vector<uint32_t> m_sums;
+	std::vector<uint64_t> m_acc;
+	std::vector<unsigned char> m_buffer;
+};
+
+// Decode JPEG data straight into thu_x*thu_y planar red, green and blue
+// channels, without going through gd. libjpeg scales it down by up to 1/8
+// while decoding, as long as that leaves at least the thumbnail size, and
+// a box filter averages the rest. Returns false if the data is not a JPEG
+// or libjpeg cannot decode it to RGB, then use resize_image_data instead.
+// Pass a scaler to reuse its buffers, otherwise a new one is allocated.
+bool resize_jpeg_channels(const unsigned char* data, size_t len, unsigned int thu_x, unsigned int thu_y, unsigned char* red, unsigned char* green, unsigned char* blue, box_scaler* scaler = NULL);
@@ -5,10 +5,16 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <tr1/unordered_map>
+#include "block_queue.h"
 #include "delta_queue.h"
 #include "debug.h"
 #include "imgdb.h"
+#include "mem_policy.h"
+#include "worker_pool.h"
 
 int debug_level = DEBUG_errors | DEBUG_base | DEBUG_summary | DEBUG_resizer | DEBUG_image_info;
 
@@ -64,6 +70,96 @@ void DeltaTest::test() {
 	if (itr != delta.end()) throw imgdb::internal_error(S"\nFailed! Did not reach end at element "+i+"!\n");
 	if (cItr != comp.end()) throw imgdb::internal_error(S"\nFailed! Reached end prematurely at element "+i+"!\n");
 	printf("OK.\n");
+
+	printf("Writing in place... ");
+	delta_counter counter;
+	for (cItr = comp.begin(); cItr != comp.end(); ++cItr)
+		counter.push_back(*cItr);
+	if (counter.words() != delta.m_base.size()) throw imgdb::internal_error(S"\nFailed! Counted "+counter.words()+" words but used "+delta.m_base.size()+"!\n");
+
+	std::vector<delta_value> words(counter.words());
+	delta_writer writer(&words.front());
+	for (cItr = comp.begin(); cItr != comp.end(); ++cItr)
+		writer.push_back(*cItr);
+	delta_queue_view view = writer.view();
+	if (view.num_words() != words.size() || view.size() != delta.size()) throw imgdb::internal_error(S"\nFailed! Wrote "+view.num_words()+" words with "+view.size()+" values!\n");
+	for (size_t w = 0; w < words.size(); w++)
+		if (words[w].full != delta.m_base[w].full) throw imgdb::internal_error(S"\nFailed! Word "+w+" differs!\n");
+	printf("OK.\n");
+}
+
+struct collect {
+	collect(std::vector<size_t>& values) : m_values(values) { }
+	void operator()(size_t v) { m_values.push_back(v); }
+	std::vector<size_t>& m_values;
+};
+
+// Store random runs of dense and sparse values, then check that iterating,
+// seeking and scanning a block at a time all give them back.
+void block_test() {
+	printf("Testing block queue...");
+	for (int n = 0; n < 200; n++) {
+		block_queue block;
+		std::vector<size_t> comp;
+		size_t last = 1000 + rand() % 1000, num = rand() % (n < 100 ? 300 : 5000);
+		int bits = n % 33;
+		for (size_t i = 0; i < num; i++) {
+			last += 1 + (bits ? (((size_t)rand() << 16) ^ rand()) & ((1ull << bits) - 2) : 0);
+			block.push_back(last);
+			comp.push_back(last);
+		}
+		if (n & 1) block.finish();
+
+		size_t i = 0;
+		block_queue::const_iterator itr = block.begin();
+		for (; itr != block.end() && i < num; ++itr, ++i)
+			if (*itr != comp[i]) throw imgdb::internal_error(S"\nFailed! Element "+i+" is "+*itr+" but should be "+comp[i]+"!\n");
+		if (itr != block.end() || i != num) throw imgdb::internal_error(S"\nFailed! Wrong number of elements in list "+n+"!\n");
+
+		for (int k = 0; k < 20 && num; k++) {
+			size_t lo = comp[rand() % num] - rand() % 3, hi = lo + rand() % (last - comp.front() + 2);
+			size_t first = std::lower_bound(comp.begin(), comp.end(), lo) - comp.begin();
+			size_t stop = std::max(first, (size_t)(std::lower_bound(comp.begin(), comp.end(), hi) - comp.begin()));
+
+			std::vector<size_t> values;
+			collect f(values);
+			itr = block.lower_bound(lo);
+			block_queue::scan(itr, block.end(), hi, f);
+			if (values.size() != stop - first || !std::equal(values.begin(), values.end(), comp.begin() + first))
+				throw imgdb::internal_error(S"\nFailed! Scanning ["+lo+", "+hi+") of list "+n+" gave "+values.size()+" elements, not "+(stop - first)+"!\n");
+			if (stop < num ? itr == block.end() || *itr != comp[stop] : itr != block.end())
+				throw imgdb::internal_error(S"\nFailed! Scanning list "+n+" stopped at the wrong element!\n");
+		}
+	}
+	printf(" OK.\n");
+}
+
+void scratch_test() {
+	printf("Testing scratch buffers...");
+	void* first;
+	{
+		mem_policy::scratch<imgdb::Score> scores(100000);
+		first = scores.ptr();
+		for (size_t i = 0; i < 100000; i++) scores[i] = i;
+
+		mem_policy::scratch<imgdb::Score> nested(1000);
+		if (nested.ptr() == first) throw imgdb::internal_error("\nFailed! Nested scratch buffer is the one in use!\n");
+		nested[999] = 0;
+	}
+	{
+		mem_policy::scratch<imgdb::Score> scores(50000);
+		if (scores.ptr() != first && mem_policy::nodes() == 1) throw imgdb::internal_error("\nFailed! Scratch buffer was not reused!\n");
+	}
+	{
+		mem_policy::scratch<imgdb::Score> scores(5000000);
+		scores[4999999] = 1;
+	}
+
+	size_t length = 3 << 20;
+	void* mem = mem_policy::map(length);
+	if (length < (3u << 20) || ((char*) mem)[length - 1]) throw imgdb::internal_error("\nFailed! Mapped memory is too short or not zeroed!\n");
+	mem_policy::unmap(mem, length);
+	printf(" OK.\n");
 }
 
 inline Idx shuffle(Idx old, int add) {
@@ -134,6 +230,510 @@ void query(imgdb::dbSpace* db, unsigned int id, const deleted_t& removed) {
 	}
 }
 
+// Large DB of random images, to split up queries between threads.
+static const char* big_fn = "test-db-big.idb";
+static const int big_images = 70000;
+static const int big_queries = 12;
+
+// Like in real images, most of the largest coefficients are low frequencies.
+void random_sig(Idx* sig, unsigned int& seed) {
+	for (int i = 0; i < NUM_COEFS; i++) {
+		Idx c;
+		do {
+			int row = NUM_PIXELS * pow((double) rand_r(&seed) / RAND_MAX, 3), col = NUM_PIXELS * pow((double) rand_r(&seed) / RAND_MAX, 3);
+			c = std::min(row, NUM_PIXELS - 1) * NUM_PIXELS + std::min(col, NUM_PIXELS - 1);
+			if (rand_r(&seed) & 1) c = -c;
+		} while (!c || std::find(sig, sig + i, c) != sig + i);
+		sig[i] = c;
+	}
+}
+
+// Seeded by the ID, with sets of about 70 images and random mask bits.
+imgdb::ImgData* random_image(int id) {
+	unsigned int seed = id;
+	data.id = id;
+	random_sig(data.sig1, seed);
+	random_sig(data.sig2, seed);
+	random_sig(data.sig3, seed);
+	for (int c = 0; c < 3; c++)
+		data.avglf[c] = (double) rand_r(&seed) / RAND_MAX * (c ? 0.2 : 1) - (c ? 0.1 : 0);
+	data.width = 1 + id % 997;
+	data.height = rand_r(&seed) & 15;
+	return &data;
+}
+
+void create_big_db() {
+	fprintf(stderr, "Creating %s with %d images... ", big_fn, big_images);
+	unlink(big_fn);
+	imgdb::dbSpace* db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_alter);
+	for (int i = 1; i <= big_images; i++)
+		db->addImageData(random_image(i));
+	db->save_file(big_fn);
+	delete db;
+	fprintf(stderr, "done.\n");
+}
+
+// The queries are images of the DB with a quarter of their coefficients
+// replaced, run with and without uniqueset and mask, for 1 and 16 results.
+imgdb::queryArg_list big_query_list(int flags = 0) {
+	imgdb::queryArg_list queries;
+	for (int q = 0; q < big_queries; q++) {
+		unsigned int seed = 1000000 + q;
+		imgdb::ImgData* img = random_image(1 + q * (big_images / big_queries));
+		Idx* sigs[3] = { img->sig1, img->sig2, img->sig3 };
+		for (int c = 0; c < 3; c++) {
+			Idx other[NUM_COEFS];
+			random_sig(other, seed);
+			for (int i = 0; i < NUM_COEFS / 4; i++)
+				if (std::find(sigs[c], sigs[c] + NUM_COEFS, other[i]) == sigs[c] + NUM_COEFS) sigs[c][rand_r(&seed) % NUM_COEFS] = other[i];
+		}
+
+		for (int v = 0; v < 8; v++) {
+			queries.push_back(imgdb::queryArg(*img, v & 1 ? 16 : 1, flags | (v & 2 ? imgdb::dbSpace::flag_uniqueset : 0)));
+			if (v & 4) queries.back().mask(3, 1);
+		}
+	}
+	return queries;
+}
+
+imgdb::sim_vector_list query_each(imgdb::dbSpace* db, const imgdb::queryArg_list& queries) {
+	imgdb::sim_vector_list results;
+	for (imgdb::queryArg_list::const_iterator itr = queries.begin(); itr != queries.end(); ++itr)
+		results.push_back(db->queryImg(*itr));
+	return results;
+}
+
+void compare_results(const char* what, const imgdb::sim_vector_list& one, const imgdb::sim_vector_list& two) {
+	if (one.size() != two.size()) throw imgdb::internal_error(S"\nFailed! "+what+" returned "+two.size()+" result lists, not "+one.size()+"!\n");
+	for (size_t q = 0; q < one.size(); q++) {
+		if (one[q].empty() || one[q].size() != two[q].size())
+			throw imgdb::internal_error(S"\nFailed! "+what+" returned "+two[q].size()+" results for query "+q+", not "+one[q].size()+"!\n");
+		for (size_t i = 0; i < one[q].size(); i++)
+			if (one[q][i].id != two[q][i].id || one[q][i].score != two[q][i].score || one[q][i].width != two[q][i].width || one[q][i].height != two[q][i].height)
+				throw imgdb::internal_error(S"\nFailed! "+what+" differs in result "+i+" of query "+q+": "+two[q][i].id+" instead of "+one[q][i].id+"!\n");
+	}
+}
+
+// Throws a data_error from one of its parts.
+struct failing_job : public worker_pool::job {
+	virtual void run(unsigned int part) { if (part == 2) throw imgdb::data_error("Bad data."); }
+};
+
+void thread_test() {
+	fprintf(stderr, "Checking worker pool errors... ");
+	worker_pool pool(3);
+	failing_job job;
+	try {
+		pool.run(job, 4);
+		throw imgdb::internal_error("\nFailed! Worker pool did not throw!\n");
+	} catch (const imgdb::data_error& e) {
+	}
+	fprintf(stderr, "OK.\n");
+
+	imgdb::queryArg_list queries = big_query_list();
+	const char* modes[] = { "simple", "readonly" };
+	for (int m = 0; m < 2; m++) {
+		fprintf(stderr, "Comparing queries with 1 and 4 threads in %s mode... ", modes[m]);
+		imgdb::dbSpace::setQueryThreads(1);
+		imgdb::dbSpace* db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_from_name(modes[m]));
+		imgdb::sim_vector_list serial = query_each(db, queries);
+		imgdb::dbSpace::setQueryThreads(4);
+		compare_results("4 query threads", serial, query_each(db, queries));
+		imgdb::dbSpace::setQueryThreads(1);
+		delete db;
+		fprintf(stderr, "OK.\n");
+	}
+}
+
+void batch_test() {
+	// Three times the queries, so that normal mode runs them in two parts.
+	imgdb::queryArg_list queries = big_query_list(), more;
+	for (int i = 0; i < 3; i++) more.insert(more.end(), queries.begin(), queries.end());
+
+	const char* modes[] = { "simple", "normal" };
+	for (int m = 0; m < 2; m++) {
+		fprintf(stderr, "Comparing batch and single queries in %s mode... ", modes[m]);
+		imgdb::dbSpace::setQueryTile(8192);
+		imgdb::dbSpace* db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_from_name(modes[m]));
+		imgdb::sim_vector_list single = query_each(db, more);
+		compare_results("Batch query", single, db->queryImgBatch(more));
+		imgdb::dbSpace::setQueryTile(65536);
+		delete db;
+		fprintf(stderr, "OK.\n");
+	}
+}
+
+// Layout of the query index in a version 10 DB file, see imglib.h.
+struct index_header {
+	uint64_t images, word_size, info, buckets, words, seek, length;
+};
+struct index_bucket {
+	uint64_t size, words, num_words, seek, num_seek;
+};
+
+std::string read_file(const char* name) {
+	std::string contents;
+	FILE* f = fopen(name, "rb");
+	if (!f) throw imgdb::io_error(S"Can't open "+name+".");
+	char buf[65536];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0) contents.append(buf, len);
+	fclose(f);
+	return contents;
+}
+
+void write_file(const char* name, const std::string& contents) {
+	FILE* f = fopen(name, "wb");
+	if (!f || fwrite(contents.data(), 1, contents.size(), f) != contents.size() || fclose(f))
+		throw imgdb::io_error(S"Can't write "+name+".");
+}
+
+void expect_data_error(const char* name, const char* what) {
+	try {
+		delete imgdb::dbSpace::load_file(name, imgdb::dbSpace::mode_simple);
+	} catch (const imgdb::data_error& e) {
+		return;
+	}
+	throw imgdb::internal_error(S"\nFailed! Loading a DB with "+what+" did not throw a data_error!\n");
+}
+
+void index_test() {
+	static const char* index_fn = "test-db-index.idb";
+	imgdb::queryArg_list queries = big_query_list();
+
+	fprintf(stderr, "Saving with query index... ");
+	imgdb::dbSpace* db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_normal);
+	db->save_file(index_fn);
+	delete db;
+	fprintf(stderr, "OK.\n");
+
+	const char* modes[] = { "simple", "readonly" };
+	for (int m = 0; m < 2; m++) {
+		fprintf(stderr, "Comparing queries with and without query index in %s mode... ", modes[m]);
+		db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_from_name(modes[m]));
+		imgdb::sim_vector_list built = query_each(db, queries);
+		delete db;
+		db = imgdb::dbSpace::load_file(index_fn, imgdb::dbSpace::mode_from_name(modes[m]));
+		compare_results("Query index", built, query_each(db, queries));
+		delete db;
+		fprintf(stderr, "OK.\n");
+	}
+
+	fprintf(stderr, "Loading corrupted query indices... ");
+	std::string contents = read_file(index_fn);
+	size_t offset = contents.size() & ~(size_t) 4095;
+	const index_header* hdr = NULL;
+	for (; offset; offset -= 4096) {
+		hdr = (const index_header*) (contents.data() + offset);
+		if (hdr->images == (uint64_t) big_images && hdr->info == sizeof(index_header) && offset + hdr->length == contents.size()) break;
+	}
+	if (!offset) throw imgdb::internal_error("\nFailed! Query index not found!\n");
+
+	std::string broken = contents.substr(0, contents.size() - sizeof(size_t));
+	write_file(index_fn, broken);
+	expect_data_error(index_fn, "a truncated query index");
+
+	broken = contents;
+	((index_bucket*) &broken[offset + hdr->buckets])->num_words = 1;
+	write_file(index_fn, broken);
+	expect_data_error(index_fn, "a corrupted query index bucket");
+
+	broken = contents;
+	((index_header*) &broken[offset])->seek = hdr->words - 1;
+	write_file(index_fn, broken);
+	expect_data_error(index_fn, "a corrupted query index header");
+
+	unlink(index_fn);
+	fprintf(stderr, "OK.\n");
+}
+
+// Add copies of the images the queries were made from and some random
+// ones, then remove half of the originals, some others and some of the
+// copies. Returns the number of images left removed.
+size_t change_big_db(imgdb::dbSpace* db) {
+	size_t removed = 0;
+	for (int q = 0; q < big_queries; q++) {
+		imgdb::ImgData* img = random_image(1 + q * (big_images / big_queries));
+		img->id = big_images + 1 + q;
+		db->addImageData(img);
+	}
+	for (int i = big_images + big_queries + 1; i <= big_images + 500; i++)
+		db->addImageData(random_image(i));
+	for (int q = 0; q < big_queries; q += 2, removed++)
+		db->removeImage(1 + q * (big_images / big_queries));
+	for (int i = 7; i <= big_images; i += 233, removed++)
+		db->removeImage(i);
+	for (int i = big_images + 3; i <= big_images + 500; i += 50, removed++)
+		db->removeImage(i);
+	return removed;
+}
+
+// Results of the queries in a freshly loaded DB with these changes.
+imgdb::sim_vector_list changed_results(const imgdb::queryArg_list& queries) {
+	static const char* fresh_fn = "test-db-fresh.idb";
+	imgdb::dbSpace* db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_normal);
+	change_big_db(db);
+	db->save_file(fresh_fn);
+	delete db;
+	db = imgdb::dbSpace::load_file(fresh_fn, imgdb::dbSpace::mode_simple);
+	imgdb::sim_vector_list fresh = query_each(db, queries);
+	delete db;
+	unlink(fresh_fn);
+	return fresh;
+}
+
+void compact_test() {
+	imgdb::queryArg_list queries = big_query_list();
+	imgdb::sim_vector_list fresh = changed_results(queries);
+	imgdb::dbSpace* db;
+
+	const char* modes[] = { "simple", "readonly" };
+	for (int m = 0; m < 2; m++) {
+		fprintf(stderr, "Compacting changes in %s mode... ", modes[m]);
+		db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_from_name(modes[m]));
+		size_t arena = db->getArenaSize();
+#if defined(USE_DELTA_QUEUE) && !defined(USE_BLOCK_QUEUE)
+		if (!arena) throw imgdb::internal_error("\nFailed! Buckets not loaded into an arena!\n");
+#endif
+		change_big_db(db);
+		if (!db->getDeltaCount()) throw imgdb::internal_error("\nFailed! No delta segment after changes!\n");
+		compare_results("Delta segment", fresh, query_each(db, queries));
+
+		if (db->compact(20000)) throw imgdb::internal_error("\nFailed! Compacted all buckets at once!\n");
+		if (db->getArenaSize() != arena) throw imgdb::internal_error("\nFailed! Arena released while buckets still use it!\n");
+		compare_results("Partial compaction", fresh, query_each(db, queries));
+
+		while (!db->compact(20000)) ;
+		if (db->getDeltaCount()) throw imgdb::internal_error(S"\nFailed! Delta segment still has "+db->getDeltaCount()+" images after compacting!\n");
+		if (db->getArenaSize()) throw imgdb::internal_error(S"\nFailed! Arena still has "+db->getArenaSize()+" bytes after compacting!\n");
+		compare_results("Compaction", fresh, query_each(db, queries));
+		delete db;
+		fprintf(stderr, "OK.\n");
+	}
+}
+
+void purge_test() {
+	imgdb::queryArg_list queries = big_query_list();
+	imgdb::sim_vector_list fresh = changed_results(queries);
+
+	const char* modes[] = { "simple", "readonly", "normal" };
+	for (int m = 0; m < 3; m++) {
+		fprintf(stderr, "Purging deleted images in %s mode... ", modes[m]);
+		imgdb::dbSpace* db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_from_name(modes[m]));
+		size_t removed = change_big_db(db);
+		if (db->getDeletedCount() != removed)
+			throw imgdb::internal_error(S"\nFailed! "+db->getDeletedCount()+" images deleted instead of "+removed+"!\n");
+
+		db->purge();
+		if (db->getDeletedCount() || db->getDeltaCount())
+			throw imgdb::internal_error("\nFailed! Deleted or delta images left after purging!\n");
+		if (db->getArenaSize()) throw imgdb::internal_error(S"\nFailed! Arena still has "+db->getArenaSize()+" bytes after purging!\n");
+		if (db->getImgCount() != big_images + 500 - removed)
+			throw imgdb::internal_error(S"\nFailed! "+db->getImgCount()+" images left after purging instead of "+(big_images + 500 - removed)+"!\n");
+		// Normal mode needs to rebuild the buckets after removing images.
+		if (m == 2) db->rehash();
+		compare_results("Purging", fresh, query_each(db, queries));
+
+		// Changes after purging work as before.
+		db->addImageData(random_image(big_images + 1000));
+		db->removeImage(big_images + 1000);
+		if (m == 2) db->rehash();
+		compare_results("Change after purging", fresh, query_each(db, queries));
+		delete db;
+		fprintf(stderr, "OK.\n");
+	}
+}
+
+void prune_test() {
+	imgdb::queryArg_list exact = big_query_list(), pruned = big_query_list(imgdb::dbSpace::flag_prune);
+	const char* modes[] = { "simple", "readonly" };
+	for (int m = 0; m < 2; m++) {
+		fprintf(stderr, "Comparing pruned and exact queries in %s mode... ", modes[m]);
+		imgdb::dbSpace::setQueryTile(8192);
+		imgdb::dbSpace* db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_from_name(modes[m]));
+		compare_results("Pruned query", query_each(db, exact), query_each(db, pruned));
+		compare_results("Pruned batch query", query_each(db, exact), db->queryImgBatch(pruned));
+		imgdb::dbSpace::setQueryTile(65536);
+		delete db;
+		fprintf(stderr, "OK.\n");
+	}
+}
+
+void rerank_test() {
+	// Without limits, every image that has any coefficient of the query is
+	// a candidate and scored from its signature.
+	imgdb::queryArg_list exact = big_query_list(), reranked = big_query_list(imgdb::dbSpace::flag_rerank);
+	const char* modes[] = { "normal", "readonly" };
+	for (int m = 0; m < 2; m++) {
+		fprintf(stderr, "Comparing reranked and full queries in %s mode... ", modes[m]);
+		imgdb::dbSpace::setRerank(~size_t(), 1e9);
+		imgdb::dbSpace* db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_from_name(modes[m]));
+		compare_results("Reranked query", query_each(db, exact), query_each(db, reranked));
+		compare_results("Reranked batch query", query_each(db, exact), db->queryImgBatch(reranked));
+		imgdb::dbSpace::setRerank(256, 0.25);
+		delete db;
+		fprintf(stderr, "OK.\n");
+	}
+
+	static const char* small_fn = "test-db-small.idb";
+	fprintf(stderr, "Comparing reranked and full queries without common coefficients... ");
+	unlink(small_fn);
+	imgdb::dbSpace* db = imgdb::dbSpace::load_file(small_fn, imgdb::dbSpace::mode_normal);
+	for (int i = 1; i <= 3; i++)
+		db->addImageData(random_image(i));
+	db->save_file(small_fn);
+	delete db;
+
+	// The query has none of the coefficients of the images, so all its buckets are empty.
+	imgdb::ImgData query = *random_image(4);
+	Idx* sigs[3] = { query.sig1, query.sig2, query.sig3 };
+	for (int c = 0; c < 3; c++) {
+		Idx coef = 1;
+		for (int i = 0; i < NUM_COEFS; i++, coef++) {
+			for (int k = 1; k <= 3; k++) {
+				imgdb::ImgData* img = random_image(k);
+				Idx* img_sigs[3] = { img->sig1, img->sig2, img->sig3 };
+				if (std::find(img_sigs[c], img_sigs[c] + NUM_COEFS, coef) != img_sigs[c] + NUM_COEFS) { coef++; k = 0; }
+			}
+			sigs[c][i] = coef;
+		}
+	}
+
+	db = imgdb::dbSpace::load_file(small_fn, imgdb::dbSpace::mode_simple);
+	imgdb::sim_vector_list full(1, db->queryImg(imgdb::queryArg(query, 16, 0)));
+	compare_results("Reranked query", full, imgdb::sim_vector_list(1, db->queryImg(imgdb::queryArg(query, 16, imgdb::dbSpace::flag_rerank))));
+	delete db;
+	unlink(small_fn);
+	fprintf(stderr, "OK.\n");
+}
+
+// Like compare_results, but images with equal scores may be in any order,
+// and the last ones of a list may be others with the same score.
+void compare_unordered(const char* what, const imgdb::sim_vector_list& one, const imgdb::sim_vector_list& two) {
+	if (one.size() != two.size()) throw imgdb::internal_error(S"\nFailed! "+what+" returned "+two.size()+" result lists, not "+one.size()+"!\n");
+	for (size_t q = 0; q < one.size(); q++) {
+		if (one[q].empty() || one[q].size() != two[q].size())
+			throw imgdb::internal_error(S"\nFailed! "+what+" returned "+two[q].size()+" results for query "+q+", not "+one[q].size()+"!\n");
+		for (size_t i = 0, end; i < one[q].size(); i = end) {
+			for (end = i; end < one[q].size() && one[q][end].score == one[q][i].score; end++)
+				if (two[q][end].score != one[q][i].score)
+					throw imgdb::internal_error(S"\nFailed! "+what+" differs in score "+end+" of query "+q+"!\n");
+			if (end == one[q].size()) break;
+
+			std::vector<imgdb::imageId> ids1, ids2;
+			for (size_t k = i; k < end; k++) {
+				ids1.push_back(one[q][k].id);
+				ids2.push_back(two[q][k].id);
+			}
+			std::sort(ids1.begin(), ids1.end());
+			std::sort(ids2.begin(), ids2.end());
+			if (ids1 != ids2)
+				throw imgdb::internal_error(S"\nFailed! "+what+" differs in results "+i+" to "+end+" of query "+q+"!\n");
+		}
+	}
+}
+
+void shard_test() {
+	imgdb::queryArg_list queries = big_query_list();
+	const char* modes[] = { "simple", "readonly" };
+	for (int m = 0; m < 2; m++) {
+		fprintf(stderr, "Comparing queries with and without shards in %s mode... ", modes[m]);
+		imgdb::dbSpace* db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_from_name(modes[m]));
+		imgdb::sim_vector_list single = query_each(db, queries);
+		delete db;
+
+		std::string sharded = std::string(modes[m]) + ":3";
+		db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_from_name(sharded.c_str()));
+		compare_unordered("Sharded query", single, query_each(db, queries));
+		compare_unordered("Sharded batch query", single, db->queryImgBatch(queries));
+
+		// Changes go to one of the shards each.
+		change_big_db(db);
+		imgdb::sim_vector_list fresh = changed_results(queries);
+		compare_unordered("Changed sharded query", fresh, query_each(db, queries));
+		delete db;
+		fprintf(stderr, "OK.\n");
+	}
+}
+
+void load_test() {
+	imgdb::queryArg_list queries = big_query_list();
+	const char* modes[] = { "simple", "readonly" };
+	for (int m = 0; m < 2; m++) {
+		fprintf(stderr, "Comparing buckets loaded with 1 and 4 threads in %s mode... ", modes[m]);
+		imgdb::dbSpace::setQueryThreads(1);
+		imgdb::dbSpace* db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_from_name(modes[m]));
+		imgdb::stats_t stats = db->getCoeffStats();
+		imgdb::sim_vector_list serial = query_each(db, queries);
+		delete db;
+
+		imgdb::dbSpace::setQueryThreads(4);
+		db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_from_name(modes[m]));
+		imgdb::dbSpace::setQueryThreads(1);
+		if (db->getCoeffStats() != stats) throw imgdb::internal_error("\nFailed! Bucket sizes differ when loading with threads!\n");
+		compare_results("Loading with threads", serial, query_each(db, queries));
+		delete db;
+		fprintf(stderr, "OK.\n");
+	}
+}
+
+// Adds an image in alter mode and returns the inode of the DB file
+// afterwards, checking that the file kept its mode.
+ino_t alter_add(const char* fn, int id) {
+	imgdb::dbSpace* db = imgdb::dbSpace::load_file(fn, imgdb::dbSpace::mode_alter);
+	db->addImageData(random_image(id));
+	delete db;
+
+	struct stat st;
+	if (stat(fn, &st)) throw imgdb::io_error(S"\nFailed! Cannot stat "+fn+"!\n");
+	if ((st.st_mode & 07777) != 0640) throw imgdb::internal_error(S"\nFailed! Mode of "+fn+" changed!\n");
+	return st.st_ino;
+}
+
+void alter_test() {
+	static const char* alter_fn = "test-db-alter.idb";
+
+	fprintf(stderr, "Altering a DB with query index... ");
+	imgdb::dbSpace* db = imgdb::dbSpace::load_file(big_fn, imgdb::dbSpace::mode_normal);
+	db->save_file(alter_fn);
+	delete db;
+	chmod(alter_fn, 0640);
+
+	struct stat st;
+	if (stat(alter_fn, &st)) throw imgdb::io_error(S"\nFailed! Cannot stat "+alter_fn+"!\n");
+	ino_t copied = alter_add(alter_fn, big_images + 1);
+	if (copied == st.st_ino) throw imgdb::internal_error("\nFailed! DB with query index was changed in place!\n");
+	fprintf(stderr, "OK.\n");
+
+	fprintf(stderr, "Altering a DB without query index... ");
+	if (alter_add(alter_fn, big_images + 2) != copied) throw imgdb::internal_error("\nFailed! DB without query index was copied!\n");
+	db = imgdb::dbSpace::load_file(alter_fn, imgdb::dbSpace::mode_simple);
+	if (db->getImgCount() != (size_t) big_images + 2) throw imgdb::internal_error(S"\nFailed! Altered DB has "+db->getImgCount()+" images!\n");
+	delete db;
+	fprintf(stderr, "OK.\n");
+
+	// Changing the file in place must not change the signatures of a DB
+	// that was loaded from it before.
+	fprintf(stderr, "Altering a DB loaded in read-only mode... ");
+	db = imgdb::dbSpace::load_file(alter_fn, imgdb::dbSpace::mode_readonly);
+	imgdb::queryArg_list loaded;
+	for (int id = 1; id <= 200; id++)
+		loaded.push_back(imgdb::queryArg(db, id, 1, 0));
+
+	imgdb::dbSpace* alter = imgdb::dbSpace::load_file(alter_fn, imgdb::dbSpace::mode_alter);
+	alter->removeImage(2);
+	alter->save_file(alter_fn);
+	delete alter;
+
+	for (int id = 1; id <= 200; id++) {
+		imgdb::queryArg query(db, id, 1, 0);
+		if (memcmp(query.sig, loaded[id - 1].sig, sizeof(query.sig)) || memcmp(query.avgl, loaded[id - 1].avgl, sizeof(query.avgl)))
+			throw imgdb::internal_error(S"\nFailed! Signature of image "+id+" changed with the DB file!\n");
+	}
+	delete db;
+	fprintf(stderr, "OK.\n");
+}
+
 #define CHECK(range, mode) docheck(range, imgdb::dbSpace::mode_ ## mode, #mode, removed)
 #define DELETE(i) \
 	{ fprintf(stderr, "-%lld ", (long long) i); \
@@ -144,6 +744,8 @@ void query(imgdb::dbSpace* db, unsigned int id, const deleted_t& removed) {
 
 int main() {
 	DeltaTest::test();
+	block_test();
+	scratch_test();
 
 	deleted_t removed;
 	imgdb::dbSpace::imgDataFromFile("test.jpg", 0, &org);
@@ -217,5 +819,19 @@ int main() {
 	DELETE(2103);
 	ADD(2103);removed.erase(2103);
 	query(db, 2103, removed); query(db, 2104, removed);
-	fprintf(stderr, "\nDone!\n");
+	fprintf(stderr, "\n");
+	delete db;
+
+	create_big_db();
+	thread_test();
+	batch_test();
+	index_test();
+	compact_test();
+	purge_test();
+	prune_test();
+	rerank_test();
+	shard_test();
+	load_test();
+	alter_test();
+	fprintf(stderr, "Done!\n");
 }
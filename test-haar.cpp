@@ -0,0 +1,172 @@
+// Little program to check that all Haar transform implementations give
+// the same results. Compile with "make test-haar" and run it with any
+// number of image files, which are compared by their signatures. It
+// also compares the full transforms of random, flat and blocky images,
+// and their signatures with those of the original priority queue
+// implementation, then prints how long each of them takes.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "auto_clean.h"
+#include "haar.h"
+#include "imgdb.h"
+
+int debug_level = 0;
+
+static const char* impls[] = { "scalar", "sse2", "avx2" };
+static const int num_impls = sizeof(impls) / sizeof(impls[0]);
+
+static double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The original get_m_largests, with a std::priority_queue.
+static void reference_largests(Unit *cdata, Idx *sig) {
+	int cnt, i;
+	valStruct val;
+	valqueue vq;
+
+	for (i = 1; i < NUM_COEFS+1; i++) {
+		val.i = i;
+		val.d = ABS(cdata[i]);
+		vq.push(val);
+	}
+
+	for (; i < NUM_PIXELS_SQUARED; i++) {
+		val.d = ABS(cdata[i]);
+		if (val.d > vq.top().d) {
+			vq.pop();
+			val.i = i;
+			vq.push(val);
+		}
+	}
+
+	cnt = 0;
+	do {
+		int t;
+		val = vq.top();
+		t = (cdata[val.i] <= 0);
+		sig[cnt++] = (val.i - t) ^ -t;
+		vq.pop();
+	} while (!vq.empty());
+}
+
+// Compare the signatures of a transform, including their order.
+static bool check_sigs(Unit* cdata) {
+	Idx expected[3][NUM_COEFS];
+	for (int c = 0; c < 3; c++)
+		reference_largests(cdata + c * NUM_PIXELS_SQUARED, expected[c]);
+
+	bool ok = true;
+	for (int i = 0; i < num_impls; i++) {
+		if (!haarUse(impls[i])) continue;
+
+		Idx sig[3][NUM_COEFS];
+		double avgl[3];
+		calcHaar(cdata, cdata + NUM_PIXELS_SQUARED, cdata + 2 * NUM_PIXELS_SQUARED, sig[0], sig[1], sig[2], avgl);
+		if (memcmp(sig, expected, sizeof(sig))) {
+			fprintf(stderr, "%s computed a different signature!\n", impls[i]);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// Transform the RGB data and compare all coefficients with the first implementation.
+static bool check_transform(const unsigned char* rgb, Unit* expected) {
+	AutoCleanArray<unsigned char> chan(3 * NUM_PIXELS_SQUARED);
+	AutoCleanArray<Unit> data(3 * NUM_PIXELS_SQUARED);
+	bool ok = true;
+	for (int i = 0; i < num_impls; i++) {
+		if (!haarUse(impls[i])) continue;
+
+		memcpy(chan.ptr(), rgb, 3 * NUM_PIXELS_SQUARED);
+		Unit* cdata = i ? data.ptr() : expected;
+		transformChar(chan.ptr(), chan.ptr() + NUM_PIXELS_SQUARED, chan.ptr() + 2 * NUM_PIXELS_SQUARED,
+			      cdata, cdata + NUM_PIXELS_SQUARED, cdata + 2 * NUM_PIXELS_SQUARED);
+		if (i && memcmp(cdata, expected, 3 * NUM_PIXELS_SQUARED * sizeof(Unit))) {
+			fprintf(stderr, "%s computed a different transform!\n", impls[i]);
+			ok = false;
+		}
+	}
+	return ok && check_sigs(expected);
+}
+
+int main(int argc, char** argv) {
+	int failed = 0;
+
+	AutoCleanArray<unsigned char> rgb(3 * NUM_PIXELS_SQUARED);
+	AutoCleanArray<Unit> expected(3 * NUM_PIXELS_SQUARED);
+	srand(1);
+	for (int n = 0; n < 200; n++) {
+		// Blocky images have many coefficients of equal magnitude.
+		int block = n < 2 ? NUM_PIXELS : n < 40 ? 1 << (n % 7) : 1;
+		for (int c = 0; c < 3; c++)
+			for (int y = 0; y < NUM_PIXELS; y++)
+				for (int x = 0; x < NUM_PIXELS; x++) {
+					unsigned char& p = rgb[c * NUM_PIXELS_SQUARED + y * NUM_PIXELS + x];
+					if (n < 2) p = n * 255;
+					else if (x % block || y % block) p = rgb[c * NUM_PIXELS_SQUARED + y / block * block * NUM_PIXELS + x / block * block];
+					else p = n < 20 ? (rand() & 1) * 255 : rand() % 256;
+				}
+		failed += !check_transform(rgb.ptr(), expected.ptr());
+	}
+	printf("Compared 200 random images.\n");
+
+	for (int f = 1; f < argc; f++) {
+		imgdb::ImgData sig, expected;
+		memset(&sig, 0, sizeof(sig));
+		memset(&expected, 0, sizeof(expected));
+		for (int i = 0; i < num_impls; i++) {
+			if (!haarUse(impls[i])) continue;
+
+			try {
+				imgdb::dbSpace::imgDataFromFile(argv[f], 0, i ? &sig : &expected);
+			} catch (const imgdb::base_error& err) {
+				fprintf(stderr, "%s: %s %s\n", argv[f], err.type(), err.what());
+				break;
+			}
+			if (i && memcmp(&sig, &expected, sizeof(sig))) {
+				fprintf(stderr, "%s: %s computed a different signature!\n", argv[f], impls[i]);
+				failed++;
+			}
+		}
+	}
+	if (argc > 1) printf("Compared %d image files.\n", argc - 1);
+
+	// Time per image: transform, then finding the largest coefficients.
+	AutoCleanArray<Unit> cdata(3 * NUM_PIXELS_SQUARED);
+	Idx sig[3][NUM_COEFS];
+	double avgl[3];
+	double start = seconds();
+	for (int n = 0; n < 1000; n++)
+		for (int c = 0; c < 3; c++)
+			reference_largests(expected.ptr() + c * NUM_PIXELS_SQUARED, sig[c]);
+	printf("  %-8s %8s    %8.2f us per image\n", "queue", "", (seconds() - start) * 1000);
+
+	for (int i = 0; i < num_impls; i++) {
+		if (!haarUse(impls[i])) {
+			printf("  %-8s not supported\n", impls[i]);
+			continue;
+		}
+
+		start = seconds();
+		for (int n = 0; n < 1000; n++)
+			transformChar(rgb.ptr(), rgb.ptr() + NUM_PIXELS_SQUARED, rgb.ptr() + 2 * NUM_PIXELS_SQUARED,
+				      cdata.ptr(), cdata.ptr() + NUM_PIXELS_SQUARED, cdata.ptr() + 2 * NUM_PIXELS_SQUARED);
+		double transform = seconds() - start;
+
+		start = seconds();
+		for (int n = 0; n < 1000; n++)
+			calcHaar(cdata.ptr(), cdata.ptr() + NUM_PIXELS_SQUARED, cdata.ptr() + 2 * NUM_PIXELS_SQUARED, sig[0], sig[1], sig[2], avgl);
+		printf("  %-8s %8.2f us %8.2f us per image\n", impls[i], transform * 1000, (seconds() - start) * 1000);
+	}
+
+	printf("%s\n", failed ? "FAILED" : "All implementations give the same results.");
+	return failed != 0;
+}
@@ -0,0 +1,175 @@
+/***************************************************************************\
+    worker_pool.cpp - Fixed set of threads to split up work into parts.
+
+    Copyright (C) 2008 piespy@gmail.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+\**************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#include "debug.h"
+#include "imgdb.h"
+#include "worker_pool.h"
+
+extern int debug_level;
+
+worker_pool::worker_pool(unsigned int threads) : m_quit(false) {
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_ready, NULL);
+	pthread_cond_init(&m_done, NULL);
+
+	m_threads.reserve(threads);
+	while (threads--) {
+		pthread_t thread;
+		if (int err = pthread_create(&thread, NULL, &thread_main, this)) {
+			DEBUG(warnings)("WARNING: Can't create worker thread, using only %zd: %s\n", m_threads.size(), strerror(err));
+			break;
+		}
+		m_threads.push_back(thread);
+	}
+}
+
+worker_pool::~worker_pool() {
+	pthread_mutex_lock(&m_lock);
+	m_quit = true;
+	pthread_cond_broadcast(&m_ready);
+	pthread_mutex_unlock(&m_lock);
+
+	for (std::vector<pthread_t>::iterator itr = m_threads.begin(); itr != m_threads.end(); ++itr)
+		pthread_join(*itr, NULL);
+
+	pthread_cond_destroy(&m_done);
+	pthread_cond_destroy(&m_ready);
+	pthread_mutex_destroy(&m_lock);
+}
+
+void* worker_pool::thread_main(void* pool) {
+	((worker_pool*)pool)->work();
+	return NULL;
+}
+
+// Hand out the next part of the task, and take it off the queue once
+// all of its parts are being worked on. Must hold m_lock.
+inline unsigned int worker_pool::next_part(task* t) {
+	unsigned int part = t->m_next++;
+	if (t->m_next == t->m_parts) {
+		task_list::iterator itr = std::find(m_tasks.begin(), m_tasks.end(), t);
+		if (itr != m_tasks.end()) m_tasks.erase(itr);
+	}
+	return part;
+}
+
+void worker_pool::run_part(task* t, unsigned int part) {
+	const char* error = NULL;
+	const char* type = "fatal_error";
+	std::string what;
+
+	try {
+		t->m_job.run(part);
+	} catch (const imgdb::base_error& e) {
+		what = e.what();
+		error = what.c_str();
+		type = e.type();
+	} catch (const std::bad_alloc& e) {
+		error = "Out of memory in worker thread.";
+		type = "memory_error";
+	} catch (const std::exception& e) {
+		what = e.what();
+		error = what.c_str();
+	} catch (...) {
+		error = "Unknown exception in worker thread.";
+	}
+
+	if (!error) return;
+
+	pthread_mutex_lock(&m_lock);
+	if (!t->m_failed) {
+		t->m_failed = true;
+		t->m_error = error;
+		t->m_type = type;
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+void worker_pool::work() {
+	pthread_mutex_lock(&m_lock);
+	while (!m_quit) {
+		if (m_tasks.empty()) {
+			pthread_cond_wait(&m_ready, &m_lock);
+			continue;
+		}
+
+		task* t = m_tasks.front();
+		unsigned int part = next_part(t);
+
+		pthread_mutex_unlock(&m_lock);
+		run_part(t, part);
+		pthread_mutex_lock(&m_lock);
+
+		if (++t->m_done == t->m_parts)
+			pthread_cond_broadcast(&m_done);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+void worker_pool::run(job& j, unsigned int parts) {
+	if (!parts) return;
+
+	task t(j, parts);
+
+	pthread_mutex_lock(&m_lock);
+	if (parts > 1 && !m_threads.empty()) {
+		m_tasks.push_back(&t);
+		pthread_cond_broadcast(&m_ready);
+	}
+
+	// Work on our own task too instead of just waiting.
+	while (t.m_next < t.m_parts) {
+		unsigned int part = next_part(&t);
+
+		pthread_mutex_unlock(&m_lock);
+		run_part(&t, part);
+		pthread_mutex_lock(&m_lock);
+
+		t.m_done++;
+	}
+
+	while (t.m_done < t.m_parts)
+		pthread_cond_wait(&m_done, &m_lock);
+	pthread_mutex_unlock(&m_lock);
+
+	if (t.m_failed)
+		rethrow(t.m_type, t.m_error);
+}
+
+// Throw the error class named type, or its closest base that takes a message.
+void worker_pool::rethrow(const std::string& type, const std::string& error) {
+	if (type == "io_error" || type == "io_errno") throw imgdb::io_error(error);
+	if (type == "data_error") throw imgdb::data_error(error);
+	if (type == "memory_error") throw imgdb::memory_error(error);
+	if (type == "internal_error") throw imgdb::internal_error(error);
+	if (type == "usage_error") throw imgdb::usage_error(error);
+	if (type == "param_error") throw imgdb::param_error(error);
+	if (type == "image_error") throw imgdb::image_error(error);
+	if (type == "duplicate_id") throw imgdb::duplicate_id(error);
+	if (type == "invalid_id") throw imgdb::invalid_id(error);
+	if (type == "simple_error") throw imgdb::simple_error(error);
+	throw imgdb::fatal_error(error);
+}
@@ -0,0 +1,98 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+/***************************************************************************\
+    worker_pool.h - Fixed set of threads to split up work into parts.
+
+    Copyright (C) 2008 piespy@gmail.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+\**************************************************************************/
+
+/* A job is split into a number of parts which are run by the worker
+   threads as well as the thread calling run(), which returns once all
+   parts are done. Several threads may call run() at the same time, their
+   jobs are then worked on in the order they were submitted.
+
+   Example:
+   struct sum_job : public worker_pool::job {
+	virtual void run(unsigned int part) { sums[part] = sum(data + part * len, len); }
+	...
+   };
+
+   sum_job job(...);
+   pool.run(job, 8);
+
+   If any part throws an exception, the remaining parts are still run and
+   run() then throws an error of the same imgdb class with the first error
+   message, or an imgdb::fatal_error for other exceptions.
+*/
+
+#include <pthread.h>
+
+#include <list>
+#include <string>
+#include <vector>
+
+class worker_pool {
+public:
+	class job {
+	public:
+		virtual ~job() { }
+		virtual void run(unsigned int part) = 0;
+	};
+
+	// Start the given number of worker threads. With zero threads,
+	// all parts are run by the thread calling run().
+	explicit worker_pool(unsigned int threads);
+	~worker_pool();
+
+	// Number of threads working on a job, including the calling thread.
+	unsigned int size() const { return m_threads.size() + 1; }
+
+	void run(job& j, unsigned int parts);
+
+private:
+	worker_pool(const worker_pool&);
+	worker_pool& operator = (const worker_pool&);
+
+	struct task {
+		task(job& j, unsigned int p) : m_job(j), m_parts(p), m_next(0), m_done(0), m_failed(false) { }
+
+		job& m_job;
+		unsigned int m_parts;
+		unsigned int m_next;
+		unsigned int m_done;
+		bool m_failed;
+		std::string m_error;
+		std::string m_type;
+	};
+	typedef std::list<task*> task_list;
+
+	static void* thread_main(void* pool);
+	void work();
+	void run_part(task* t, unsigned int part);
+	unsigned int next_part(task* t);
+	static void rethrow(const std::string& type, const std::string& error);
+
+	std::vector<pthread_t> m_threads;
+	task_list m_tasks;
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_ready;		// signalled when a task is queued, or when quitting
+	pthread_cond_t m_done;		// signalled when a task has all its parts done
+	bool m_quit;
+};
+
+#endif // WORKER_POOL_H